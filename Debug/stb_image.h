@@ -522,6 +522,22 @@ STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpre
 STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+// optionally split decoding across threads. func must call task(task_data, i) for every i in
+// [0,count), in any order, and return once all calls are done; it may be called from several
+// decoding threads at once. output is identical to the single-threaded path. pass NULL (the
+// default) to turn it off.
+//   JPEG: IDCT, upsampling and color conversion run as bands of MCU rows, and baseline scans
+//         from memory with restart markers also entropy-decode one restart interval per task
+//   PNG:  inflate and unfiltering run as a two-stage pipeline, and zlib streams written with
+//         full flushes inflate one flushed section per task
+typedef void stbi_parallel_for(void *user, int count, void (*task)(void *task_data, int index), void *task_data);
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for *func, void *user);
+
+// cap the instruction set used by the JPEG kernels: 0 = portable C, 1 = SSE2/NEON, 2 = AVX2.
+// the default uses the best the CPU supports. meant for benchmarking, since every level
+// produces the same output
+STBIDEF void stbi_set_jpeg_simd_limit(int level);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -748,7 +764,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -759,7 +775,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -772,6 +788,35 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 JPEG kernels are compiled next to the SSE2 ones and picked at runtime, so unlike SSE2
+// they don't need the whole file built with -mavx2. Define STBI_NO_AVX2 to leave them out.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2) && !defined(STBI_NO_JPEG) && \
+    ((defined(_MSC_VER) && _MSC_VER >= 1800) || (defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))))
+#define STBI_AVX2
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#define STBI__AVX2_TARGET
+static int stbi__avx2_available(void)
+{
+   int info[4];
+   __cpuid(info, 0);
+   if (info[0] < 7) return 0;
+   __cpuid(info, 1);
+   // the OS has to save the upper halves of the YMM registers too
+   if (!((info[2] >> 27) & 1) || (_xgetbv(0) & 6) != 6) return 0;
+   __cpuidex(info, 7, 0);
+   return (info[1] >> 5) & 1;
+}
+#else
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+static int stbi__avx2_available(void)
+{
+   return __builtin_cpu_supports("avx2");
+}
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -901,6 +946,7 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int flipped;     // loader already stored the rows bottom-up, so skip the vertical flip pass
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -1132,6 +1178,22 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+static stbi_parallel_for *stbi__parallel_for = NULL;
+static void *stbi__parallel_for_user = NULL;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for *func, void *user)
+{
+   stbi__parallel_for = func;
+   stbi__parallel_for_user = user;
+}
+
+static int stbi__jpeg_simd_limit = 2;
+
+STBIDEF void stbi_set_jpeg_simd_limit(int level)
+{
+   stbi__jpeg_simd_limit = level;
+}
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1273,7 +1335,7 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   if (stbi__vertically_flip_on_load && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
@@ -1300,7 +1362,7 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (stbi__vertically_flip_on_load && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1988,12 +2050,16 @@ typedef struct
    int            jfif;
    int            app14_color_transform; // Adobe APP14 tag
    int            rgb;
+   int            flip_output; // write output rows bottom-up for stbi_set_flip_vertically_on_load
+   stbi_parallel_for *parallel_for; // non-NULL: baseline scans keep coefficients, idct/convert run in bands
+   void          *parallel_for_user;
 
    int scan_n, order[4];
    int restart_interval, todo;
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_block_pair_kernel)(stbi_uc *out, int out_stride, short data[128]); // optional, two blocks side by side
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
@@ -2702,6 +2768,197 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// avx2 version of stbi__idct_simd for two horizontally adjacent blocks: block 0 sits in the low
+// 128-bit lane of every register and block 1 in the high lane. every step is lane-local, so
+// each lane does exactly what the sse2 version does and the output is identical.
+static STBI__AVX2_TARGET void stbi__idct_avx2_pair(stbi_uc *out, int out_stride, short data[128])
+{
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_set1_epi32((int) (((unsigned int) (unsigned short) (y) << 16) | (unsigned short) (x)))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   // row k of block 0 in the low lane, row k of block 1 in the high lane
+   #define dct_load(k) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (data + (k)*8))), \
+                              _mm_load_si128((const __m128i *) (data + 64 + (k)*8)), 1)
+
+   // the two lanes of p hold rows r and r+1 of each block; both blocks' rows are contiguous in out
+   #define dct_store2(p) \
+      { \
+         __m128i lo = _mm256_castsi256_si128(p); \
+         __m128i hi = _mm256_extracti128_si256(p, 1); \
+         _mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi64(lo, hi)); out += out_stride; \
+         _mm_storeu_si128((__m128i *) out, _mm_unpackhi_epi64(lo, hi)); out += out_stride; \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m256i p0 = _mm256_packus_epi16(row0, row1);
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      // transpose pass 2
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
+
+      // transpose pass 3
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      // store
+      dct_store2(p0);
+      dct_store2(p2);
+      dct_store2(p1);
+      dct_store2(p3);
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+#undef dct_store2
+}
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2944,67 +3201,195 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// parallel decoding: work is split into contiguous bands of rows (MCU rows, or restart
+// intervals) that run as independent tasks through the installed stbi_parallel_for
+#define STBI__JPEG_MAX_TASKS 64
+
+typedef int (*stbi__jpeg_band_func)(stbi__jpeg *z, void *data, int r0, int r1);
+
+typedef struct
+{
+   stbi__jpeg *z;
+   void *data;
+   stbi__jpeg_band_func band;
+   int rows, tasks;
+   int ok[STBI__JPEG_MAX_TASKS]; // one slot per task so workers never share a write
+} stbi__jpeg_bands;
+
+static void stbi__jpeg_band_task(void *task_data, int index)
+{
+   stbi__jpeg_bands *b = (stbi__jpeg_bands *) task_data;
+   b->ok[index] = b->band(b->z, b->data, b->rows * index / b->tasks, b->rows * (index+1) / b->tasks);
+}
+
+// run band() over [0,rows); returns 0 if any band failed
+static int stbi__jpeg_run_bands(stbi__jpeg *z, int rows, void *data, stbi__jpeg_band_func band)
+{
+   stbi__jpeg_bands b;
+   int i, result = 1;
+   b.tasks = rows < STBI__JPEG_MAX_TASKS ? rows : STBI__JPEG_MAX_TASKS;
+   if (!z->parallel_for || b.tasks <= 1)
+      return band(z, data, 0, rows);
+   b.z = z;
+   b.data = data;
+   b.band = band;
+   b.rows = rows;
+   z->parallel_for(z->parallel_for_user, b.tasks, stbi__jpeg_band_task, &b);
+   for (i=0; i < b.tasks; ++i)
+      result &= b.ok[i];
+   return result;
+}
+
+// decode one block of a baseline scan; with a parallel path the dequantized coefficients are
+// kept for stbi__jpeg_finish, otherwise the block goes straight through the idct
+stbi_inline static int stbi__jpeg_decode_baseline_block(stbi__jpeg *z, short *data, int n, int bx, int by)
+{
+   int ha = z->img_comp[n].ha;
+   if (z->parallel_for)
+      data = z->img_comp[n].coeff + 64 * (bx + by * z->img_comp[n].coeff_w);
+   if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+   if (!z->parallel_for)
+      z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*by*8+bx*8, z->img_comp[n].w2, data);
+   return 1;
+}
+
+// number of MCUs in the current scan
+static int stbi__jpeg_scan_mcus(stbi__jpeg *z)
+{
+   int n = z->order[0];
+   // non-interleaved data: every block is an MCU, and the number of blocks just depends on
+   // how many actual "pixels" this component has, independent of interleaved MCU blocking
+   if (z->scan_n == 1)
+      return ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   return z->img_mcu_x * z->img_mcu_y;
+}
+
+// decode MCU number mcu (in raster order) of the current baseline scan
+static int stbi__jpeg_decode_mcu(stbi__jpeg *z, int mcu)
+{
+   STBI_SIMD_ALIGN(short, data[64]);
+   int i,j,k,x,y;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3;
+      return stbi__jpeg_decode_baseline_block(z, data, n, mcu % w, mcu / w);
+   }
+   i = mcu % z->img_mcu_x;
+   j = mcu / z->img_mcu_x;
+   // scan an interleaved mcu... process scan_n components in order
+   for (k=0; k < z->scan_n; ++k) {
+      int n = z->order[k];
+      // scan out an mcu's worth of this component; that's just determined
+      // by the basic H and V specified for the component
+      for (y=0; y < z->img_comp[n].v; ++y)
+         for (x=0; x < z->img_comp[n].h; ++x)
+            if (!stbi__jpeg_decode_baseline_block(z, data, n, i*z->img_comp[n].h + x, j*z->img_comp[n].v + y)) return 0;
+   }
+   return 1;
+}
+
+typedef struct
+{
+   stbi_uc **start; // first entropy-coded byte of each restart interval
+   int mcus;
+} stbi__jpeg_segments;
+
+// decode restart intervals [r0,r1) on private copies of the decoder and its input cursor
+static int stbi__jpeg_decode_segments(stbi__jpeg *z, void *data, int r0, int r1)
+{
+   stbi__jpeg_segments *seg = (stbi__jpeg_segments *) data;
+   stbi__jpeg *t = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   stbi__context s;
+   int r, m, ok = 1;
+   if (!t) return stbi__err("outofmem", "Out of memory");
+   memcpy(t, z, sizeof(stbi__jpeg));
+   s = *z->s;
+   t->s = &s;
+   for (r=r0; ok && r < r1; ++r) {
+      int last = (r+1) * z->restart_interval;
+      if (last > seg->mcus) last = seg->mcus;
+      s.img_buffer = seg->start[r];
+      stbi__jpeg_reset(t);
+      for (m=r * z->restart_interval; ok && m < last; ++m)
+         ok = stbi__jpeg_decode_mcu(t, m);
+   }
+   STBI_FREE(t);
+   return ok;
+}
+
+// split a baseline scan read from memory at its restart markers and entropy-decode the
+// intervals in parallel. returns -1 when the scan can't be split (no restart interval, a
+// callback source, or markers that don't match the MCU count), so the caller falls back to
+// the serial loop, which handles those cases exactly as before
+static int stbi__jpeg_parse_entropy_parallel(stbi__jpeg *z, int mcus)
+{
+   stbi__jpeg_segments seg;
+   stbi_uc *p, *e;
+   int count, found = 1, ok, marker = STBI__MARKER_none;
+   if (!z->restart_interval || z->s->read_from_callbacks)
+      return -1;
+   count = (mcus + z->restart_interval - 1) / z->restart_interval;
+   if (count < 2)
+      return -1;
+   seg.mcus = mcus;
+   seg.start = (stbi_uc **) stbi__malloc_mad2(count, sizeof(stbi_uc *), 0);
+   if (!seg.start) return -1;
+   // walk the entropy-coded bytes the same way stbi__grow_buffer_unsafe does: 0xff 0x00 is a
+   // stuffed zero, runs of 0xff are fill, RSTn starts the next interval, anything else ends the scan
+   p = seg.start[0] = z->s->img_buffer;
+   e = z->s->img_buffer_end;
+   for (;;) {
+      int c;
+      while (p < e && *p != 0xff) ++p;
+      while (p < e && *p == 0xff) ++p;
+      if (p >= e) { found = 0; break; }
+      c = *p++;
+      if (c == 0) continue;
+      if (!STBI__RESTART(c)) {
+         marker = c;
+         break;
+      }
+      if (found == count) { found = 0; break; }
+      seg.start[found++] = p;
+   }
+   if (found != count) {
+      STBI_FREE(seg.start);
+      return -1;
+   }
+   ok = stbi__jpeg_run_bands(z, count, &seg, stbi__jpeg_decode_segments);
+   STBI_FREE(seg.start);
+   if (!ok) return stbi__err("bad huffman code", "Corrupt JPEG");
+   // leave the input where the serial loop would: just past the marker that ends the scan
+   z->s->img_buffer = p;
+   z->marker = (unsigned char) marker;
+   z->code_bits = 0;
+   z->code_buffer = 0;
+   z->nomore = 1;
+   return 1;
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
    if (!z->progressive) {
-      if (z->scan_n == 1) {
-         int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
-         int n = z->order[0];
-         // non-interleaved data, we just need to process one block at a time,
-         // in trivial scanline order
-         // number of blocks to do just depends on how many actual "pixels" this
-         // component has, independent of interleaved MCU blocking and such
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-               // every data block is an MCU, so countdown the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  // if it's NOT a restart, then just bail, so we get corrupt data
-                  // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
-            }
-         }
-         return 1;
-      } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
-                  }
-               }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
-            }
+      int m, mcus = stbi__jpeg_scan_mcus(z);
+      if (z->parallel_for) {
+         int result = stbi__jpeg_parse_entropy_parallel(z, mcus);
+         if (result >= 0) return result;
+      }
+      for (m=0; m < mcus; ++m) {
+         if (!stbi__jpeg_decode_mcu(z, m)) return 0;
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!STBI__RESTART(z->marker)) return 1;
+            stbi__jpeg_reset(z);
          }
-         return 1;
       }
+      return 1;
    } else {
       if (z->scan_n == 1) {
          int i,j;
@@ -3075,23 +3460,41 @@ static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
       data[i] *= dequant[i];
 }
 
-static void stbi__jpeg_finish(stbi__jpeg *z)
+// idct the kept coefficients of MCU rows [r0,r1); progressive data is dequantized first
+// (baseline blocks come out of stbi__jpeg_decode_block already dequantized)
+static int stbi__jpeg_finish_rows(stbi__jpeg *z, void *user, int r0, int r1)
 {
-   if (z->progressive) {
-      // dequantize and idct the data
-      int i,j,n;
-      for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+   int i,j,n;
+   STBI_NOTUSED(user);
+   for (n=0; n < z->s->img_n; ++n) {
+      int w = (z->img_comp[n].x+7) >> 3;
+      int h = (z->img_comp[n].y+7) >> 3;
+      int j1 = r1 * z->img_comp[n].v;
+      if (j1 > h) j1 = h;
+      for (j=r0 * z->img_comp[n].v; j < j1; ++j) {
+         for (i=0; i < w; ++i) {
+            short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+            stbi_uc *out = z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8;
+            // neighbouring blocks in a row are neighbours in coeff too, so they can go two at a time
+            int pair = z->idct_block_pair_kernel && i+1 < w;
+            if (z->progressive) {
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (pair) stbi__jpeg_dequantize(data + 64, z->dequant[z->img_comp[n].tq]);
             }
+            if (pair) {
+               z->idct_block_pair_kernel(out, z->img_comp[n].w2, data);
+               ++i;
+            } else
+               z->idct_block_kernel(out, z->img_comp[n].w2, data);
          }
       }
    }
+   return 1;
+}
+
+static int stbi__jpeg_finish(stbi__jpeg *z)
+{
+   return stbi__jpeg_run_bands(z, z->img_mcu_y, NULL, stbi__jpeg_finish_rows);
 }
 
 static int stbi__process_marker(stbi__jpeg *z, int m)
@@ -3337,7 +3740,7 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
          return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
-      if (z->progressive) {
+      if (z->progressive || z->parallel_for) {
          // w2, h2 are multiples of 8 (see above)
          z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
          z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
@@ -3439,8 +3842,8 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
          m = stbi__get_marker(j);
       }
    }
-   if (j->progressive)
-      stbi__jpeg_finish(j);
+   if (j->progressive || j->parallel_for)
+      return stbi__jpeg_finish(j);
    return 1;
 }
 
@@ -3815,6 +4218,158 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_AVX2
+// avx2 version of stbi__resample_row_hv_2_simd, 16 input pixels per iteration
+static STBI__AVX2_TARGET stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // need to generate 2x2 samples for every one in input
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   // the last pixel in a row is left to the scalar code below, for the filter boundary
+   for (; i < ((w-1) & ~15); i += 16) {
+      // vertical filtering pass, 3*x + y = 4*x + (y - x)
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i diff  = _mm256_sub_epi16(farw, nearw);
+      __m256i nears = _mm256_slli_epi16(nearw, 2);
+      __m256i curr  = _mm256_add_epi16(nears, diff); // current row
+
+      // "prev" and "next" are the current row shifted by one pixel across the whole register,
+      // so the pixel that crosses the 128-bit lane boundary comes from the other lane
+      __m256i prv0 = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+      __m256i nxt0 = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+      __m256i prev = _mm256_insert_epi16(prv0, t1, 0);
+      __m256i next = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+      // horizontal filter, polyphase implementation since it's convenient:
+      // even pixels = 3*cur + prev = cur*4 + (prev - cur)
+      // odd  pixels = 3*cur + next = cur*4 + (next - cur)
+      __m256i bias = _mm256_set1_epi16(8);
+      __m256i curs = _mm256_slli_epi16(curr, 2);
+      __m256i prvd = _mm256_sub_epi16(prev, curr);
+      __m256i nxtd = _mm256_sub_epi16(next, curr);
+      __m256i curb = _mm256_add_epi16(curs, bias);
+      __m256i even = _mm256_add_epi16(prvd, curb);
+      __m256i odd  = _mm256_add_epi16(nxtd, curb);
+
+      // interleave even and odd pixels, then undo scaling. the lane-wise unpack and pack
+      // leave outputs 0..15 in the low lane and 16..31 in the high lane
+      __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+      __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+      __m256i de0  = _mm256_srli_epi16(int0, 4);
+      __m256i de1  = _mm256_srli_epi16(int1, 4);
+      __m256i outv = _mm256_packus_epi16(de0, de1);
+      _mm256_storeu_si256((__m256i *) (out + i*2), outv);
+
+      // "previous" value for next iter
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+
+// avx2 version of stbi__YCbCr_to_RGB_simd, 16 pixels per iteration. unlike the sse2 version
+// it also handles step == 3, which is what 3-channel loads use
+static STBI__AVX2_TARGET void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   if (step == 3 || step == 4) {
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+      // drops every fourth byte of a 128-bit lane, packing 4 rgba pixels into 12 bytes of rgb
+      __m256i rgb_shuffle = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+                                             0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+      // the rgb stores write 4 bytes past the 48 they fill, so keep 2 pixels in hand for the tail
+      int end = step == 4 ? count - 15 : count - 17;
+
+      for (; i < end; i += 16) {
+         // load
+         __m128i y_bytes = _mm_loadu_si128((__m128i *) (y+i));
+         __m128i cr_bytes = _mm_loadu_si128((__m128i *) (pcr+i));
+         __m128i cb_bytes = _mm_loadu_si128((__m128i *) (pcb+i));
+         __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+         __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+         // widen to short, same values as the sse2 unpack against y_bias / zero
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 8), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cr_biased), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cb_biased), 8);
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte, set up for transpose
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+         // transpose to interleave channels; o0 holds pixels 0-3 | 8-11, o1 holds 4-7 | 12-15
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+         // store
+         if (step == 4) {
+            _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+            _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+            out += 64;
+         } else {
+            __m256i p0 = _mm256_shuffle_epi8(o0, rgb_shuffle);
+            __m256i p1 = _mm256_shuffle_epi8(o1, rgb_shuffle);
+            _mm_storeu_si128((__m128i *) (out + 0), _mm256_castsi256_si128(p0));
+            _mm_storeu_si128((__m128i *) (out + 12), _mm256_castsi256_si128(p1));
+            _mm_storeu_si128((__m128i *) (out + 24), _mm256_extracti128_si256(p0, 1));
+            _mm_storeu_si128((__m128i *) (out + 36), _mm256_extracti128_si256(p1, 1));
+            out += 48;
+         }
+      }
+   }
+
+   // the rest goes through the sse2 path, which ends with the scalar loop
+   if (i < count)
+      stbi__YCbCr_to_RGB_simd(out, y + i, pcb + i, pcr + i, count - i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
@@ -3822,6 +4377,10 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
+   j->idct_block_pair_kernel = NULL;
+   if (stbi__jpeg_simd_limit < 1)
+      return;
+
 #ifdef STBI_SSE2
    if (stbi__sse2_available()) {
       j->idct_block_kernel = stbi__idct_simd;
@@ -3830,6 +4389,14 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__jpeg_simd_limit >= 2 && stbi__avx2_available()) {
+      j->idct_block_pair_kernel = stbi__idct_avx2_pair;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
@@ -3860,6 +4427,174 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
+// put a resampler into the state it has just before producing output row j
+static void stbi__resample_seek(stbi__resample *r, stbi_uc *data, int w2, int comp_y, int j)
+{
+   int t = (r->vs >> 1) + j;
+   int wraps = t / r->vs;
+   int row1 = wraps < comp_y ? wraps : comp_y - 1;
+   int row0 = wraps == 0 ? 0 : (wraps - 1 < comp_y ? wraps - 1 : comp_y - 1);
+   r->ystep = t % r->vs;
+   r->ypos  = wraps;
+   r->line0 = data + w2 * row0;
+   r->line1 = data + w2 * row1;
+}
+
+// color-convert one row of resampled components into out (n bytes per pixel). some cases
+// write one byte past the end of the row
+static void stbi__jpeg_color_row(stbi__jpeg *z, stbi_uc *out, stbi_uc *coutput[4], int n, int is_rgb)
+{
+   unsigned int i;
+   if (n >= 3) {
+      stbi_uc *y = coutput[0];
+      if (z->s->img_n == 3) {
+         if (is_rgb) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = y[i];
+               out[1] = coutput[1][i];
+               out[2] = coutput[2][i];
+               out[3] = 255;
+               out += n;
+            }
+         } else {
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+         }
+      } else if (z->s->img_n == 4) {
+         if (z->app14_color_transform == 0) { // CMYK
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               out[0] = stbi__blinn_8x8(coutput[0][i], m);
+               out[1] = stbi__blinn_8x8(coutput[1][i], m);
+               out[2] = stbi__blinn_8x8(coutput[2][i], m);
+               out[3] = 255;
+               out += n;
+            }
+         } else if (z->app14_color_transform == 2) { // YCCK
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               out[0] = stbi__blinn_8x8(255 - out[0], m);
+               out[1] = stbi__blinn_8x8(255 - out[1], m);
+               out[2] = stbi__blinn_8x8(255 - out[2], m);
+               out += n;
+            }
+         } else { // YCbCr + alpha?  Ignore the fourth channel for now
+            z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+         }
+      } else
+         for (i=0; i < z->s->img_x; ++i) {
+            out[0] = out[1] = out[2] = y[i];
+            out[3] = 255; // not used if n==3
+            out += n;
+         }
+   } else {
+      if (is_rgb) {
+         if (n == 1)
+            for (i=0; i < z->s->img_x; ++i)
+               *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+         else {
+            for (i=0; i < z->s->img_x; ++i, out += 2) {
+               out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+               out[1] = 255;
+            }
+         }
+      } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+         for (i=0; i < z->s->img_x; ++i) {
+            stbi_uc m = coutput[3][i];
+            stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+            stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+            stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+            out[0] = stbi__compute_y(r, g, b);
+            out[1] = 255;
+            out += n;
+         }
+      } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+         for (i=0; i < z->s->img_x; ++i) {
+            out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+            out[1] = 255;
+            out += n;
+         }
+      } else {
+         stbi_uc *y = coutput[0];
+         if (n == 1)
+            for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+         else
+            for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+      }
+   }
+}
+
+typedef struct
+{
+   stbi_uc *output;
+   stbi__resample *res_comp;
+   int n, decode_n, is_rgb;
+} stbi__jpeg_convert;
+
+// resample and color-convert output rows [j0,j1), using linebuf[] for upsampled lines. when
+// edge_row is given the rows around the band are owned by other threads, so the row whose
+// stray trailing byte would land in them is converted in edge_row and copied out
+static void stbi__jpeg_convert_rows(stbi__jpeg *z, stbi__jpeg_convert *c, stbi_uc **linebuf, stbi_uc *edge_row, int j0, int j1)
+{
+   stbi__resample res_comp[4];
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   int row_bytes = c->n * z->s->img_x;
+   int j,k;
+
+   for (k=0; k < c->decode_n; ++k) {
+      res_comp[k] = c->res_comp[k];
+      stbi__resample_seek(&res_comp[k], z->img_comp[k].data, z->img_comp[k].w2, z->img_comp[k].y, j0);
+   }
+
+   for (j=j0; j < j1; ++j) {
+      stbi_uc *out = c->output + row_bytes * (z->flip_output ? (int) z->s->img_y - 1 - j : j);
+      // when flipping, the byte past this row is the start of the row finished just before
+      int restore = z->flip_output && j > j0;
+      int edge = edge_row && (z->flip_output ? j == j0 && j > 0 : j == j1 - 1 && j1 < (int) z->s->img_y);
+      stbi_uc *row_end = out + row_bytes;
+      stbi_uc spill = restore ? *row_end : 0;
+      for (k=0; k < c->decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
+         }
+      }
+      if (edge) {
+         stbi__jpeg_color_row(z, edge_row, coutput, c->n, c->is_rgb);
+         memcpy(out, edge_row, row_bytes);
+      } else {
+         stbi__jpeg_color_row(z, out, coutput, c->n, c->is_rgb);
+         if (restore) *row_end = spill;
+      }
+   }
+}
+
+// one parallel band of MCU rows, with its own line buffers
+static int stbi__jpeg_convert_band(stbi__jpeg *z, void *data, int r0, int r1)
+{
+   stbi__jpeg_convert *c = (stbi__jpeg_convert *) data;
+   stbi_uc *linebuf[4];
+   int k, line = z->s->img_x + 3;
+   int j0 = r0 * z->img_mcu_h, j1 = r1 * z->img_mcu_h;
+   stbi_uc *scratch = (stbi_uc *) stbi__malloc_mad2(c->decode_n + c->n, line, 0);
+   if (!scratch) return stbi__err("outofmem", "Out of memory");
+   for (k=0; k < c->decode_n; ++k)
+      linebuf[k] = scratch + k * line;
+   if (j1 > (int) z->s->img_y) j1 = z->s->img_y;
+   if (j0 < j1)
+      stbi__jpeg_convert_rows(z, c, linebuf, scratch + c->decode_n * line, j0, j1);
+   STBI_FREE(scratch);
+   return 1;
+}
+
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n, is_rgb;
@@ -3888,9 +4623,8 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // resample and color-convert
    {
       int k;
-      unsigned int i,j;
       stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+      stbi__jpeg_convert convert;
 
       stbi__resample res_comp[4];
 
@@ -3921,99 +4655,22 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
       if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
+      convert.output = output;
+      convert.res_comp = res_comp;
+      convert.n = n;
+      convert.decode_n = decode_n;
+      convert.is_rgb = is_rgb;
+      if (z->parallel_for && z->img_mcu_y > 1) {
+         if (!stbi__jpeg_run_bands(z, z->img_mcu_y, &convert, stbi__jpeg_convert_band)) {
+            STBI_FREE(output);
+            stbi__cleanup_jpeg(z);
+            return NULL;
          }
+      } else {
+         stbi_uc *linebuf[4];
+         for (k=0; k < decode_n; ++k)
+            linebuf[k] = z->img_comp[k].linebuf;
+         stbi__jpeg_convert_rows(z, &convert, linebuf, NULL, 0, z->s->img_y);
       }
       stbi__cleanup_jpeg(z);
       *out_x = z->s->img_x;
@@ -4029,10 +4686,13 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
    if (!j) return stbi__errpuc("outofmem", "Out of memory");
    memset(j, 0, sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
+   j->flip_output = stbi__vertically_flip_on_load;
+   j->parallel_for = stbi__parallel_for;
+   j->parallel_for_user = stbi__parallel_for_user;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
+   if (result) ri->flipped = j->flip_output;
    STBI_FREE(j);
    return result;
 }
@@ -4090,6 +4750,31 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
+// the PNG pipeline publishes inflate progress to a thread that unfilters rows as they arrive;
+// it is compiled out where there are no atomics or no way to yield
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+#include <intrin.h>
+#define STBI__ATOMICS
+static long stbi__atomic_load(volatile long *p)          { return _InterlockedOr(p, 0); }
+static void stbi__atomic_store(volatile long *p, long v) { _InterlockedExchange(p, v); }
+static int  stbi__atomic_claim(volatile long *p, long v) { return _InterlockedCompareExchange(p, v, 0) == 0; }
+#elif defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__) || defined(_WIN32))
+#define STBI__ATOMICS
+static long stbi__atomic_load(volatile long *p)          { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static void stbi__atomic_store(volatile long *p, long v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static int  stbi__atomic_claim(volatile long *p, long v) { return __sync_bool_compare_and_swap(p, 0, v); }
+#endif
+
+#ifdef STBI__ATOMICS
+#ifdef _WIN32
+STBI_EXTERN __declspec(dllimport) int __stdcall SwitchToThread(void);
+#define stbi__yield()  SwitchToThread()
+#else
+#include <sched.h>
+#define stbi__yield()  sched_yield()
+#endif
+#endif
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -4172,7 +4857,7 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
 
-typedef struct
+typedef struct stbi__zbuf
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
@@ -4183,6 +4868,17 @@ typedef struct
    char *zout_end;
    int   z_expandable;
 
+   volatile long *progress; // if set, bytes of output done so far, for another thread to read
+   char *zpublish;          // output position last stored to progress
+   stbi_uc *zstop;          // if set, stop after a stored block that ends here
+
+   // if set, called instead of growing the buffer when n more bytes don't fit. it may slide the
+   // output down, keeping at least the last 32K for back references, and adds what it dropped
+   // to zout_base
+   int (*zwindow)(struct stbi__zbuf *z, int n);
+   void *zwindow_user;
+   stbi__uint32 zout_base;  // output bytes before zout_start
+
    stbi__zhuffman z_length, z_distance;
 } stbi__zbuf;
 
@@ -4256,11 +4952,20 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
    return stbi__zhuffman_decode_slowpath(a, z);
 }
 
+static void stbi__zpublish(stbi__zbuf *z, char *zout)
+{
+#ifdef STBI__ATOMICS
+   stbi__atomic_store(z->progress, (long) (z->zout_base + (zout - z->zout_start)));
+#endif
+   z->zpublish = zout;
+}
+
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
 {
    char *q;
    unsigned int cur, limit, old_limit;
    z->zout = zout;
+   if (z->zwindow) return z->zwindow(z, n);
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (unsigned int) (z->zout - z->zout_start);
    limit = old_limit = (unsigned) (z->zout_end - z->zout_start);
@@ -4309,6 +5014,7 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          int len,dist;
          if (z == 256) {
             a->zout = zout;
+            if (a->progress) stbi__zpublish(a, zout);
             return 1;
          }
          if (z >= 286) return stbi__err("bad huffman code","Corrupt PNG"); // per DEFLATE, length codes 286 and 287 must not appear in compressed data
@@ -4326,11 +5032,18 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
          }
          p = (stbi_uc *) (zout - dist);
          if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
+            memset(zout, *p, len);
+            zout += len;
+         } else if (dist >= 8 && a->zout_end - zout >= len + 8) {
+            // 8 bytes at a time: with dist >= 8 each chunk only reads bytes already written,
+            // and the chunk that runs past len lands in room checked above
+            char *end = zout + len;
+            do { memcpy(zout, p, 8); zout += 8; p += 8; } while (zout < end);
+            zout = end;
          } else {
             if (len) { do *zout++ = *p++; while (--len); }
          }
+         if (a->progress && zout - a->zpublish >= 32768) stbi__zpublish(a, zout);
       }
    }
 }
@@ -4469,6 +5182,9 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
       type = stbi__zreceive(a,2);
       if (type == 0) {
          if (!stbi__parse_uncompressed_block(a)) return 0;
+         if (a->progress) stbi__zpublish(a, a->zout);
+         if (a->zstop && a->zbuffer == a->zstop) // end of one section of a split stream
+            return final ? stbi__err("zlib corrupt","Corrupt PNG") : 1;
       } else if (type == 3) {
          return 0;
       } else {
@@ -4482,6 +5198,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
          if (!stbi__parse_huffman_block(a)) return 0;
       }
    } while (!final);
+   if (a->zstop) return stbi__err("zlib corrupt","Corrupt PNG"); // section ended early
    return 1;
 }
 
@@ -4491,6 +5208,10 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->progress   = NULL;
+   a->zstop      = NULL;
+   a->zwindow    = NULL;
+   a->zout_base  = 0;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4605,11 +5326,14 @@ static int stbi__check_png_header(stbi__context *s)
    return 1;
 }
 
+struct stbi__png_pipe;
+
 typedef struct
 {
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   struct stbi__png_pipe *pipe; // set while unfiltering rows that are still being inflated
 } stbi__png;
 
 
@@ -4646,6 +5370,149 @@ static int stbi__paeth(int a, int b, int c)
 
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
+#ifdef STBI_SSE2
+// 8-bit rows: Up runs 16 bytes at a time, Sub/Avg/Paeth one 3- or 4-byte pixel at a time with
+// all its channels in one register. Paeth is the branch-free form libpng uses, so it picks the
+// same predictor as stbi__paeth
+// pixels move as 4 bytes whenever n (the bytes left in the row) allows; an RGB pixel then
+// carries one byte of the next pixel, which is written over when that pixel is done
+static __m128i stbi__png_load_px(const stbi_uc *p, int n)
+{
+   int v = 0;
+   if (n >= 4) memcpy(&v, p, 4);
+   else        memcpy(&v, p, 3);
+   return _mm_cvtsi32_si128(v);
+}
+
+static void stbi__png_store_px(stbi_uc *p, __m128i x, int n)
+{
+   int v = _mm_cvtsi128_si32(x);
+   if (n >= 4) memcpy(p, &v, 4);
+   else        memcpy(p, &v, 3);
+}
+
+static __m128i stbi__png_abs16(__m128i x)
+{
+   return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static __m128i stbi__png_select(__m128i mask, __m128i t, __m128i f)
+{
+   return _mm_or_si128(_mm_and_si128(mask, t), _mm_andnot_si128(mask, f));
+}
+
+// unfilters everything after the first pixel of a row; returns 0 for filters left to the caller
+static int stbi__png_unfilter_simd(int filter, stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int nk, int bpp)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a, b, c;
+   int k;
+
+   if (filter == STBI__F_up) {
+      for (k=0; k + 16 <= nk; k += 16) {
+         __m128i x = _mm_loadu_si128((__m128i *) (raw + k));
+         _mm_storeu_si128((__m128i *) (cur + k), _mm_add_epi8(x, _mm_loadu_si128((__m128i *) (prior + k))));
+      }
+      for (; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      return 1;
+   }
+   if (bpp != 3 && bpp != 4) return 0;
+
+   a = stbi__png_load_px(cur - bpp, bpp);
+   switch (filter) {
+      case STBI__F_sub:
+         for (k=0; k < nk; k += bpp) {
+            a = _mm_add_epi8(stbi__png_load_px(raw + k, nk - k), a);
+            stbi__png_store_px(cur + k, a, nk - k);
+         }
+         return 1;
+      case STBI__F_avg:
+         for (k=0; k < nk; k += bpp) {
+            // avg_epu8 rounds up; take the carry back off to get (a+b)>>1
+            __m128i avg;
+            b = stbi__png_load_px(prior + k, nk - k);
+            avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+            a = _mm_add_epi8(stbi__png_load_px(raw + k, nk - k), avg);
+            stbi__png_store_px(cur + k, a, nk - k);
+         }
+         return 1;
+      case STBI__F_paeth:
+         c = stbi__png_load_px(prior - bpp, bpp);
+         for (k=0; k < nk; k += bpp) {
+            __m128i a16, b16, c16, pa, pb, pc, smallest, nearest;
+            b = stbi__png_load_px(prior + k, nk - k);
+            a16 = _mm_unpacklo_epi8(a, zero);
+            b16 = _mm_unpacklo_epi8(b, zero);
+            c16 = _mm_unpacklo_epi8(c, zero);
+            pa = _mm_sub_epi16(b16, c16); // p-a
+            pb = _mm_sub_epi16(a16, c16); // p-b
+            pc = stbi__png_abs16(_mm_add_epi16(pa, pb));
+            pa = stbi__png_abs16(pa);
+            pb = stbi__png_abs16(pb);
+            smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            nearest = stbi__png_select(_mm_cmpeq_epi16(pc, smallest), c16, b16);
+            nearest = stbi__png_select(_mm_cmpeq_epi16(pb, smallest), b16, nearest);
+            nearest = stbi__png_select(_mm_cmpeq_epi16(pa, smallest), a16, nearest);
+            a = _mm_add_epi8(stbi__png_load_px(raw + k, nk - k), _mm_packus_epi16(nearest, nearest));
+            stbi__png_store_px(cur + k, a, nk - k);
+            c = b;
+         }
+         return 1;
+   }
+   return 0;
+}
+#endif
+
+#ifdef STBI__ATOMICS
+// one task inflates into a bounded window while another unfilters each row as soon as it has
+// been inflated. the window holds the deflate history plus room to run ahead; once it fills,
+// the inflater waits for the unfilter task to catch up and slides the window down. offsets in
+// produced, consumed and base count from the start of the stream
+enum
+{
+   STBI__PNG_UNFILTER_IDLE,     // the unfilter task hasn't started
+   STBI__PNG_UNFILTER_GROWING,  // it hasn't, and the inflater is reallocating the window
+   STBI__PNG_UNFILTER_RUNNING,
+   STBI__PNG_UNFILTER_DONE,
+   STBI__PNG_UNFILTER_FAILED
+};
+
+typedef struct stbi__png_pipe
+{
+   stbi__png *z;
+   stbi_uc *idata;
+   stbi__uint32 idata_len, raw_len, row_bytes;
+   char *raw;                 // the window
+   stbi__uint32 window_len;
+   int parse_header, out_n, depth, color;
+   int unfiltered;            // result of the unfiltering task
+   volatile long claimed;     // set by whichever task starts first, which then inflates
+   volatile long produced;    // bytes inflated and ready to read
+   volatile long consumed;    // bytes the unfilter task is done with
+   volatile long base;        // offset of raw[0]
+   volatile long unfilter;    // STBI__PNG_UNFILTER_*
+   volatile long state;       // 0 while inflating, 1 once done, -1 if inflate failed
+} stbi__png_pipe;
+
+static int stbi__png_wait(stbi__png_pipe *p, stbi__uint32 need)
+{
+   while ((stbi__uint32) stbi__atomic_load(&p->produced) < need) {
+      if (stbi__atomic_load(&p->state) != 0)
+         return (stbi__uint32) stbi__atomic_load(&p->produced) >= need;
+      stbi__yield();
+   }
+   return 1;
+}
+
+// where the row starting at offset sits in the window; only valid once stbi__png_wait has
+// seen it inflated, and until the row is marked consumed
+static stbi_uc *stbi__png_pipe_row(stbi__png_pipe *p, stbi__uint32 offset)
+{
+   return (stbi_uc *) p->raw + (offset - (stbi__uint32) stbi__atomic_load(&p->base));
+}
+#endif
+
 // create the png data from post-deflated data
 static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
 {
@@ -4659,6 +5526,9 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
+#ifdef STBI_SSE2
+   int simd = depth == 8 && stbi__sse2_available();
+#endif
 
    STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
    a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
@@ -4676,7 +5546,16 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    for (j=0; j < y; ++j) {
       stbi_uc *cur = a->out + stride*j;
       stbi_uc *prior;
-      int filter = *raw++;
+      int filter;
+
+#ifdef STBI__ATOMICS
+      if (a->pipe) {
+         if (!stbi__png_wait(a->pipe, (j+1) * (img_width_bytes+1)))
+            return stbi__err("not enough pixels","Corrupt PNG");
+         raw = stbi__png_pipe_row(a->pipe, j * (img_width_bytes+1));
+      }
+#endif
+      filter = *raw++;
 
       if (filter > 4)
          return stbi__err("invalid filter","Corrupt PNG");
@@ -4728,18 +5607,24 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       // this is a little gross, so that we don't switch per-pixel or per-component
       if (depth < 8 || img_n == out_n) {
          int nk = (width - 1)*filter_bytes;
+         int done = 0;
+#ifdef STBI_SSE2
+         if (simd) done = stbi__png_unfilter_simd(filter, cur, prior, raw, nk, filter_bytes);
+#endif
          #define STBI__CASE(f) \
              case f:     \
                 for (k=0; k < nk; ++k)
-         switch (filter) {
-            // "none" filter turns into a memcpy here; make that explicit.
-            case STBI__F_none:         memcpy(cur, raw, nk); break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
+         if (!done) {
+            switch (filter) {
+               // "none" filter turns into a memcpy here; make that explicit.
+               case STBI__F_none:         memcpy(cur, raw, nk); break;
+               STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
+               STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
+               STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
+               STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
+               STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
+               STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
+            }
          }
          #undef STBI__CASE
          raw += nk;
@@ -4769,6 +5654,9 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
             }
          }
       }
+#ifdef STBI__ATOMICS
+      if (a->pipe) stbi__atomic_store(&a->pipe->consumed, (long) ((j+1) * (img_width_bytes+1)));
+#endif
    }
 
    // we make a separate pass to expand bits to pixels; for performance,
@@ -4904,6 +5792,253 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
+// parallel decoding, when stbi_set_parallel_for has installed a hook. zlib streams written with
+// full flushes (each flushed section starts with an empty window) inflate one section per task;
+// otherwise a non-interlaced image inflates and unfilters as a two-task pipeline
+#define STBI__PNG_MAX_SECTIONS  64
+#define STBI__PNG_MIN_SECTION   (64 << 10)  // compressed bytes per section
+#define STBI__PNG_MIN_PIPELINE  (1 << 20)   // image bytes before a pipeline pays for itself
+#define STBI__PNG_ZWINDOW       32768       // deflate back references reach no further
+#define STBI__PNG_RUN_AHEAD     (256 << 10) // pipeline window beyond the history and a row
+#define STBI__PNG_START_SPINS   64          // yields to wait for the unfilter task before growing
+
+typedef struct
+{
+   stbi_uc *start, *end;
+   char *out;
+   int out_len, ok;
+} stbi__png_section;
+
+typedef struct
+{
+   stbi__png_section section[STBI__PNG_MAX_SECTIONS];
+   int count, parse_header, out_guess;
+} stbi__png_sections;
+
+// splits at the empty stored blocks (00 00 FF FF on a byte boundary) that a flush leaves
+// behind, picking the ones nearest to even intervals. a false match inside compressed data,
+// or a sync flush that keeps the window, is caught when the sections are inflated
+static int stbi__png_find_sections(stbi__png_sections *t, stbi_uc *data, stbi__uint32 len)
+{
+   stbi__uint32 want = len / STBI__PNG_MIN_SECTION, pos = 0, k;
+   stbi_uc *start = data;
+   if (want > STBI__PNG_MAX_SECTIONS) want = STBI__PNG_MAX_SECTIONS;
+   t->count = 0;
+   for (k=1; k < want; ++k) {
+      stbi__uint32 p = len / want * k;
+      if (p < pos) p = pos;
+      while (p + 4 < len && !(data[p] == 0 && data[p+1] == 0 && data[p+2] == 0xff && data[p+3] == 0xff))
+         ++p;
+      if (p + 4 >= len) break;
+      pos = p + 4;
+      t->section[t->count].start = start;
+      t->section[t->count].end = data + pos;
+      ++t->count;
+      start = data + pos;
+   }
+   t->section[t->count].start = start;
+   t->section[t->count].end = data + len;
+   return ++t->count;
+}
+
+static void stbi__png_inflate_section(void *data, int index)
+{
+   stbi__png_sections *t = (stbi__png_sections *) data;
+   stbi__png_section *c = &t->section[index];
+   int size = t->out_guess / t->count + 4096;
+   stbi__zbuf a;
+   c->out = (char *) stbi__malloc(size);
+   c->ok = 0;
+   if (!c->out) return;
+   a.zbuffer = c->start;
+   a.zbuffer_end = c->end;
+   // each section gets its own buffer, so a back reference into an earlier one is a bad distance
+   a.zout_start = a.zout = c->out;
+   a.zout_end = c->out + size;
+   a.z_expandable = 1;
+   a.progress = NULL;
+   a.zstop = index + 1 < t->count ? c->end : NULL;
+   a.zwindow = NULL;
+   a.zout_base = 0;
+   c->ok = stbi__parse_zlib(&a, index == 0 && t->parse_header);
+   c->out = a.zout_start;
+   c->out_len = (int) (a.zout - a.zout_start);
+}
+
+static int stbi__png_inflate_sections(stbi__png *z, stbi_uc *idata, stbi__uint32 idata_len, stbi__uint32 out_guess, int parse_header, stbi__uint32 *raw_len)
+{
+   stbi__png_sections *t;
+   stbi__uint32 total = 0;
+   int i, ok = 1;
+   if (idata_len / STBI__PNG_MIN_SECTION < 2 || out_guess > INT_MAX) return 0;
+   t = (stbi__png_sections *) stbi__malloc(sizeof(*t));
+   if (!t) return 0;
+   t->parse_header = parse_header;
+   t->out_guess = (int) out_guess;
+   if (stbi__png_find_sections(t, idata, idata_len) < 2) {
+      STBI_FREE(t);
+      return 0;
+   }
+   stbi__parallel_for(stbi__parallel_for_user, t->count, stbi__png_inflate_section, t);
+   for (i=0; i < t->count; ++i) {
+      if (!t->section[i].ok || (stbi__uint32) t->section[i].out_len > INT_MAX - total) ok = 0;
+      else total += t->section[i].out_len;
+   }
+   if (ok) {
+      z->expanded = (stbi_uc *) stbi__malloc(total ? total : 1);
+      ok = z->expanded != NULL;
+   }
+   total = 0;
+   for (i=0; i < t->count; ++i) {
+      if (ok) memcpy(z->expanded + total, t->section[i].out, t->section[i].out_len);
+      total += t->section[i].out_len;
+      STBI_FREE(t->section[i].out);
+   }
+   STBI_FREE(t);
+   if (ok) *raw_len = total;
+   return ok;
+}
+
+#ifdef STBI__ATOMICS
+// stbi__zbuf.zwindow for the pipeline's inflater. waits until the unfilter task is done with
+// everything but the last 32K, then moves that to the front of the window
+static int stbi__png_pipe_window(stbi__zbuf *a, int n)
+{
+   stbi__png_pipe *p = (stbi__png_pipe *) a->zwindow_user;
+   int spins = 0;
+   stbi__zpublish(a, a->zout); // the unfilter task may be waiting on these bytes
+   for (;;) {
+      long unfilter = stbi__atomic_load(&p->unfilter);
+      stbi__uint32 total = a->zout_base + (stbi__uint32) (a->zout - a->zout_start);
+      stbi__uint32 keep_from, done;
+      if (unfilter == STBI__PNG_UNFILTER_IDLE && spins++ >= STBI__PNG_START_SPINS
+          && stbi__atomic_claim(&p->unfilter, STBI__PNG_UNFILTER_GROWING)) {
+         // nothing reads the window yet, so after a short wait it grows, rather than wait on
+         // a task that might only start once this one returns
+         stbi__uint32 used = (stbi__uint32) (a->zout - a->zout_start), limit = p->window_len;
+         char *q = NULL;
+         while (used + n > limit && limit <= (1u << 30)) limit *= 2;
+         if (used + n <= limit)
+            q = (char *) STBI_REALLOC_SIZED(a->zout_start, p->window_len, limit);
+         if (q) {
+            a->zout_start = p->raw = q;
+            a->zout = a->zpublish = q + used;
+            a->zout_end = q + limit;
+            p->window_len = limit;
+         }
+         stbi__atomic_store(&p->unfilter, STBI__PNG_UNFILTER_IDLE);
+         return q ? 1 : stbi__err("outofmem", "Out of memory");
+      }
+      if (unfilter == STBI__PNG_UNFILTER_FAILED) return 0;
+      // trailing data only ever needs the history, but offsets stay inside a long
+      if (total >= (1u << 31) - p->window_len) return stbi__err("outofmem", "Out of memory");
+
+      // keep the history and whatever the unfilter task hasn't read. it is only safe to move
+      // once the task can't be inside a row: a finished task, or one waiting on the next row
+      done = unfilter == STBI__PNG_UNFILTER_DONE ? total : (stbi__uint32) stbi__atomic_load(&p->consumed);
+      keep_from = total > STBI__PNG_ZWINDOW ? total - STBI__PNG_ZWINDOW : 0;
+      if (done < keep_from) keep_from = done;
+      if (keep_from < a->zout_base) keep_from = a->zout_base;
+      if (unfilter >= STBI__PNG_UNFILTER_RUNNING && total - keep_from + n <= p->window_len
+          && (unfilter == STBI__PNG_UNFILTER_DONE || total - done < p->row_bytes)) {
+         memmove(a->zout_start, a->zout_start + (keep_from - a->zout_base), total - keep_from);
+         a->zout_base = keep_from;
+         a->zout = a->zpublish = a->zout_start + (total - keep_from);
+         stbi__atomic_store(&p->base, (long) keep_from);
+         return 1;
+      }
+      stbi__yield();
+   }
+}
+
+static void stbi__png_pipe_task(void *data, int index)
+{
+   stbi__png_pipe *p = (stbi__png_pipe *) data;
+   STBI_NOTUSED(index);
+   // whichever task starts first inflates, so a parallel_for that runs them one after the
+   // other still finishes: the window just grows to hold the stream
+   if (stbi__atomic_claim(&p->claimed, 1)) {
+      stbi__zbuf a;
+      a.zbuffer = p->idata;
+      a.zbuffer_end = p->idata + p->idata_len;
+      a.zout_start = a.zout = a.zpublish = p->raw;
+      a.zout_end = p->raw + p->window_len;
+      a.z_expandable = 0;
+      a.progress = &p->produced;
+      a.zstop = NULL;
+      a.zwindow = stbi__png_pipe_window;
+      a.zwindow_user = p;
+      a.zout_base = 0;
+      if (stbi__parse_zlib(&a, p->parse_header)) {
+         stbi__zpublish(&a, a.zout);
+         stbi__atomic_store(&p->state, 1);
+      } else {
+         stbi__atomic_store(&p->state, -1);
+      }
+   } else {
+      stbi__png *z = p->z;
+      // only waits out a reallocation of the window
+      while (!stbi__atomic_claim(&p->unfilter, STBI__PNG_UNFILTER_RUNNING))
+         stbi__yield();
+      p->unfiltered = stbi__create_png_image_raw(z, (stbi_uc *) p->raw, p->raw_len, p->out_n, z->s->img_x, z->s->img_y, p->depth, p->color);
+      stbi__atomic_store(&p->unfilter, p->unfiltered ? STBI__PNG_UNFILTER_DONE : STBI__PNG_UNFILTER_FAILED);
+   }
+}
+
+static int stbi__png_pipeline(stbi__png *z, stbi_uc *idata, stbi__uint32 idata_len, int parse_header, int out_n, int color)
+{
+   stbi__context *s = z->s;
+   stbi__png_pipe p;
+   stbi__uint32 row_bytes;
+   if (!stbi__mad3sizes_valid(s->img_n, s->img_x, z->depth, 7)) return 0;
+   row_bytes = ((s->img_n * s->img_x * z->depth + 7) >> 3) + 1;
+   // progress is a long, so stay well inside 32 bits
+   if (row_bytes > (1u << 30) / s->img_y) return 0;
+   memset(&p, 0, sizeof(p));
+   p.row_bytes = row_bytes;
+   p.raw_len = row_bytes * s->img_y;
+   if (p.raw_len < STBI__PNG_MIN_PIPELINE) return 0;
+   // the history, a row, and room to run ahead, which is more than the largest stored block
+   p.window_len = (row_bytes > STBI__PNG_ZWINDOW ? row_bytes : STBI__PNG_ZWINDOW) + STBI__PNG_RUN_AHEAD;
+   p.raw = (char *) stbi__malloc(p.window_len);
+   if (!p.raw) return 0;
+   p.z = z;
+   p.idata = idata;
+   p.idata_len = idata_len;
+   p.parse_header = parse_header;
+   p.out_n = out_n;
+   p.depth = z->depth;
+   p.color = color;
+   z->pipe = &p;
+   stbi__parallel_for(stbi__parallel_for_user, 2, stbi__png_pipe_task, &p);
+   z->pipe = NULL;
+   if (!p.unfiltered || p.state != 1) {
+      // corrupt data; the serial path reports it
+      STBI_FREE(z->out); z->out = NULL;
+      STBI_FREE(p.raw);
+      return 0;
+   }
+   z->expanded = (stbi_uc *) p.raw;
+   return 1;
+}
+#endif
+
+// returns 1 if only the inflate was done (into z->expanded), 2 if z->out is done too, and 0 if
+// the image should be decoded serially
+static int stbi__png_decode_parallel(stbi__png *z, stbi__uint32 idata_len, stbi__uint32 out_guess, stbi__uint32 *raw_len, int parse_header, int out_n, int color, int interlace)
+{
+   if (!stbi__parallel_for) return 0;
+   if (stbi__png_inflate_sections(z, z->idata, idata_len, out_guess, parse_header, raw_len))
+      return 1;
+#ifdef STBI__ATOMICS
+   if (!interlace && stbi__png_pipeline(z, z->idata, idata_len, parse_header, out_n, color))
+      return 2;
+#else
+   STBI_NOTUSED(out_n); STBI_NOTUSED(color); STBI_NOTUSED(interlace);
+#endif
+   return 0;
+}
+
 static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
 {
    stbi__context *s = z->s;
@@ -5088,6 +6223,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->pipe = NULL;
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -5197,20 +6333,24 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('I','E','N','D'): {
             stbi__uint32 raw_len, bpl;
+            int decoded;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
             // initial guess for decoded data size to avoid unnecessary reallocs
             bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            decoded = stbi__png_decode_parallel(z, ioff, raw_len, &raw_len, !is_iphone, s->img_out_n, color, interlace);
+            if (!decoded) {
+               z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
+               if (z->expanded == NULL) return 0; // zlib should set error
+            }
+            STBI_FREE(z->idata); z->idata = NULL;
+            if (decoded < 2 && !stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
             if (has_trans) {
                if (z->depth == 16) {
                   if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
@@ -6,8 +6,35 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <cfloat>
 #include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
 #include "Debug/camera.h"
+#include "bvh.h"
+#include "gpu_buffer.h"
+#include "mesh_generator.h"
+#include "mesh_optimizer.h"
+#include "frustum.h"
+#include "mesh_registry.h"
+#include "occlusion_culler.h"
+#include "render_queue.h"
+#include "scene.h"
+#include "shader_program.h"
+#include "texture_loader.h"
+#include "transform_table.h"
+#include "triangle_bvh.h"
+#include "vertex_format.h"
+// stb_image allocates from the decode arena of the thread it runs on (decode_arena.h)
+#define STBI_MALLOC(size) decodeArenaMalloc(size)
+#define STBI_REALLOC_SIZED(p, oldSize, newSize) decodeArenaRealloc(p, oldSize, newSize)
+#define STBI_FREE(p) decodeArenaFree(p)
 #define STB_IMAGE_IMPLEMENTATION
 #include "Debug/stb_image.h"  
 #include <glm/gtx/string_cast.hpp>
@@ -34,12 +61,26 @@ namespace
     float gDeltaTime = 0.0f; // Time between frames
     float gLastFrame = 0.0f;
 
-    // mesh
-    struct GLMesh
+    // mesh: every shape lives in gMeshes' shared buffers
+    MeshRegistry gMeshes;
+    bool gPackedVertices = false; // 16-byte PackedVertex instead of 8 floats (--packed-vertices)
+
+    // every shape, at each of its levels of detail
+    const int LOD_SEGMENTS[MAX_MESH_LODS] = { 64, 32, 16, 8 }; // sides of the round shapes
+    LodMesh gPyramidMesh, gCylinderMesh, gTubeMesh, gBoxMesh;
+    std::deque<TriangleBvh> gPickMeshes; // what LodMesh::pickLevels point into
+    const float TAPE_INNER_RADIUS = 1.8f / 1.9f; // the inner tape cylinder fills the hole
+    float gLodTolerance = 0.5f; // largest on-screen chord error a level may show, in pixels (--lod-tolerance)
+
+    // One level of a shape before it goes into gMeshes: FLOATS_PER_VERTEX floats per vertex,
+    // and either indices or, if there are none, a triangle soup
+    struct SceneShape
     {
-        GLuint vao;
-        GLuint vbo;
-        GLuint nVertices;
+        std::string name;
+        std::vector<GLfloat> vertices;
+        std::vector<GLushort> indices;
+        LodMesh* mesh; // UCreateMesh appends the level to it
+        int segments;
     };
 
     // View mode
@@ -49,41 +90,120 @@ namespace
     };
     View_Mode VIEW;
     float aspectRatio; // for p matrix aspect ratio
+    const float NEAR_PLANE = 0.1f;
+    const float PERSPECTIVE_FAR_PLANE = 1000.0f;
+    const float ORTHO_FAR_PLANE = 100.0f;
+
+    // The whole scene is one glMultiDrawElementsIndirect over gMeshes, with a command for each
+    // entity inside the view frustum. The command for the entity in gScene slot i reads
+    // gDrawData[i] from the DrawBuffer storage block. Records stay on the GPU and are only
+    // rewritten when their entity moves; the commands are only sent when what is visible, or
+    // the level of detail it is drawn at, changes.
+    struct DrawData
+    {
+        glm::mat4 model;     // world matrix, scale included
+        glm::vec4 normal[3]; // its inverse transpose, as the columns of a std430 mat3
+        GLint layer;         // gTextureArray layer
+        GLuint flags;        // DRAW_* bits
+        GLint pad[2];
+    };
+    static_assert(sizeof(DrawData) == 128, "DrawData must match the std430 layout");
+    const GLuint DRAW_UNLIT = 1; // flat white, for the lamp
+    const GLuint DRAW_DATA_BINDING = 0;
+    GpuArray<DrawData> gDrawData;
+    GpuArray<DrawElementsIndirectCommand> gDrawCommands;
+    GpuArray<GLuint> gDrawIndices; // 0, 1, 2, ...: the instanced attribute that tells a draw its index
+    std::vector<DrawData> gDrawRecords;                   // what gDrawData holds
+    std::vector<DrawElementsIndirectCommand> gDrawList;   // by slot, at the entity's current level
+    std::vector<DrawElementsIndirectCommand> gDrawQueue;  // the visible ones, sorted: what gDrawCommands holds
+    RenderQueue gRenderQueue;                             // sorts them, front to back
+    std::vector<uint8_t> gVisible;                        // by slot, from the frustum test
+    std::vector<uint32_t> gVisibleSlots;
+    Bvh gSceneBvh;                      // over gScene.volumes.boxes, by slot
+    uint64_t gBvhRevision = (uint64_t)-1; // gScene.Revision() it was built for
+    const size_t BVH_CULL_MIN = 4096;   // fewer are culled faster one by one (--bench-bvh)
+    size_t gReportedDraws = (size_t)-1; // visible count last printed
+
+    // Draws that pass the frustum test then go through gOcclusionCuller, in two passes
+    bool gOcclusionCulling = true; // (--no-occlusion-cull)
+    OcclusionCuller gOcclusionCuller;
+    GLuint gDepthPyramidProgramId;
+    GLuint gOcclusionProgramId;
+    uint64_t gOcclusionRevision = 0;    // gScene.Revision() its visibility is by slot for
+    GLuint gReportedTested = 0;          // occlusion counts last printed
+    GLuint gReportedHidden = (GLuint)-1;
+    const GLuint OCCLUSION_FIRST_BINDING = 1; // storage blocks after DrawBuffer
+    const GLuint OCCLUSION_FIRST_UNIT = 1;    // texture units after the scene's texture array
+    const size_t MAX_ENTITIES = 16384; // room in the draw buffers (1.6 MB of records and commands)
+
+    // Every object in the scene
+    Scene gScene;
+
+    // An object as a scene file describes it; see ULoadScene for the text form
+    struct SceneObject
+    {
+        const char* mesh;   // "cylinder", "tube", "box" or "pyramid"
+        int layer;          // gTextureArray layer
+        glm::vec3 position;
+        float angle;        // degrees about axis
+        glm::vec3 axis;
+        glm::vec3 scale;
+    };
 
-    // Large Cylinder - battery
-    GLuint LargeCylinderVBO, LargeCylinderVAO; // Large Cylinder variables
-    float LCLocX, LCLocY, LCLocZ; // Large Cylinder location (x,y,z)
-    glm::mat4 pMat, vMat, mMat, mvMat; // mvp variables
-    // Small Cylinder - battery
-    GLuint SmallCylinderVBO, SmallCylinderVAO; // Small Cylinder variables
-    float SCLocX, SCLocY, SCLocZ; // Small Cylinder location (x, y, z)
-    // Plane - Table
-    GLuint PlaneVBO[2], PlaneVAO; // Plane variables
-    GLuint nIndices;
-    // Large Cylinder - weight
-    float wLCLocX, wLCLocY, wLCLocZ;
-    // Small Cylinder - weight
-    float wSCLocX, wSCLocY, wSCLocZ;
-    // Small Box 
-    GLuint BoxVBO, BoxVAO, boxVertices;
-    float BLocX, BLocY, BLocZ;
-    // Large Cylinder - tape
-    float TLCLocX, TLCLocY, TLCLocZ;
-    // Small Cylinder - tape
-    float TSCLocX, TSCLocY, TSCLocZ;
-
-    // Array for triangle rotations
-    glm::float32 triRotations[] = { 0.0f, 60.0f, 120.0f, 180.0f, 240.0f, 300.0f };
+    // What the scene holds without --scene; the lamp is added at gLightPosition on top
+    const SceneObject DEFAULT_SCENE[] = {
+        { "box", 1, glm::vec3(5.0f, -5.5f, 0.0f), 0.0f, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(48.0f, 7.0f, 48.0f) },         // table
+        { "box", 4, glm::vec3(10.0f, -1.22f, 1.0f), 28.6478898f, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(5.5f, 1.5f, 8.0f) },  // box
+        { "cylinder", 2, glm::vec3(0.0f, 0.0f, 0.0f), -70.0f, glm::vec3(1.0f, 90.0f, 0.5f), glm::vec3(0.8f, 1.0f, 0.8f) },   // battery
+        { "cylinder", 3, glm::vec3(4.0f, -1.5f, 4.7f), -70.0f, glm::vec3(1.0f, 90.0f, 0.5f), glm::vec3(2.0f, 0.25f, 2.0f) }, // weight base
+        { "tube", 6, glm::vec3(5.0f, -0.21f, 1.85f), 45.0f, glm::vec3(0.1f, 0.0f, 0.2f), glm::vec3(1.9f, 0.7f, 1.9f) },      // outer tape
+        { "cylinder", 3, glm::vec3(0.0f, 0.2f, 0.0f), -70.0f, glm::vec3(1.0f, 90.0f, 0.5f), glm::vec3(0.3f) },               // battery cap
+        { "cylinder", 3, glm::vec3(4.0f, -1.0f, 4.7f), -70.0f, glm::vec3(1.0f, 90.0f, 0.5f), glm::vec3(0.5f) },              // weight top
+        { "cylinder", 5, glm::vec3(5.0f, -0.2f, 1.85f), 45.0f, glm::vec3(0.1f, 0.0f, 0.2f), glm::vec3(1.8f, 0.7f, 1.8f) },   // inner tape
+    };
+    const char* gSceneFile = nullptr; // --scene
 
     GLFWwindow* gWindow = nullptr;
 
-    GLMesh gMesh;
-    GLuint gTextureId[7];
+    GLuint gTextureArray; // every scene texture, one layer each
+
+    // Texture files, indexed the same as the layers of gTextureArray
+    const char* const TEXTURE_FILES[] = {
+        "Debug/Brick.jpg",          // 0
+        "Debug/black-wood.jpg",     // 1 table
+        "Debug/AmazonBattery2.png", // 2 battery body
+        "Debug/Chrome.jpg",         // 3 battery cap, weight
+        "Debug/BoxTop.jpg",         // 4 box
+        "Debug/tape_t_p2.jpg",      // 5 tape top
+        "Debug/white_plastic.png"   // 6 tape side
+    };
+    const int TEXTURE_COUNT = sizeof(TEXTURE_FILES) / sizeof(TEXTURE_FILES[0]);
+    TextureStreamer gTextureStreamer;
+    bool gStreamTextures = true; // false: block until every texture is loaded (--sync-textures)
+    TextureLoadOptions gTextureLoadOptions;
+    int gMaxLayerSize = 1024; // cap on the side of a texture array layer (--texture-layer-size)
     GLuint gProgramId;
-    GLuint gLampProgramId;
+    ShaderProgram gSceneProgram; // uniform tables for gProgramId
+    bool gDepthPrepass = false;  // lay down depth alone, then shade with GL_EQUAL (--depth-prepass)
+    GLuint gDepthProgramId;
+    ShaderProgram gDepthProgram;
+    GLint gResidentLayersLoc;
+
+    // Mirrors the std140 FrameData block the shaders declare: what stays the same for every
+    // draw in a frame, uploaded once per frame
+    struct FrameData
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec4 viewPosition; // xyz
+        glm::vec4 lightPos;     // xyz
+        glm::vec4 lightColor;   // rgb
+    };
+    static_assert(sizeof(FrameData) == 176, "FrameData must match the std140 layout");
+    const GLuint FRAME_DATA_BINDING = 0;
+    UniformBuffer<FrameData> gFrameData;
 
     // colors
-    glm::vec3 gObjectColor(1.0f, 0.2f, 0.0f);
     glm::vec3 gLightColor(0.90f, 0.94f, 0.97f);
 
     // Light position and scale
@@ -95,15 +215,36 @@ namespace
 bool UInitialize(int, char* [], GLFWwindow** window);
 void UResizeWindow(GLFWwindow* window, int width, int height);
 void UProcessInput(GLFWwindow* window);
-void UCreateMesh(GLMesh& mesh);
-void UDestroyMesh(GLMesh& mesh);
+std::vector<SceneShape> USceneShapes();
+void UCreateMesh();
+MeshHandle UAddMesh(const SceneShape& shape);
+int UCheckVertexPacking();
+bool UCreateScene();
+bool ULoadScene(const char* path, std::vector<SceneObject>& objects, std::vector<std::string>& meshNames);
+const LodMesh* UFindMesh(const std::string& name);
+void UCreateDrawBuffers();
+void UUpdateTransforms();
+void UCullScene(const glm::mat4& viewProjection);
+void UUpdateLods(const glm::mat4& projection);
+void UQueueDraws(const glm::mat4& view);
 void URender();
+void UDrawRuns(bool depthOnly);
+void UReportOcclusion();
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
+bool UCreateComputeProgram(const char* shaderSource, GLuint& programId);
 void UDestroyShaderProgram(GLuint programId);
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
-bool UCreateTexture(const char* filename, GLuint& textureId);
+bool UCreateTextures(const char* const filenames[], GLuint& textureArray, int count);
+bool UBakeTextures(const char* const filenames[], int count);
+int UBenchmarkFlip(const char* filename);
+int UBenchmarkJpeg(const char* const filenames[], int count);
+int UBenchmarkBvh();
+int UBenchmarkPick();
+glm::mat4 UProjection();
+void UPick(GLFWwindow* window);
+const char* UMeshName(const LodMesh* mesh);
 void UDestroyTexture(GLuint textureId);
 
 // Vertex shader
@@ -111,24 +252,54 @@ const GLchar* vertexShaderSource = GLSL(440,
     layout(location = 0) in vec3 position; 
     layout(location = 1) in vec3 normal;
     layout(location = 2) in vec2 textureCoordinate;  
+    layout(location = 3) in uint drawIndex; // instanced, and equal to the command's baseInstance
 
     out vec3 vertexNormal; 
     out vec3 vertexFragmentPos;
     out vec2 vertexTextureCoordinate;
+    flat out int vertexLayer;
+    flat out uint vertexFlags;
 
+    layout(std140) uniform FrameData
+    {
+        mat4 view;
+        mat4 projection;
+        vec4 viewPosition;
+        vec4 lightPos;
+        vec4 lightColor;
+    };
 
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    struct DrawData
+    {
+        mat4 model;
+        mat3 normalMatrix;
+        int layer;
+        uint flags;
+        int pad0;
+        int pad1;
+    };
+    layout(std430) readonly buffer DrawBuffer
+    {
+        DrawData draws[];
+    };
+
+    // computed the same way in depthVertexShaderSource, so the pre-pass depth matches exactly
+    invariant gl_Position;
 
     void main()
     {
+        DrawData draw = draws[drawIndex];
+
+        mat4 model = draw.model;
+
         gl_Position = projection * view * model * vec4(position, 1.0f);
 
         vertexFragmentPos = vec3(model * vec4(position, 1.0f));
 
-        vertexNormal = mat3(transpose(inverse(model))) * normal;
+        vertexNormal = draw.normalMatrix * normal;
         vertexTextureCoordinate = textureCoordinate;
+        vertexLayer = draw.layer;
+        vertexFlags = draw.flags;
     }
 );
 
@@ -138,39 +309,55 @@ const GLchar* fragmentShaderSource = GLSL(440,
     in vec3 vertexNormal;
     in vec3 vertexFragmentPos; 
     in vec2 vertexTextureCoordinate;
+    flat in int vertexLayer;
+    flat in uint vertexFlags;
 
     out vec4 fragmentColor; 
 
+    layout(std140) uniform FrameData
+    {
+        mat4 view;
+        mat4 projection;
+        vec4 viewPosition;
+        vec4 lightPos;
+        vec4 lightColor;
+    };
+
     // Uniform 
-    uniform vec3 objectColor;
-    uniform vec3 lightColor;
-    uniform vec3 lightPos;
-    uniform vec3 viewPosition;
-    uniform sampler2D uTexture;
+    uniform sampler2DArray uTextures;
+    uniform uint uResidentLayers; // bit n set once layer n has streamed in
 
     void main()
     {
+        // DRAW_UNLIT: the lamp
+        if ((vertexFlags & 1u) != 0u)
+        {
+            fragmentColor = vec4(1.0f);
+            return;
+        }
+
         float ambientStrength = 0.1f; 
-        vec3 ambient = ambientStrength * lightColor; 
+        vec3 ambient = ambientStrength * lightColor.rgb; 
 
         //Calculate Diffuse lighting*/
         vec3 norm = normalize(vertexNormal);
-        vec3 lightDirection = normalize(lightPos - vertexFragmentPos);
+        vec3 lightDirection = normalize(lightPos.xyz - vertexFragmentPos);
         float impact = max(dot(norm, lightDirection), 0.0);
-        vec3 diffuse = impact * lightColor; 
+        vec3 diffuse = impact * lightColor.rgb; 
 
         //Calculate Specular lighting*/
         float specularIntensity = 0.8f; 
         float highlightSize = 16.0f; 
-        vec3 viewDir = normalize(viewPosition - vertexFragmentPos); 
+        vec3 viewDir = normalize(viewPosition.xyz - vertexFragmentPos); 
         vec3 reflectDir = reflect(-lightDirection, norm);
 
         //Calculate specular component
         float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-        vec3 specular = specularIntensity * specularComponent * lightColor;
+        vec3 specular = specularIntensity * specularComponent * lightColor.rgb;
 
 
-        vec4 textureColor = texture(uTexture, vertexTextureCoordinate);
+        bool resident = ((uResidentLayers >> uint(vertexLayer)) & 1u) != 0u;
+        vec4 textureColor = resident ? texture(uTextures, vec3(vertexTextureCoordinate, vertexLayer)) : vec4(0.5f);
 
         // Calculate phong result
         vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
@@ -179,154 +366,310 @@ const GLchar* fragmentShaderSource = GLSL(440,
     }
 );
 
-/* Lamp Shader */
-const GLchar* lampVertexShaderSource = GLSL(440,
+// Depth pre-pass: position alone, through the same matrices as vertexShaderSource
+const GLchar* depthVertexShaderSource = GLSL(440,
+    layout(location = 0) in vec3 position;
+    layout(location = 3) in uint drawIndex;
 
-    layout(location = 0) in vec3 position; 
+    layout(std140) uniform FrameData
+    {
+        mat4 view;
+        mat4 projection;
+        vec4 viewPosition;
+        vec4 lightPos;
+        vec4 lightColor;
+    };
 
-        //Uniform 
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    struct DrawData
+    {
+        mat4 model;
+        mat3 normalMatrix;
+        int layer;
+        uint flags;
+        int pad0;
+        int pad1;
+    };
+    layout(std430) readonly buffer DrawBuffer
+    {
+        DrawData draws[];
+    };
+
+    invariant gl_Position;
 
     void main()
     {
-        gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+        mat4 model = draws[drawIndex].model;
+        gl_Position = projection * view * model * vec4(position, 1.0f);
     }
 );
 
-/* Fragment Shader Source Code*/
-const GLchar* lampFragmentShaderSource = GLSL(440,
+const GLchar* depthFragmentShaderSource = GLSL(440,
+    void main()
+    {
+    }
+);
+
+// Depth pyramid: each texel holds the farthest depth of the block it covers below, 4x4 depth
+// buffer pixels for level 0 and 2x2 texels above that. Sizes round down, so the last row and
+// column of a level also take in whatever is left over below.
+const GLchar* depthPyramidShaderSource = GLSL(440,
+    layout(local_size_x = 8, local_size_y = 8) in;
 
-    out vec4 fragmentColor;
+    uniform int uLevel;
+    uniform sampler2D uDepth;                       // below level 0
+    layout(r32f) readonly uniform image2D uSource;  // below the others: level uLevel - 1
+    layout(r32f) writeonly uniform image2D uTarget; // level uLevel
 
     void main()
     {
-        fragmentColor = vec4(1.0f); 
+        ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+        ivec2 targetSize = imageSize(uTarget);
+        if (any(greaterThanEqual(texel, targetSize)))
+            return;
+
+        int scale = uLevel == 0 ? 4 : 2;
+        ivec2 sourceSize = uLevel == 0 ? textureSize(uDepth, 0) : imageSize(uSource);
+        ivec2 first = texel * scale;
+        ivec2 last = min(first + scale - 1, sourceSize - 1);
+        if (texel.x == targetSize.x - 1)
+            last.x = sourceSize.x - 1;
+        if (texel.y == targetSize.y - 1)
+            last.y = sourceSize.y - 1;
+        float farthest = 0.0f;
+        for (int y = first.y; y <= last.y; ++y)
+        {
+            for (int x = first.x; x <= last.x; ++x)
+            {
+                float depth = uLevel == 0 ? texelFetch(uDepth, ivec2(x, y), 0).r : imageLoad(uSource, ivec2(x, y)).r;
+                farthest = max(farthest, depth);
+            }
+        }
+        imageStore(uTarget, texel, vec4(farthest));
     }
 );
 
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
-{
-    for (int j = 0; j < height / 2; ++j)
+// Occlusion test over the draws the frustum test kept, one per invocation. Pass 0 writes the
+// first pass: the draws whose entity was visible at the last test. Pass 1 tests every draw's
+// world box against the depth pyramid, writes the second pass (the draws it finds visible that
+// pass 0 skipped), keeps the result for the next frame and counts the draws it hides.
+const GLchar* occlusionShaderSource = GLSL(440,
+    layout(local_size_x = 64) in;
+
+    layout(std140) uniform FrameData
     {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
+        mat4 view;
+        mat4 projection;
+        vec4 viewPosition;
+        vec4 lightPos;
+        vec4 lightColor;
+    };
 
-        for (int i = width * channels; i > 0; --i)
+    struct Command
+    {
+        uint count;
+        uint instanceCount;
+        uint firstIndex;
+        int baseVertex;
+        uint baseInstance; // the entity's slot
+    };
+    layout(std430) readonly buffer Draws
+    {
+        Command draws[];
+    };
+    layout(std430) writeonly buffer PassDraws
+    {
+        Command passDraws[];
+    };
+    layout(std430) buffer Visibility
+    {
+        uint visible[]; // by slot
+    };
+    layout(std430) readonly buffer Boxes
+    {
+        float boxes[]; // by slot: world min xyz, then max xyz
+    };
+    layout(std430) buffer OcclusionStats
+    {
+        uint hidden[];
+    };
+
+    uniform int uPass;
+    uniform uint uDrawCount;
+    uniform uint uStatsSlot;
+    uniform ivec2 uDepthSize;   // the depth buffer under pyramid level 0
+    uniform sampler2D uPyramid;
+
+    // False when the box is farther than the pyramid everywhere it covers on screen. A box
+    // reaching behind the camera or past the near plane is always visible.
+    bool boxVisible(uint slot)
+    {
+        uint base = slot * 6u;
+        vec3 boxMin = vec3(boxes[base], boxes[base + 1u], boxes[base + 2u]);
+        vec3 boxMax = vec3(boxes[base + 3u], boxes[base + 4u], boxes[base + 5u]);
+        mat4 viewProjection = projection * view;
+        vec2 screenMin = vec2(1.0f);
+        vec2 screenMax = vec2(-1.0f);
+        float nearest = 1.0f;
+        for (int i = 0; i < 8; ++i)
         {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
+            vec3 corner = mix(boxMin, boxMax, vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1));
+            vec4 clip = viewProjection * vec4(corner, 1.0f);
+            if (clip.w <= 0.0f)
+                return true;
+            vec3 ndc = clip.xyz / clip.w;
+            screenMin = min(screenMin, ndc.xy);
+            screenMax = max(screenMax, ndc.xy);
+            nearest = min(nearest, ndc.z);
         }
+        float depth = nearest * 0.5f + 0.5f;
+        if (depth <= 0.0f)
+            return true;
+
+        // the box's pixels in level 0 texels, then the level where they span at most two each way
+        vec2 lastPixel = vec2(uDepthSize - 1);
+        ivec2 first = ivec2(clamp((screenMin * 0.5f + 0.5f) * vec2(uDepthSize), vec2(0.0f), lastPixel)) >> 2;
+        ivec2 last = ivec2(clamp((screenMax * 0.5f + 0.5f) * vec2(uDepthSize), vec2(0.0f), lastPixel)) >> 2;
+        int level = 0;
+        while (any(greaterThan((last >> level) - (first >> level), ivec2(1))))
+            ++level;
+        // worked out here: llvmpipe answered textureSize(uPyramid, level) with the wrong level
+        ivec2 levelLast = max((uDepthSize >> (2 + level)) - 1, ivec2(0));
+        ivec2 low = min(first >> level, levelLast);
+        ivec2 high = min(last >> level, levelLast);
+        float farthest = max(max(texelFetch(uPyramid, low, level).r, texelFetch(uPyramid, ivec2(high.x, low.y), level).r),
+                             max(texelFetch(uPyramid, ivec2(low.x, high.y), level).r, texelFetch(uPyramid, high, level).r));
+        return depth <= farthest;
     }
-}
 
-void initPositions()
-{
-    // Large Battery 
-    LCLocX = 0.0f;
-    LCLocY = 0.0f;
-    LCLocZ = 0.0f;
-    // Small Battery
-    SCLocX = 0.0f;
-    SCLocY = 0.2f;
-    SCLocZ = 0.0f;
-    // Small Weight
-    wSCLocX = 4.0f;
-    wSCLocY = -1.0f;
-    wSCLocZ = 4.7f;
-    // Large Weight
-    wLCLocX = 4.0f;
-    wLCLocY = -1.5f;
-    wLCLocZ = 4.7f;
-    // Small Box
-    BLocX = 10.0f;
-    BLocY = -1.22f;
-    BLocZ = 1.0f;
-    // Outer Tape 
-    TLCLocX = 5.0f;
-    TLCLocY = -0.21f;
-    TLCLocZ = 1.85f;
-    // Inner Tape
-    TSCLocX = 5.0f;
-    TSCLocY = -0.2f;
-    TSCLocZ = 1.85f;
-}
+    void main()
+    {
+        uint k = gl_GlobalInvocationID.x;
+        if (k >= uDrawCount)
+            return;
+
+        Command draw = draws[k];
+        uint slot = draw.baseInstance;
+        if (uPass == 0)
+            draw.instanceCount = visible[slot];
+        else
+        {
+            bool seen = boxVisible(slot);
+            draw.instanceCount = seen && visible[slot] == 0u ? 1u : 0u;
+            visible[slot] = seen ? 1u : 0u;
+            if (!seen)
+                atomicAdd(hidden[uStatsSlot], 1u);
+        }
+        passDraws[k] = draw;
+    }
+);
 
 // Main function for program
 int main(int argc, char* argv[])
 {
-    // Intialize GLFW, GLEW, and window
-    if (!UInitialize(argc, argv, &gWindow))
+    bool bake = false;
+    for (int i = 1; i < argc; ++i)
     {
-        return EXIT_FAILURE;
+        if (strcmp(argv[i], "--bench-flip") == 0)
+            return UBenchmarkFlip(i + 1 < argc ? argv[i + 1] : "Debug/black-wood.jpg");
+        if (strcmp(argv[i], "--bench-jpeg") == 0)
+            return UBenchmarkJpeg(TEXTURE_FILES, TEXTURE_COUNT);
+        if (strcmp(argv[i], "--check-vertex-packing") == 0)
+            return UCheckVertexPacking();
+        if (strcmp(argv[i], "--bench-bvh") == 0)
+            return UBenchmarkBvh();
+        if (strcmp(argv[i], "--bench-pick") == 0)
+            return UBenchmarkPick();
+
+        if (strcmp(argv[i], "--sync-textures") == 0)
+            gStreamTextures = false;
+        else if (strcmp(argv[i], "--bake") == 0)
+            bake = true;
+        else if (strcmp(argv[i], "--compress-textures") == 0)
+            gTextureLoadOptions.compress = true;
+        else if (strcmp(argv[i], "--no-texture-cache") == 0)
+            gTextureLoadOptions.useCache = false;
+        else if (strcmp(argv[i], "--serial-decode") == 0)
+            gTextureLoadOptions.parallelDecode = false;
+        else if (strcmp(argv[i], "--no-decode-arena") == 0)
+            gTextureLoadOptions.useArena = false;
+        else if (strcmp(argv[i], "--vram-budget-mb") == 0 && i + 1 < argc)
+            gTextureLoadOptions.vramBudget = (size_t)atoi(argv[++i]) * 1024 * 1024;
+        else if (strcmp(argv[i], "--texture-layer-size") == 0 && i + 1 < argc)
+            gMaxLayerSize = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--packed-vertices") == 0)
+            gPackedVertices = true;
+        else if (strcmp(argv[i], "--lod-tolerance") == 0 && i + 1 < argc)
+            gLodTolerance = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+            gSceneFile = argv[++i];
+        else if (strcmp(argv[i], "--no-occlusion-cull") == 0)
+            gOcclusionCulling = false;
+        else if (strcmp(argv[i], "--depth-prepass") == 0)
+            gDepthPrepass = true;
     }
-    initPositions();
-    // Create mesh
-    UCreateMesh(gMesh);
 
-    // Create shader
-    if (!UCreateShaderProgram(vertexShaderSource, fragmentShaderSource, gProgramId))
-    {
-        return EXIT_FAILURE;
-    }
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
-    {
-        return EXIT_FAILURE;
-    }
+    // Offline step: rebuild every texture cache entry and exit without opening a window
+    if (bake)
+        return UBakeTextures(TEXTURE_FILES, TEXTURE_COUNT) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-    // Load textures
-    const char* texFilename = "Debug/Brick.jpg";
-    if (!UCreateTexture(texFilename, gTextureId[0]))
-    {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
-    const char* texFilenameWood = "Debug/black-wood.jpg";
-    if (!UCreateTexture(texFilenameWood, gTextureId[1]))
+    // Intialize GLFW, GLEW, and window
+    if (!UInitialize(argc, argv, &gWindow))
     {
-        cout << "Failed to load texture " << texFilenameWood << endl;
         return EXIT_FAILURE;
     }
-    const char* texFilenameBattery = "Debug/AmazonBattery2.png";
-    if (!UCreateTexture(texFilenameBattery, gTextureId[2]))
+    // Create mesh
+    UCreateMesh();
+    if (!UCreateScene())
     {
-        cout << "Failed to load texture " << texFilenameBattery << endl;
         return EXIT_FAILURE;
     }
-    const char* texFilenameBatteryCap = "Debug/Chrome.jpg";
-    if (!UCreateTexture(texFilenameBatteryCap, gTextureId[3]))
+    UCreateDrawBuffers();
+
+    // Create shader
+    if (!UCreateShaderProgram(vertexShaderSource, fragmentShaderSource, gProgramId))
     {
-        cout << "Failed to load texture " << texFilenameBatteryCap << endl;
         return EXIT_FAILURE;
     }
-    const char* texFilenameBoxTop = "Debug/BoxTop.jpg";
-    if (!UCreateTexture(texFilenameBoxTop, gTextureId[4]))
+
+    // Look every uniform up once; the render loop only uses the numbers
+    gSceneProgram.Reflect(gProgramId);
+    gResidentLayersLoc = gSceneProgram.Location("uResidentLayers");
+    gFrameData.Create(FRAME_DATA_BINDING);
+    gSceneProgram.BindBlock("FrameData", FRAME_DATA_BINDING);
+    gSceneProgram.BindStorageBlock("DrawBuffer", DRAW_DATA_BINDING);
+
+    if (gDepthPrepass)
     {
-        cout << "Failed to load texture " << texFilenameBoxTop << endl;
-        return EXIT_FAILURE;
+        if (!UCreateShaderProgram(depthVertexShaderSource, depthFragmentShaderSource, gDepthProgramId))
+        {
+            return EXIT_FAILURE;
+        }
+        gDepthProgram.Reflect(gDepthProgramId);
+        gDepthProgram.BindBlock("FrameData", FRAME_DATA_BINDING);
+        gDepthProgram.BindStorageBlock("DrawBuffer", DRAW_DATA_BINDING);
     }
-    const char* texFilenameTapeTop = "Debug/tape_t_p2.jpg";
-    if (!UCreateTexture(texFilenameTapeTop, gTextureId[5]))
+
+    if (gOcclusionCulling)
     {
-        cout << "Failed to load texture " << texFilenameTapeTop << endl;
-        return EXIT_FAILURE;
+        if (!UCreateComputeProgram(depthPyramidShaderSource, gDepthPyramidProgramId) ||
+            !UCreateComputeProgram(occlusionShaderSource, gOcclusionProgramId))
+        {
+            return EXIT_FAILURE;
+        }
+        gOcclusionCuller.Create(gDepthPyramidProgramId, gOcclusionProgramId, MAX_ENTITIES, FRAME_DATA_BINDING,
+                                OCCLUSION_FIRST_BINDING, OCCLUSION_FIRST_UNIT);
     }
-    const char* texFilenameTapeSide = "Debug/white_plastic.png";
-    if (!UCreateTexture(texFilenameTapeSide, gTextureId[6]))
+
+    // Load textures; in streaming mode they show up over the first few frames
+    if (!UCreateTextures(TEXTURE_FILES, gTextureArray, TEXTURE_COUNT) && !gStreamTextures)
     {
-        cout << "Failed to load texture " << texFilenameTapeSide << endl;
         return EXIT_FAILURE;
     }
 
     glUseProgram(gProgramId);
 
     // texture unit 0
-    glUniform1i(glGetUniformLocation(gProgramId, "Texture1"), 0);
-    glUniform1i(glGetUniformLocation(gProgramId, "Texture2"), 1);
+    glUniform1i(gSceneProgram.Location("uTextures"), 0);
    
 
     // Set background to black
@@ -338,22 +681,30 @@ int main(int argc, char* argv[])
     {
         UProcessInput(gWindow);
 
+        gTextureStreamer.Update();
+
         URender();
 
         glfwPollEvents();
     }
 
     // Clean up
-    UDestroyMesh(gMesh);
-    UDestroyTexture(gTextureId[0]);
-    UDestroyTexture(gTextureId[1]);
-    UDestroyTexture(gTextureId[2]);
-    UDestroyTexture(gTextureId[3]);
-    UDestroyTexture(gTextureId[4]);
-    UDestroyTexture(gTextureId[5]);
-    UDestroyTexture(gTextureId[6]);
+    gMeshes.Destroy();
+    gDrawData.Destroy();
+    gDrawCommands.Destroy();
+    gDrawIndices.Destroy();
+    gTextureStreamer.Shutdown();
+    UDestroyTexture(gTextureArray);
+    gFrameData.Destroy();
     UDestroyShaderProgram(gProgramId);
-    UDestroyShaderProgram(gLampProgramId);
+    if (gDepthPrepass)
+        UDestroyShaderProgram(gDepthProgramId);
+    if (gOcclusionCulling)
+    {
+        gOcclusionCuller.Destroy();
+        UDestroyShaderProgram(gDepthPyramidProgramId);
+        UDestroyShaderProgram(gOcclusionProgramId);
+    }
 
     // successful exit
     exit(EXIT_SUCCESS);
@@ -475,7 +826,7 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
     case GLFW_MOUSE_BUTTON_LEFT:
     {
         if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
+            UPick(window);
         else
             cout << "Left mouse button released" << endl;
     }
@@ -517,12 +868,6 @@ void URender()
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
 
-    // Move and adjust the object
-    glm::mat4 scale = glm::scale(glm::vec3(1.0f, 1.0f, 1.0f));
-    glm::mat4 rotation = glm::rotate(0.0f, glm::vec3(1.0f, 1.0f, 0.0f));
-    glm::mat4 translation = glm::translate(glm::vec3(5.0f, 0.0f, 0.0f));
-    glm::mat4 model = translation * rotation * scale;
-    
     // Camera
     glm::mat4 view = gCamera.GetViewMatrix();
     float currentFrame = glfwGetTime();
@@ -535,566 +880,1048 @@ void URender()
 
     // Build Perspective matrix
     glfwGetFramebufferSize(gWindow, &WINDOW_WIDTH, &WINDOW_HEIGHT);
-    aspectRatio = (float)WINDOW_WIDTH / (float)WINDOW_HEIGHT;
-    glm::mat4 projection;
-    if (VIEW == PERSPEC)
-        projection = glm::perspective(glm::radians(gCamera.Zoom), aspectRatio, 0.1f, 1000.0f);
-    else
-        projection = glm::ortho(-aspectRatio, aspectRatio, -1.0f, 1.0f, 0.1f, 100.0f);
-
-
-    glUseProgram(gProgramId);
-
-    GLint modelLoc = glGetUniformLocation(gProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(gProgramId, "view");
-    GLint projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, value_ptr(projection));
-
-    GLint objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
+    const glm::mat4 projection = UProjection();
 
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
 
+    // everything both programs share goes up in one buffer update
+    FrameData frame;
+    frame.view = view;
+    frame.projection = projection;
+    frame.viewPosition = glm::vec4(gCamera.Position, 1.0f);
+    frame.lightPos = glm::vec4(gLightPosition, 1.0f);
+    frame.lightColor = glm::vec4(gLightColor, 1.0f);
+    gFrameData.Update(frame);
 
-    /*-----------------------------  PLANE  -------------------------------*/
+    UUpdateTransforms();
+    UCullScene(projection * view);
+    UUpdateLods(projection);
+    UQueueDraws(view);
 
-    glBindVertexArray(PlaneVAO);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId[1]);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices);
-    glBindVertexArray(0);
-
-    /*-----------------------------  End of Plane ------------------------*/
-   
-   /*------------------------       BATTERY       ---------------------------------*/
-    /*-----------------------   Large Cylinder    ---------------------------------*/
+    glUseProgram(gProgramId);
 
-    glBindVertexArray(LargeCylinderVAO);
+    // one texture for the whole scene; layers that haven't arrived yet draw grey
+    GLuint residentLayers = 0;
+    for (int i = 0; i < TEXTURE_COUNT; ++i)
+    {
+        if (gTextureStreamer.LayerResident(i))
+            residentLayers |= 1u << i;
+    }
+    glUniform1ui(gResidentLayersLoc, residentLayers);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId[2]);
-
-    // Use loop to build Model matrix for Large Cylinder
-    for (int i = 0; i < 6; i++) {
-        // Apply Transform to model // Build model matrix for LC
-        scale = glm::scale(glm::vec3(0.8f, 1.0f, 0.8f));
-        mMat = glm::translate(glm::mat4(1.0f), glm::vec3(LCLocX, LCLocY, LCLocZ));
-        mMat = glm::rotate(mMat, glm::radians(-70.f), glm::vec3(1.0f, 90.0f, 0.5f));
-        mMat = glm::rotate(mMat, glm::radians(triRotations[i]), glm::vec3(0.0f, 1.0f, 0.0f));
-        mvMat =  mMat * scale;
- 
-        //Copy perspective and MV matrices to uniforms
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(mvMat));
-
-
-        glDrawArrays(GL_TRIANGLES, 0, 9);
 
+    // the queue's runs once, or twice with occlusion culling: what was visible last frame, then
+    // what the depth that left shows is visible and wasn't drawn. With the pre-pass that lays
+    // down depth alone, and a colour pass then shades only the surfaces that ended up in front.
+    const GLsizei drawCount = (GLsizei)gDrawQueue.size();
+    if (gDepthPrepass)
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    if (!gOcclusionCulling)
+    {
+        gDrawCommands.Bind(GL_DRAW_INDIRECT_BUFFER);
+        UDrawRuns(gDepthPrepass);
     }
-
+    else
+    {
+        if (gScene.Revision() != gOcclusionRevision)
+        {
+            gOcclusionCuller.Reset();
+            gOcclusionRevision = gScene.Revision();
+        }
+        gOcclusionCuller.Resize(WINDOW_WIDTH, WINDOW_HEIGHT);
+        gOcclusionCuller.BindFirstPass(gDrawCommands, drawCount);
+        UDrawRuns(gDepthPrepass);
+        gOcclusionCuller.BindSecondPass(gDrawCommands, drawCount);
+        UDrawRuns(gDepthPrepass);
+        UReportOcclusion();
+    }
+    if (gDepthPrepass)
+    {
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+        if (!gOcclusionCulling)
+            UDrawRuns(false);
+        else
+        {
+            gOcclusionCuller.FirstPass().Bind(GL_DRAW_INDIRECT_BUFFER);
+            UDrawRuns(false);
+            gOcclusionCuller.SecondPass().Bind(GL_DRAW_INDIRECT_BUFFER);
+            UDrawRuns(false);
+        }
+        glDepthMask(GL_TRUE);
+        glDepthFunc(GL_LESS);
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
     glBindVertexArray(0);
+    glUseProgram(0);
 
-    /*-------------------  End of Large Cylinder  ---------------------------*/
-
-     /*-----------------------   Small Cylinder    ---------------------------------*/
-
-    glBindVertexArray(SmallCylinderVAO);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId[3]);
 
-    // Use loop to build Model matrix for Large Cylinder
-    for (int i = 0; i < 6; i++) {
-        // Apply Transform to model // Build model matrix for LC
-        scale = glm::scale(glm::vec3(0.3f, 0.3f, 0.3f));
-        mMat = glm::translate(glm::mat4(1.0f), glm::vec3(SCLocX, SCLocY, SCLocZ));
-        mMat = glm::rotate(mMat, glm::radians(-70.f), glm::vec3(1.0f, 90.0f, 0.5f));
-        mMat = glm::rotate(mMat, glm::radians(triRotations[i]), glm::vec3(0.0f, 1.0f, 0.0f));
-        mvMat = mMat * scale;
+    glfwSwapBuffers(gWindow);
+}
 
-        //Copy perspective and MV matrices to uniforms
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(mvMat));
+// One multi-draw per run of gRenderQueue, from the commands bound to GL_DRAW_INDIRECT_BUFFER:
+// gDrawCommands or an occlusion pass, which all keep the queue's order. depthOnly draws each
+// run with gDepthProgramId instead of its own program.
+void UDrawRuns(bool depthOnly)
+{
+    for (const RenderQueue::Run& run : gRenderQueue.Runs())
+    {
+        glUseProgram(depthOnly ? gDepthProgramId : sortKeyProgram(run.state));
+        glBindTexture(GL_TEXTURE_2D_ARRAY, sortKeyTexture(run.state));
+        glBindVertexArray(sortKeyVertexArray(run.state));
+        const void* offset = reinterpret_cast<const void*>(run.first * sizeof(DrawElementsIndirectCommand));
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, offset, (GLsizei)run.count, 0);
+    }
+}
 
+// Prints how many of the draws in view the depth pyramid hid, whenever either count changes.
+// The counts come back from the GPU a couple of frames late.
+void UReportOcclusion()
+{
+    GLuint tested, hidden;
+    if (!gOcclusionCuller.Stats(tested, hidden) || (tested == gReportedTested && hidden == gReportedHidden))
+        return;
+    gReportedTested = tested;
+    gReportedHidden = hidden;
+    cout << "Occlusion: " << hidden << " of " << tested << " objects in view hidden ("
+         << (tested > 0 ? 100.0f * hidden / tested : 0.0f) << "%)" << endl;
+}
 
-        glDrawArrays(GL_TRIANGLES, 0, 9);
+// The active projection for the current framebuffer size
+glm::mat4 UProjection()
+{
+    aspectRatio = (float)WINDOW_WIDTH / (float)WINDOW_HEIGHT;
+    if (VIEW == PERSPEC)
+        return glm::perspective(glm::radians(gCamera.Zoom), aspectRatio, NEAR_PLANE, PERSPECTIVE_FAR_PLANE);
+    return glm::ortho(-aspectRatio, aspectRatio, -1.0f, 1.0f, NEAR_PLANE, ORTHO_FAR_PLANE);
+}
 
+// Reports the entity under the cursor: a ray from the camera through gSceneBvh, then through
+// the triangles of each entity whose box it reaches, nearest first, at the level being drawn.
+// While mouse-look has the cursor disabled, that is the entity at the centre of the screen.
+void UPick(GLFWwindow* window)
+{
+    typedef chrono::steady_clock Clock;
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    if (width == 0 || height == 0)
+        return;
+    Clock::time_point start = Clock::now();
+
+    // A disabled cursor's position is virtual and drifts without bound as the camera turns, so
+    // only a visible one is mapped to the screen; it is in screen coordinates, which high-DPI
+    // displays scale to framebuffer pixels
+    float ndcX = 0.0f, ndcY = 0.0f;
+    if (glfwGetInputMode(window, GLFW_CURSOR) != GLFW_CURSOR_DISABLED)
+    {
+        double cursorX, cursorY;
+        int windowWidth, windowHeight;
+        glfwGetCursorPos(window, &cursorX, &cursorY);
+        glfwGetWindowSize(window, &windowWidth, &windowHeight);
+        if (windowWidth > 0 && windowHeight > 0)
+        {
+            const float pixelX = (float)(cursorX * width / windowWidth);
+            const float pixelY = (float)(cursorY * height / windowHeight);
+            ndcX = glm::clamp(2.0f * pixelX / width - 1.0f, -1.0f, 1.0f);
+            ndcY = glm::clamp(1.0f - 2.0f * pixelY / height, -1.0f, 1.0f);
+        }
     }
 
-    glBindVertexArray(0);
-
-    /*-------------------  End of Small Cylinder  ---------------------------*/
-    /*-------------------  End of Battery         ---------------------------*/
+    // the cursor on the near and far planes, taken back through projection * view
+    const glm::mat4 toWorld = glm::inverse(UProjection() * gCamera.GetViewMatrix());
+    const glm::vec4 nearPoint = toWorld * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+    const glm::vec4 farPoint = toWorld * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+    const glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+    const glm::vec3 direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
 
+    float distance = FLT_MAX;
+    uint32_t slot = 0;
+    const bool hit = gSceneBvh.Raycast(origin, direction, distance, slot, [&](uint32_t i, float limit)
+    {
+        // in the entity's own space, with the direction left unnormalised so t still measures
+        // along the world ray
+        const TriangleBvh& triangles = *gScene.meshes[i]->pickLevels[std::max(gScene.lodLevels[i], 0)];
+        const glm::mat4 toLocal = glm::inverse(gScene.transforms.World(i));
+        const glm::vec3 localOrigin(toLocal * glm::vec4(origin, 1.0f));
+        const glm::vec3 localDirection(toLocal * glm::vec4(direction, 0.0f));
+        float t = limit;
+        uint32_t triangle;
+        return triangles.Raycast(localOrigin, localDirection, t, triangle) ? t : -1.0f;
+    });
+    const double us = chrono::duration<double, micro>(Clock::now() - start).count();
+
+    if (!hit)
+    {
+        cout << "Picked nothing (" << us << " us)" << endl;
+        return;
+    }
+    cout << "Picked entity " << gScene.entities[slot] << " (" << UMeshName(gScene.meshes[slot]) << ", layer "
+         << gScene.materials[slot].layer << ") at distance " << distance << " (" << us << " us)" << endl;
+}
 
-    /*---------------------------       Weight        ----------------------------------*/
-        /*-----------------------   Large Cylinder    ---------------------------------*/
+const char* UMeshName(const LodMesh* mesh)
+{
+    if (mesh == &gCylinderMesh)
+        return "cylinder";
+    if (mesh == &gTubeMesh)
+        return "tube";
+    if (mesh == &gBoxMesh)
+        return "box";
+    return "pyramid";
+}
 
-    glBindVertexArray(LargeCylinderVAO);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId[3]);
+// Every level of every shape in the scene: the hand-made lamp pyramid, and the round shapes and
+// boxes from mesh_generator.h, the round ones once per LOD_SEGMENTS entry
+std::vector<SceneShape> USceneShapes()
+{
+    static const GLfloat verts[] = {
+        //Positions          // Normals           //Texture Coordinates
+        // Front face
+        0.0f,  1.0f,  0.0f,  0.0f,  0.45f, 0.9f,  1.0f, 0.0f,
+        -1.0f, -1.0f, 1.0f,  0.0f,  0.45f, 0.9f,  1.0f, 1.0f,
+        1.0f,  -1.0f, 1.0f,  0.0f,  0.45f, 0.9f,  0.0f, 1.0f,
+        // Right face
+        0.0f,  1.0f,  0.0f,  0.9f,  0.45f, 0.0f,  1.0f, 0.0f,
+        1.0f, -1.0f,  1.0f,  0.9f,  0.45f, 0.0f,  1.0f, 1.0f,
+        1.0f,  -1.0f, -1.0f,  0.9f,  0.45f, 0.0f,  0.0f, 1.0f,
+        // Back face
+        0.0f,  1.0f,  0.0f, 0.0f,  0.45f, -0.9f,  1.0f, 0.0f,
+        1.0f,  -1.0f, -1.0f, 0.0f,  0.45f, -0.9f,  1.0f, 1.0f,
+        -1.0f, -1.0f, -1.0f, 0.0f,  0.45f, -0.9f,  0.0f, 1.0f,
+        // Left face
+        0.0f,  1.0f,  0.0f,  -0.9f,  0.45f, 0.0f,  1.0f, 0.0f,
+        -1.0f, -1.0f, -1.0f,  -0.9f,  0.45f, 0.0f,  1.0f, 1.0f,
+        -1.0f, -1.0f, 1.0f,  -0.9f,  0.45f, 0.0f,  0.0f, 1.0f,
+        // Bottom back left
+        -1.0f, -1.0f, 1.0f,  0.0f, -0.9f,  0.0f,   1.0f, 1.0f,
+        -1.0f, -1.0f, -1.0f,  0.0f, -0.9f,  0.0f,  1.0f, 0.0f,
+        1.0f, -1.0f, -1.0f,  0.0f, -0.9f,  0.0f,   0.0f, 0.0f,
+        // Bottom front right
+        1.0f, -1.0f, -1.0f,  0.0f, -0.9f,  0.0f,   1.0f, 0.0f,
+        1.0f, -1.0f, 1.0f,  0.0f, -0.9f,  0.0f,    1.0f, 1.0f,
+        -1.0f, -1.0f, 1.0f,  0.0f, -0.9f,  0.0f,   0.0f, 1.0f,
+    };
 
-    // Use loop to build Model matrix for Large Cylinder
-    for (int i = 0; i < 6; i++) {
-        // Apply Transform to model // Build model matrix for LC
-        scale = glm::scale(glm::vec3(2.0f, 0.25f, 2.0f));
-        mMat = glm::translate(glm::mat4(1.0f), glm::vec3(wLCLocX, wLCLocY, wLCLocZ));
-        mMat = glm::rotate(mMat, glm::radians(-70.f), glm::vec3(1.0f, 90.0f, 0.5f));
-        mMat = glm::rotate(mMat, glm::radians(triRotations[i]), glm::vec3(0.0f, 1.0f, 0.0f));
-        mvMat = mMat * scale;
+    auto shape = [](std::string name, const GeneratedMesh& generated, LodMesh* mesh, int segments)
+    {
+        SceneShape result;
+        result.name = name;
+        result.vertices = generated.vertices;
+        result.indices = generated.indices;
+        result.mesh = mesh;
+        result.segments = segments;
+        return result;
+    };
 
-        //Copy perspective and MV matrices to uniforms
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(mvMat));
+    std::vector<SceneShape> shapes;
+    SceneShape pyramid;
+    pyramid.name = "pyramid";
+    pyramid.vertices.assign(verts, verts + sizeof(verts) / sizeof(verts[0]));
+    pyramid.mesh = &gPyramidMesh;
+    pyramid.segments = 0;
+    shapes.push_back(pyramid);
+    for (int segments : LOD_SEGMENTS)
+    {
+        shapes.push_back(shape("cylinder/" + std::to_string(segments), generateCylinder(segments), &gCylinderMesh, segments));
+        shapes.push_back(shape("tube/" + std::to_string(segments), generateTube(segments, TAPE_INNER_RADIUS), &gTubeMesh, segments));
+    }
+    shapes.push_back(shape("box", generateBox(1), &gBoxMesh, 0));
+    return shapes;
+}
 
+// Registers every shape with gMeshes and uploads them
+void UCreateMesh()
+{
+    const GLuint floatsPerVertex = 3;
+    const GLuint floatsPerNormal = 3;
+    const GLuint floatsPerUV = 2;
 
-        glDrawArrays(GL_TRIANGLES, 0, 9);
+    const VertexAttribute floatLayout[] = {
+        { 0, floatsPerVertex, GL_FLOAT, GL_FALSE, 0 },
+        { 1, floatsPerNormal, GL_FLOAT, GL_FALSE, sizeof(float) * floatsPerVertex },
+        { 2, floatsPerUV, GL_FLOAT, GL_FALSE, sizeof(float) * (floatsPerVertex + floatsPerNormal) },
+    };
+    const VertexAttribute packedLayout[] = {
+        { 0, 3, GL_HALF_FLOAT, GL_FALSE, offsetof(PackedVertex, position) },
+        { 1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, offsetof(PackedVertex, normal) },
+        { 2, 2, GL_UNSIGNED_SHORT, GL_TRUE, offsetof(PackedVertex, uv) },
+    };
+    if (gPackedVertices)
+        gMeshes.SetLayout(sizeof(PackedVertex), packedLayout, sizeof(packedLayout) / sizeof(packedLayout[0]));
+    else
+        gMeshes.SetLayout(sizeof(float) * FLOATS_PER_VERTEX, floatLayout, sizeof(floatLayout) / sizeof(floatLayout[0]));
 
+    for (const SceneShape& shape : USceneShapes())
+    {
+        LodMesh& mesh = *shape.mesh;
+        const MeshBounds bounds = computeMeshBounds(shape.vertices.data(), shape.vertices.size() / FLOATS_PER_VERTEX, FLOATS_PER_VERTEX);
+        mesh.bounds = mesh.count == 0 ? bounds : mergeBounds(mesh.bounds, bounds);
+        mesh.levels[mesh.count] = UAddMesh(shape);
+
+        // picking reads the shape as authored; welding and reordering don't change its triangles.
+        // A soup is numbered in 32 bits, as it may have more vertices than a GLushort reaches.
+        gPickMeshes.push_back(TriangleBvh());
+        if (shape.indices.empty())
+        {
+            std::vector<uint32_t> sequential(shape.vertices.size() / FLOATS_PER_VERTEX);
+            for (size_t i = 0; i < sequential.size(); ++i)
+                sequential[i] = (uint32_t)i;
+            gPickMeshes.back().Build(shape.vertices.data(), FLOATS_PER_VERTEX, sequential.data(), sequential.size());
+        }
+        else
+            gPickMeshes.back().Build(shape.vertices.data(), FLOATS_PER_VERTEX, shape.indices.data(), shape.indices.size());
+        mesh.pickLevels[mesh.count] = &gPickMeshes.back();
+        mesh.segments[mesh.count] = shape.segments;
+        ++mesh.count;
     }
+    gMeshes.Upload();
 
-    glBindVertexArray(0);
-
-    /*-------------------  End of Large Cylinder  ---------------------------*/
-
-     /*-----------------------   Small Cylinder    ---------------------------------*/
+    const MeshRegistryStats& stats = gMeshes.Stats();
+    cout << "Meshes: " << stats.uniqueMeshes << " of " << stats.meshes << " stored, "
+         << stats.vertexBytes + stats.indexBytes << " bytes (" << stats.vertexBytes << " vertex, "
+         << stats.indexBytes << " index) for " << stats.requestedBytes << " requested" << endl;
+}
 
-    glBindVertexArray(SmallCylinderVAO);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId[3]);
+// Welds a triangle soup into indexed form (generated shapes come indexed already), orders its
+// triangles for the vertex cache and registers it with gMeshes, packed if gPackedVertices is
+// set, reporting what that saved. A shape 16-bit indices can't cover is reported and gets an
+// empty handle, which draws nothing.
+MeshHandle UAddMesh(const SceneShape& shape)
+{
+    const size_t stride = sizeof(float) * FLOATS_PER_VERTEX;
+    const size_t soupVertices = shape.vertices.size() / FLOATS_PER_VERTEX;
+    const char* name = shape.name.c_str();
 
-    // Use loop to build Model matrix for Large Cylinder
-    for (int i = 0; i < 6; i++) {
-        // Apply Transform to model // Build model matrix for LC
-        scale = glm::scale(glm::vec3(0.5f, 0.5f, 0.5f));
-        mMat = glm::translate(glm::mat4(1.0f), glm::vec3(wSCLocX, wSCLocY, wSCLocZ));
-        mMat = glm::rotate(mMat, glm::radians(-70.f), glm::vec3(1.0f, 90.0f, 0.5f));
-        mMat = glm::rotate(mMat, glm::radians(triRotations[i]), glm::vec3(0.0f, 1.0f, 0.0f));
-        mvMat = mMat * scale;
+    std::vector<unsigned char> welded;
+    std::vector<GLushort> indices;
+    if (!shape.indices.empty())
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(shape.vertices.data());
+        welded.assign(bytes, bytes + shape.vertices.size() * sizeof(GLfloat));
+        indices = shape.indices;
+    }
+    else if (!weldVertices(shape.vertices.data(), soupVertices, stride, welded, indices))
+    {
+        // more unique vertices than 16-bit indices reach, welded or not; the mesh can't be drawn
+        cerr << "Mesh " << name << ": more than " << MAX_MESH_VERTICES << " unique vertices, not drawn" << endl;
+        return MeshHandle();
+    }
+    const size_t weldedVertices = welded.size() / stride;
+    if (weldedVertices > MAX_MESH_VERTICES)
+    {
+        cerr << "Mesh " << name << ": " << weldedVertices << " vertices, more than " << MAX_MESH_VERTICES
+             << " can be indexed, not drawn" << endl;
+        return MeshHandle();
+    }
 
-        //Copy perspective and MV matrices to uniforms
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(mvMat));
+    const float acmrBefore = averageCacheMissRatio(indices.data(), indices.size(), weldedVertices);
+    optimizeVertexCache(indices.data(), indices.size(), weldedVertices);
+    const float acmrAfter = averageCacheMissRatio(indices.data(), indices.size(), weldedVertices);
+    cout << "Mesh " << name << ": " << soupVertices << " -> " << weldedVertices << " vertices, "
+         << indices.size() / 3 << " triangles, ACMR " << acmrBefore << " -> " << acmrAfter << endl;
+    if (!gPackedVertices)
+        return gMeshes.Add(welded.data(), weldedVertices, indices.data(), indices.size());
+
+    std::vector<PackedVertex> packed(weldedVertices);
+    packVertices(reinterpret_cast<const float*>(welded.data()), weldedVertices, packed.data());
+    return gMeshes.Add(packed.data(), weldedVertices, indices.data(), indices.size());
+}
 
+// --check-vertex-packing: reports, for every shape, the largest error PackedVertex introduces
+// in each attribute and what it saves, without opening a window
+int UCheckVertexPacking()
+{
+    cout << "Vertex packing: " << sizeof(float) * FLOATS_PER_VERTEX << " -> " << sizeof(PackedVertex)
+         << " bytes per vertex" << endl;
+    for (const SceneShape& shape : USceneShapes())
+    {
+        const size_t vertexCount = shape.vertices.size() / FLOATS_PER_VERTEX;
+        const VertexPackingError error = measurePackingError(shape.vertices.data(), vertexCount);
+        cout << "  " << shape.name << ": " << vertexCount << " vertices, max error position "
+             << error.position << ", normal " << error.normal << ", uv " << error.uv << endl;
+    }
+    return EXIT_SUCCESS;
+}
 
-        glDrawArrays(GL_TRIANGLES, 0, 9);
+// Fills gScene from --scene, or DEFAULT_SCENE without it, and puts the lamp at gLightPosition
+bool UCreateScene()
+{
+    std::vector<SceneObject> objects;
+    std::vector<std::string> meshNames; // SceneObject::mesh points into these for a loaded file
+    if (!gSceneFile)
+        objects.assign(DEFAULT_SCENE, DEFAULT_SCENE + sizeof(DEFAULT_SCENE) / sizeof(DEFAULT_SCENE[0]));
+    else if (!ULoadScene(gSceneFile, objects, meshNames))
+        return false;
 
+    if (objects.size() + 1 > MAX_ENTITIES)
+    {
+        cout << "Scene has " << objects.size() << " objects; at most " << MAX_ENTITIES - 1 << " fit" << endl;
+        return false;
     }
 
-    glBindVertexArray(0);
-
-    /*-------------------  End of Small Cylinder  ---------------------------*/
+    for (const SceneObject& object : objects)
+    {
+        const Material material = { object.layer, 0 };
+        gScene.Create(UFindMesh(object.mesh), material, object.position, glm::radians(object.angle), object.axis, object.scale);
+    }
+    const Material lamp = { 0, DRAW_UNLIT };
+    gScene.Create(&gPyramidMesh, lamp, gLightPosition, 0.0f, glm::vec3(0.0f, 1.0f, 0.0f), gLightScale);
+    return true;
+}
 
-    /*-----------------------------  BOX  -------------------------------*/
+// Reads a scene file: one object per line as
+//     mesh layer  x y z  angle  axisX axisY axisZ  scaleX scaleY scaleZ
+// with the angle in degrees and the mesh one of cylinder, tube, box or pyramid. Blank lines and
+// lines starting with # are skipped.
+bool ULoadScene(const char* path, std::vector<SceneObject>& objects, std::vector<std::string>& meshNames)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        cout << "Failed to open scene " << path << endl;
+        return false;
+    }
 
-    glBindVertexArray(BoxVAO);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId[4]);
+    std::vector<SceneObject> loaded;
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number)
+    {
+        std::istringstream fields(line);
+        std::string mesh;
+        if (!(fields >> mesh) || mesh[0] == '#')
+            continue;
+
+        SceneObject object;
+        fields >> object.layer >> object.position.x >> object.position.y >> object.position.z >> object.angle
+               >> object.axis.x >> object.axis.y >> object.axis.z >> object.scale.x >> object.scale.y >> object.scale.z;
+        if (!fields || !UFindMesh(mesh) || object.layer < 0 || object.layer >= TEXTURE_COUNT)
+        {
+            cout << "Scene " << path << " line " << number << ": expected mesh layer x y z angle axis(3) scale(3)" << endl;
+            return false;
+        }
+        meshNames.push_back(mesh);
+        object.mesh = nullptr;
+        loaded.push_back(object);
+    }
 
-    glm::mat4 Bscale = glm::scale(glm::vec3(5.5f, 1.5f, 8.0f));
-    glm::mat4 Brotation = glm::rotate(0.5f, glm::vec3(0.0f, 1.0f, 0.0f));
-    glm::mat4 Btranslation = glm::translate(glm::vec3(BLocX, BLocY, BLocZ));
-    glm::mat4 Bmodel = Btranslation * Brotation * Bscale;
+    // the names only stop moving once they are all in
+    for (size_t i = 0; i < loaded.size(); ++i)
+        loaded[i].mesh = meshNames[i].c_str();
+    objects.insert(objects.end(), loaded.begin(), loaded.end());
+    cout << "Loaded " << loaded.size() << " objects from " << path << endl;
+    return true;
+}
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(Bmodel));
+// nullptr for a name the scene format doesn't know
+const LodMesh* UFindMesh(const std::string& name)
+{
+    if (name == "cylinder")
+        return &gCylinderMesh;
+    if (name == "tube")
+        return &gTubeMesh;
+    if (name == "box")
+        return &gBoxMesh;
+    if (name == "pyramid")
+        return &gPyramidMesh;
+    return nullptr;
+}
 
-    glDrawArrays(GL_TRIANGLES, 0, boxVertices);
+// Makes room for MAX_ENTITIES draws. Command i reads gDrawData[i], found through the drawIndex
+// attribute, which each command starts at baseInstance = i. The contents arrive on the first
+// frame: every entity starts with a changed transform and no level of detail.
+void UCreateDrawBuffers()
+{
+    std::vector<GLuint> indices(MAX_ENTITIES);
+    for (size_t i = 0; i < indices.size(); ++i)
+        indices[i] = (GLuint)i;
+
+    gDrawData.Create(nullptr, MAX_ENTITIES);
+    gDrawData.BindBase(GL_SHADER_STORAGE_BUFFER, DRAW_DATA_BINDING);
+    gDrawCommands.Create(nullptr, MAX_ENTITIES);
+    gDrawIndices.Create(indices.data(), indices.size());
+
+    glBindVertexArray(gMeshes.Vao());
+    gDrawIndices.Bind(GL_ARRAY_BUFFER);
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(GLuint), 0);
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(3);
     glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-    /*-----------------------------  End of BOX ------------------------*/
-
-        /*---------------------------       Tape        ----------------------------------*/
-        /*-----------------------   Outer Cylinder    ---------------------------------*/
-
-    glBindVertexArray(LargeCylinderVAO);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId[6]);
-
-    // Use loop to build Model matrix for Large Cylinder
-    for (int i = 0; i < 6; i++) {
-        // Apply Transform to model // Build model matrix for LC
-        scale = glm::scale(glm::vec3(1.9f, 0.7f, 1.9f));
-        mMat = glm::translate(glm::mat4(1.0f), glm::vec3(TLCLocX, TLCLocY, TLCLocZ));
-        mMat = glm::rotate(mMat, glm::radians(45.0f), glm::vec3(0.1f, 0.0f, 0.2f));
-        mMat = glm::rotate(mMat, glm::radians(triRotations[i]), glm::vec3(0.0f, 1.0f, 0.0f));
-        mvMat = mMat * scale;
+// Rebuilds the world matrices of whatever moved since the last frame and sends just those
+// records to the GPU; with nothing moving this does no work at all
+void UUpdateTransforms()
+{
+    gDrawRecords.resize(gScene.Count());
+    std::vector<uint32_t> changed = gScene.transforms.Update();
+    for (uint32_t i : changed)
+    {
+        const glm::mat4& world = gScene.transforms.World(i);
+        DrawData& record = gDrawRecords[i];
+        const glm::mat3& normal = gScene.transforms.Normal(i);
+        record.model = world;
+        for (int column = 0; column < 3; ++column)
+            record.normal[column] = glm::vec4(normal[column], 0.0f);
+        record.layer = gScene.materials[i].layer;
+        record.flags = gScene.materials[i].flags;
+
+        // round shapes are measured by their rim: radius 1 around the axis, centred at y = -1
+        const glm::vec3& scale = gScene.transforms.Scale(i);
+        gScene.bounds[i].centre = glm::vec3(world * glm::vec4(0.0f, -1.0f, 0.0f, 1.0f));
+        gScene.bounds[i].radius = std::max(scale.x, scale.z);
+
+        const MeshBounds& local = gScene.meshes[i]->bounds;
+        gScene.volumes.Set(i, transformSphere(local.sphere, world), transformAabb(local.box, world));
+    }
 
-        //Copy perspective and MV matrices to uniforms
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(mvMat));
+    // a new or destroyed entity reshuffles slots, so the tree starts over; movement just refits
+    if (gScene.Revision() != gBvhRevision)
+    {
+        gSceneBvh.Build(gScene.volumes.boxes.data(), gScene.Count());
+        gBvhRevision = gScene.Revision();
+    }
+    else if (!changed.empty())
+        gSceneBvh.Refit(gScene.volumes.boxes.data(), changed);
+    gDrawData.UpdateIndices(gDrawRecords.data(), changed);
+    if (gOcclusionCulling)
+        gOcclusionCuller.UpdateBoxes(gScene.volumes.boxes.data(), changed);
+}
 
+// Finds the entities inside the view frustum. Big scenes walk gSceneBvh, skipping whole
+// branches out of view; small ones take a SIMD pass over every bounding sphere, then the boxes
+// of those that pass, which drops long objects whose sphere pokes into view.
+void UCullScene(const glm::mat4& viewProjection)
+{
+    const Frustum frustum = extractFrustum(viewProjection);
+    const CullVolumes& volumes = gScene.volumes;
+    const size_t count = gScene.Count();
+    gVisibleSlots.clear();
+    if (count >= BVH_CULL_MIN)
+        gSceneBvh.Cull(frustum, gVisibleSlots);
+    else
+    {
+        gVisible.resize(count);
+        cullSpheres(frustum, volumes.x.data(), volumes.y.data(), volumes.z.data(), volumes.radius.data(), count, gVisible.data());
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (gVisible[i] && !boxOutsideFrustum(frustum, volumes.boxes[i]))
+                gVisibleSlots.push_back((uint32_t)i);
+        }
+    }
 
-        glDrawArrays(GL_TRIANGLES, 0, 9);
+    if (gVisibleSlots.size() != gReportedDraws)
+    {
+        gReportedDraws = gVisibleSlots.size();
+        cout << "Drawing " << gReportedDraws << " of " << count << " objects, " << count - gReportedDraws << " culled" << endl;
+    }
+}
 
+// Moves every visible round entity to the coarsest level whose chord error stays under
+// gLodTolerance pixels on screen; entities out of view keep whatever level they had
+void UUpdateLods(const glm::mat4& projection)
+{
+    // projection[1][1] turns a view-space height into NDC; half the viewport turns NDC into pixels
+    const float pixelsPerUnit = projection[1][1] * WINDOW_HEIGHT * 0.5f;
+    const bool perspective = VIEW == PERSPEC;
+    gDrawList.resize(gScene.Count());
+    for (uint32_t i : gVisibleSlots)
+    {
+        const LodMesh& lods = *gScene.meshes[i];
+        int level = 0;
+        if (lods.count > 1)
+        {
+            // perspective sizes shrink with distance; a camera inside the rim gets the finest level
+            const Bounds& bounds = gScene.bounds[i];
+            const float distance = glm::length(bounds.centre - gCamera.Position);
+            float radiusPixels = bounds.radius * pixelsPerUnit;
+            if (perspective)
+                radiusPixels = distance > bounds.radius ? radiusPixels / distance : FLT_MAX;
+
+            while (level + 1 < lods.count && chordError(radiusPixels, lods.segments[level + 1]) <= gLodTolerance)
+                ++level;
+        }
+        if (level == gScene.lodLevels[i])
+            continue;
+
+        gScene.lodLevels[i] = level;
+        const MeshHandle& mesh = lods.levels[level];
+        DrawElementsIndirectCommand& command = gDrawList[i];
+        command.count = mesh.count;
+        command.instanceCount = 1;
+        command.firstIndex = mesh.firstIndex;
+        command.baseVertex = mesh.baseVertex;
+        command.baseInstance = i;
     }
+}
 
-    glBindVertexArray(0);
+// Sorts the visible entities' commands through gRenderQueue, nearest first, and sends them to
+// gDrawCommands, unless they are the ones already there, as they are whenever the camera and
+// the scene hold still
+void UQueueDraws(const glm::mat4& view)
+{
+    const CullVolumes& volumes = gScene.volumes;
+    const float farPlane = VIEW == PERSPEC ? PERSPECTIVE_FAR_PLANE : ORTHO_FAR_PLANE;
+    gRenderQueue.Clear();
+    for (uint32_t i : gVisibleSlots)
+    {
+        // the bounding sphere's nearest point along the view direction
+        const glm::vec4 centre = view * glm::vec4(volumes.x[i], volumes.y[i], volumes.z[i], 1.0f);
+        const uint16_t bucket = depthBucket(-centre.z - volumes.radius[i], NEAR_PLANE, farPlane);
+        gRenderQueue.Push(makeSortKey(bucket, gProgramId, gTextureArray, gMeshes.Vao()), gDrawList[i]);
+    }
+    gRenderQueue.Sort();
 
-    /*-------------------  End of Outer Cylinder  ---------------------------*/
+    const std::vector<DrawElementsIndirectCommand>& commands = gRenderQueue.Commands();
+    if (commands.size() == gDrawQueue.size() &&
+        (commands.empty() || memcmp(commands.data(), gDrawQueue.data(), commands.size() * sizeof(commands[0])) == 0))
+    {
+        return;
+    }
+    gDrawQueue = commands;
+    gDrawCommands.Update(0, gDrawQueue.size(), gDrawQueue.data());
+}
 
-     /*-----------------------   Inner Cylinder    ---------------------------------*/
+// Starts streaming every texture into its layer of one texture array; objects draw flat grey
+// until their layer arrives. Unless streaming, waits for all of them to become resident.
+bool UCreateTextures(const char* const filenames[], GLuint& textureArray, int count)
+{
+    gTextureLoadOptions.allowCompressed = GLEW_EXT_texture_compression_s3tc != 0;
+    gTextureStreamer.StartArray(filenames, count, textureArray, gMaxLayerSize, gTextureLoadOptions);
 
-    glBindVertexArray(SmallCylinderVAO);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId[5]);
+    if (gStreamTextures)
+        return true;
 
-    // Use loop to build Model matrix for Large Cylinder
-    for (int i = 0; i < 6; i++) {
-        // Apply Transform to model // Build model matrix for LC
-        scale = glm::scale(glm::vec3(1.8f, 0.7f, 1.8f));
-        mMat = glm::translate(glm::mat4(1.0f), glm::vec3(TSCLocX, TSCLocY, TSCLocZ));
-        mMat = glm::rotate(mMat, glm::radians(45.0f), glm::vec3(0.1f, 0.0f, 0.2f));
-        mMat = glm::rotate(mMat, glm::radians(triRotations[i]), glm::vec3(0.0f, 1.0f, 0.0f));
-        mvMat = mMat * scale;
+    return gTextureStreamer.Finish();
+}
 
-        //Copy perspective and MV matrices to uniforms
-        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(mvMat));
+// Writes a fresh cache file (pre-flipped full mip chain at the texture array's layer size) next
+// to every texture
+bool UBakeTextures(const char* const filenames[], int count)
+{
+    TextureLoadOptions options = gTextureLoadOptions;
+    options.useCache = true;
+    options.rebuildCache = true;
+    options.layerSize = chooseTextureLayerSize(filenames, count, gMaxLayerSize, options);
 
+    const char* formatNames[] = { "RGB8", "RGBA8", "BC1", "BC3" };
 
-        glDrawArrays(GL_TRIANGLES, 0, 9);
+    TextureDecodePool pool(0, options);
+    for (int i = 0; i < count; ++i)
+        pool.Submit(i, filenames[i]);
 
+    bool success = true;
+    DecodedImage image;
+    while (pool.WaitNext(image))
+    {
+        if (image.Valid())
+        {
+            cout << "Baked " << textureCachePath(image.filename, options.layerSize) << ": " << image.width << "x" << image.height << " "
+                 << formatNames[image.format] << ", " << image.levels.size() << " levels" << endl;
+            if (image.decodeStats.allocations > 0)
+                cout << "  decode " << describeDecodeArenaStats(image.decodeStats) << endl;
+        }
+        else
+        {
+            cout << "Failed to bake " << image.filename << " (" << image.error << ")" << endl;
+            success = false;
+        }
+        image.Free();
     }
 
-    glBindVertexArray(0);
-
-    /*-------------------  End of Inner Cylinder  ---------------------------*/
-
-    /****************************** Lamp ***********************************/
-    
-    glUseProgram(gLampProgramId);
-
-    model = glm::translate(gLightPosition) * glm::scale(gLightScale);
-
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
+    return success;
+}
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+// Times the original byte loop against the SIMD row swaps, and against letting stb_image
+// write rows bottom-up so no flip pass runs at all
+int UBenchmarkFlip(const char* filename)
+{
+    typedef chrono::steady_clock Clock;
+    const int iterations = 20;
 
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices);
+    vector<unsigned char> source;
+    if (!readFileBytes(filename, source))
+    {
+        cout << "Failed to open " << filename << endl;
+        return EXIT_FAILURE;
+    }
 
-    glBindVertexArray(0);
-    glUseProgram(0);
+    int width, height, channels;
+    unsigned char* image = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 0);
+    if (!image)
+    {
+        cout << "Failed to decode " << filename << endl;
+        return EXIT_FAILURE;
+    }
+    cout << filename << ": " << width << "x" << height << "x" << channels << endl;
 
-    /*********************** End of Lamp ***********************************/
+    const char* kernelNames[] = { "bytewise loop", "scalar 8-byte", "SSE2", "AVX2" };
+    for (int kernel = FLIP_BYTEWISE; kernel <= FLIP_AVX2; ++kernel)
+    {
+#ifndef CPU_X86_SIMD
+        if (kernel >= FLIP_SSE2)
+            break;
+#endif
+        if (kernel == FLIP_AVX2 && !cpuHasAVX2())
+            break;
+
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < iterations; ++i)
+            flipImageVertically(image, width, height, channels, (FlipKernel)kernel);
+        double ms = chrono::duration<double, milli>(Clock::now() - start).count() / iterations;
+        cout << "  flip, " << kernelNames[kernel] << ": " << ms << " ms" << endl;
+    }
+    stbi_image_free(image);
 
+    // whole decodes, so the flip cost shows relative to what it sits next to
+    const char* modeNames[] = { "decode only", "decode + best flip", "decode flipped by stb_image" };
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        stbi_set_flip_vertically_on_load_thread(mode == 2);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < iterations / 4; ++i)
+        {
+            image = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 0);
+            if (!image)
+            {
+                cout << "Failed to decode " << filename << " (" << modeNames[mode] << ")" << endl;
+                stbi_set_flip_vertically_on_load_thread(0);
+                return EXIT_FAILURE;
+            }
+            if (mode == 1)
+                flipImageVertically(image, width, height, channels);
+            stbi_image_free(image);
+        }
+        double ms = chrono::duration<double, milli>(Clock::now() - start).count() / (iterations / 4);
+        cout << "  " << modeNames[mode] << ": " << ms << " ms" << endl;
+    }
+    stbi_set_flip_vertically_on_load_thread(0);
 
-    glfwSwapBuffers(gWindow);
+    return EXIT_SUCCESS;
 }
 
-// Create mesh
-void UCreateMesh(GLMesh& mesh)
+// --bench-bvh: build, refit and query times of the scene Bvh over synthetic scenes of 10k to 1M
+// props, against the one-by-one passes it replaces, whose answers it has to match
+int UBenchmarkBvh()
 {
-    GLfloat verts[] = {
-        //Positions          // Normals           //Texture Coordinates
-        // Front face
-        0.0f,  1.0f,  0.0f,  0.0f,  0.45f, 0.9f,  1.0f, 0.0f,
-        -1.0f, -1.0f, 1.0f,  0.0f,  0.45f, 0.9f,  1.0f, 1.0f,
-        1.0f,  -1.0f, 1.0f,  0.0f,  0.45f, 0.9f,  0.0f, 1.0f,
-        // Right face
-        0.0f,  1.0f,  0.0f,  0.9f,  0.45f, 0.0f,  1.0f, 0.0f,
-        1.0f, -1.0f,  1.0f,  0.9f,  0.45f, 0.0f,  1.0f, 1.0f,
-        1.0f,  -1.0f, -1.0f,  0.9f,  0.45f, 0.0f,  0.0f, 1.0f,
-        // Back face
-        0.0f,  1.0f,  0.0f, 0.0f,  0.45f, -0.9f,  1.0f, 0.0f,
-        1.0f,  -1.0f, -1.0f, 0.0f,  0.45f, -0.9f,  1.0f, 1.0f,
-        -1.0f, -1.0f, -1.0f, 0.0f,  0.45f, -0.9f,  0.0f, 1.0f,
-        // Left face
-        0.0f,  1.0f,  0.0f,  -0.9f,  0.45f, 0.0f,  1.0f, 0.0f,
-        -1.0f, -1.0f, -1.0f,  -0.9f,  0.45f, 0.0f,  1.0f, 1.0f,
-        -1.0f, -1.0f, 1.0f,  -0.9f,  0.45f, 0.0f,  0.0f, 1.0f,
-        // Bottom back left
-        -1.0f, -1.0f, 1.0f,  0.0f, -0.9f,  0.0f,   1.0f, 1.0f,
-        -1.0f, -1.0f, -1.0f,  0.0f, -0.9f,  0.0f,  1.0f, 0.0f,
-        1.0f, -1.0f, -1.0f,  0.0f, -0.9f,  0.0f,   0.0f, 0.0f,
-        // Bottom front right
-        1.0f, -1.0f, -1.0f,  0.0f, -0.9f,  0.0f,   1.0f, 0.0f,
-        1.0f, -1.0f, 1.0f,  0.0f, -0.9f,  0.0f,    1.0f, 1.0f,
-        -1.0f, -1.0f, 1.0f,  0.0f, -0.9f,  0.0f,   0.0f, 1.0f,
-    };
-
-    // Define vertex data for Large Cylinder
-    GLfloat cylinderVertices[] = {
-        // positon attributes (x,y,z)
-        // triangle 1
-        0.0f, 0.0f, 0.0f,  // vert 1
-        0.0f, 0.43f, 0.0, // Normals
-        0.5f, 1.0f, // middle top
-
-        0.5f, 0.0f, 0.866f, // vert 2
-        0.0f, 0.43f, 0.0f, 
-        0.0f, 0.0f, // left top
-
-        1.0f, 0.0f, 0.0f, // vert 3
-        0.0f, 0.43f, 0.0f,
-        1.0f, 0.0f,  // right top
-        // triangle 2
-        0.5f, 0.0f, 0.866f, // vert 4
-        0.87f, 0.0f, 0.5f,
-        1.0f, 1.0f, // top right side
-
-        0.5f, -2.0f, 0.866f, // vert 5
-        0.87f, 0.0f, 0.5f,
-        1.0f, 0.0f,  // bottom right side	
-
-        1.0f, 0.0f, 0.0f, // vert 6
-        0.87f, 0.0f, 0.5f,
-        0.0f, 1.0f, // bottom left side
-        // triangle 3
-        1.0f, 0.0f, 0.0f, // vert 7
-        0.87f, 0.0f, 0.5f,
-        0.0f, 1.0f, // right top
-
-        1.0f, -2.0f, 0.0f, // vert 8
-        0.87f, 0.0f, 0.5f,
-        0.0f, 0.0f,  // blue
-
-        0.5f, -2.0f, 0.866f, // vert 9
-        0.87f, 0.0f, 0.5f,
-        1.0f, 0.0f, // bottom right side
-    };
-
-    // Define vertex data for Plane
-    GLfloat PlaneVertices[] = {
-        // Plane1
-        24.0f,  -2.0f,  24.0f,  0.0f, 1.0f, 0.0f,  1.0f, 1.0f, // Top-Right Vertex 0
-        24.0f,  -2.0f, -24.0f,  0.0f, 1.0f, 0.0f,  1.0f, 0.0f, // Bottom-Right Vertex 1
-        -24.0f, -2.0f,  24.0f,  0.0f, 1.0f, 0.0f,  0.0f, 1.0f, // Top-Left Vertex 3
-
-        24.0f,  -2.0f, -24.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f, // Bottom-Right Vertex 1
-        -24.0f, -2.0f, -24.0f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f, // Bottom-Left Vertex 2
-        -24.0f, -2.0f,  24.0f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f, // Top-Left Vertex 3
-
-        // Plane 2
-        24.0f,  -2.0f,  24.0f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f, // Top-Right Vertex 0
-        24.0f,  -2.0f, -24.0f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f, // Bottom-Right Vertex 1
-        24.0f,  -9.0f,  -24.0f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f, // 4 br  right
-
-        24.0f,  -2.0f,  24.0f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f, // Top-Right Vertex 0
-        24.0f,  -9.0f,  -24.0f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f, // 4 br  right
-        24.0f,  -9.0f,   24.0f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f, //  5 tl  right
-
-        // Plane 3
-        24.0f,  -2.0f,  24.0f, 0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // Top-Right Vertex 0
-        24.0f,  -9.0f,   24.0f, 0.0f,  0.0f, -1.0f,  1.0f, 0.0f, //  5 tl  right
-        -24.0f, -9.0f,   24.0f, 0.0f,  0.0f, -1.0f,  0.0f, 0.0f, //  6 tl  top
-
-        24.0f,  -2.0f,  24.0f, 0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // Top-Right Vertex 0
-        -24.0f, -2.0f,  24.0f, 0.0f,  0.0f, -1.0f,  0.0f, 1.0f, // Top-Left Vertex 3
-        -24.0f, -9.0f,  -24.0f, 0.0f,  0.0f, -1.0f,  0.0f, 1.0f, //  7 bl back
-
-        // Plane 4
-        24.0f,  -9.0f,  -24.0f, 0.0f, -1.0f,  0.0f,  1.0f, 1.0f, // 4 br  right
-        24.0f,  -9.0f,   24.0f, 0.0f, -1.0f,  0.0f,  1.0f, 0.0f, //  5 tl  right
-        -24.0f, -9.0f,   24.0f, 0.0f, -1.0f,  0.0f,  0.0f, 0.0f, //  6 tl  top
-
-        24.0f,  -9.0f,  -24.0f, 0.0f, -1.0f,  0.0f,  1.0f, 1.0f, // 4 br  right
-        -24.0f, -9.0f,   24.0f, 0.0f, -1.0f,  0.0f,  0.0f, 0.0f, //  6 tl  top
-        -24.0f, -9.0f,  -24.0f, 0.0f, -1.0f,  0.0f,  0.0f, 1.0f, //  7 bl back
-
-        // Plane 5
-        -24.0f, -2.0f, -24.0f, 1.0f,  0.0f,  0.0f,  0.0f, 0.0f, // Bottom-Left Vertex 2
-        -24.0f, -2.0f,  24.0f, 1.0f,  0.0f,  0.0f,  0.0f, 1.0f, // Top-Left Vertex 3
-        -24.0f, -9.0f,   24.0f, 1.0f,  0.0f,  0.0f,  0.0f, 0.0f, //  6 tl  top
-
-        -24.0f, -2.0f, -24.0f, 1.0f,  0.0f,  0.0f,  0.0f, 0.0f, // Bottom-Left Vertex 2
-        -24.0f, -9.0f,   24.0f, 1.0f,  0.0f,  0.0f,  0.0f, 0.0f, //  6 tl  top
-        -24.0f, -9.0f,  -24.0f, 1.0f,  0.0f,  0.0f,  0.0f, 1.0f, //  7 bl back
-
-        // Plane 6
-        24.0f,  -2.0f, -24.0f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f, // Bottom-Right Vertex 1
-        24.0f,  -9.0f,  -24.0f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f, // 4 br  right
-        -24.0f, -9.0f,  -24.0f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f, //  7 bl back
-
-        24.0f,  -2.0f, -24.0f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f, // Bottom-Right Vertex 1
-        -24.0f, -2.0f, -24.0f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f, // Bottom-Left Vertex 2
-        -24.0f, -9.0f,  -24.0f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f, //  7 bl back
-    };
-
-    GLfloat BoxVertices[] = {
-        //Positions          //Normals
-        // ------------------------------------------------------
-        //Back Face          //Negative Z Normal  Texture Coords.
-       -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-        0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-        0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-        0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-       -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
-       -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-
-       //Front Face         //Positive Z Normal
-      -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-       0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
-       0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-       0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-      -0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
-      -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-
-      //Left Face          //Negative X Normal
-     -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-     -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-     -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-     -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-     -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-     -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-
-     //Right Face         //Positive X Normal
-     0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-     0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-     0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-     0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-     0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-     0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-
-     //Bottom Face        //Negative Y Normal
-     -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-     0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-     0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-     0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-     -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-     -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-
-    //Top Face           //Positive Y Normal
-     -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-     0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-     0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-     0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-     -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-     -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
-    };
+    typedef chrono::steady_clock Clock;
+    const size_t sizes[] = { 1000, 10000, 100000, 1000000 };
+    const int views = 16;
+    const int queries = 10000;
+    mt19937 random(1);
 
+    for (size_t count : sizes)
+    {
+        // props up to a unit across, at the same density whatever the count
+        const float extent = 2.0f * std::cbrt((float)count);
+        uniform_real_distribution<float> place(-extent, extent);
+        uniform_real_distribution<float> size(0.1f, 0.5f);
+        vector<Aabb> boxes(count);
+        vector<float> x(count), y(count), z(count), radius(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const glm::vec3 centre(place(random), place(random) * 0.1f, place(random));
+            const glm::vec3 half(size(random), size(random), size(random));
+            boxes[i].min = centre - half;
+            boxes[i].max = centre + half;
+            x[i] = centre.x;
+            y[i] = centre.y;
+            z[i] = centre.z;
+            radius[i] = glm::length(half);
+        }
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+        Bvh bvh;
+        Clock::time_point start = Clock::now();
+        bvh.Build(boxes.data(), count);
+        const double buildMs = chrono::duration<double, milli>(Clock::now() - start).count();
+        cout << count << " objects: " << bvh.NodeCount() << " nodes, build " << buildMs << " ms" << endl;
 
-    boxVertices = sizeof(BoxVertices) / (sizeof(BoxVertices[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    // Pyramind
-    glGenVertexArrays(1, &mesh.vao);
-    glBindVertexArray(mesh.vao);
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
-    glBindVertexArray(0);
-    
-    // Large Cynlinder 
-    glGenVertexArrays(1, &LargeCylinderVAO); // Create VAO
-    glGenBuffers(1, &LargeCylinderVBO); // Create VBO
-    glBindVertexArray(LargeCylinderVAO); // Activate VAO for VBO association
-    glBindBuffer(GL_ARRAY_BUFFER, LargeCylinderVBO); // Enable VBO	
-    glBufferData(GL_ARRAY_BUFFER, sizeof(cylinderVertices), cylinderVertices, GL_STATIC_DRAW); // Copy Vertex data to VBO
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0); // Associate VBO with VA (Vertex Attribute)
-    glEnableVertexAttribArray(0); // Enable VA
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float)* (floatsPerVertex + floatsPerNormal))); // Associate VBO with VA
-    glEnableVertexAttribArray(2); // Enable VA
-    glBindVertexArray(0); // Unbind VAO (Optional but recommended)
-
-     // Small Cynlinder
-    glGenVertexArrays(1, &SmallCylinderVAO); // Create VAO
-    glGenBuffers(1, &SmallCylinderVBO); // Create VBO
-    glBindVertexArray(SmallCylinderVAO); // Activate VAO for VBO association
-    glBindBuffer(GL_ARRAY_BUFFER, SmallCylinderVBO); // Enable VBO	
-    glBufferData(GL_ARRAY_BUFFER, sizeof(cylinderVertices), cylinderVertices, GL_STATIC_DRAW); // Copy Vertex data to VBO
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0); // Associate VBO with VA (Vertex Attribute)
-    glEnableVertexAttribArray(0); // Enable VA
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));  // Associate VBO with VA
-    glEnableVertexAttribArray(2); // Enable VA
-    glBindVertexArray(0); // Unbind VAO (Optional but recommended)
-
-    // Plane
-    glGenVertexArrays(1, &PlaneVAO); // Create VAO
-    glBindVertexArray(PlaneVAO);
-    glGenBuffers(1, PlaneVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, PlaneVBO[0]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(PlaneVertices), PlaneVertices, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
-    glBindVertexArray(0);
+        // a hundredth of the props nudged, then all of them
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            vector<uint32_t> moved;
+            const size_t movedCount = pass == 0 ? count / 100 : count;
+            for (size_t k = 0; k < movedCount; ++k)
+            {
+                const uint32_t i = pass == 0 ? (uint32_t)(random() % count) : (uint32_t)k;
+                const glm::vec3 offset(size(random), 0.0f, -size(random));
+                boxes[i].min += offset;
+                boxes[i].max += offset;
+                moved.push_back(i);
+            }
+            start = Clock::now();
+            bvh.Refit(boxes.data(), moved);
+            const double ms = chrono::duration<double, milli>(Clock::now() - start).count();
+            cout << "  refit " << movedCount << " moved: " << ms << " ms" << endl;
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            const glm::vec3 centre = (boxes[i].min + boxes[i].max) * 0.5f;
+            x[i] = centre.x;
+            z[i] = centre.z;
+        }
 
-    // Box
-    glGenVertexArrays(1, &BoxVAO);
-    glBindVertexArray(BoxVAO);
-    glGenBuffers(1, &BoxVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, BoxVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(BoxVertices), BoxVertices, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
-    glBindVertexArray(0);
+        // a camera at the middle turning through a full circle
+        const glm::mat4 projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 1000.0f);
+        vector<uint32_t> visible;
+        vector<uint8_t> passed(count);
+        double treeMs = 0.0, linearMs = 0.0;
+        size_t drawn = 0;
+        bool mismatch = false;
+        for (int v = 0; v < views; ++v)
+        {
+            const float angle = glm::radians(360.0f * v / views);
+            const glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 2.0f, 0.0f), glm::vec3(std::cos(angle), 1.5f, std::sin(angle)), glm::vec3(0.0f, 1.0f, 0.0f));
+            const Frustum frustum = extractFrustum(projection * view);
+
+            visible.clear();
+            start = Clock::now();
+            bvh.Cull(frustum, visible);
+            treeMs += chrono::duration<double, milli>(Clock::now() - start).count();
+            drawn += visible.size();
+
+            size_t linearCount = 0;
+            start = Clock::now();
+            cullSpheres(frustum, x.data(), y.data(), z.data(), radius.data(), count, passed.data());
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (passed[i] && !boxOutsideFrustum(frustum, boxes[i]))
+                    ++linearCount;
+            }
+            linearMs += chrono::duration<double, milli>(Clock::now() - start).count();
+            mismatch = mismatch || linearCount != visible.size();
+        }
+        cout << "  frustum cull, " << drawn / views << " visible: " << treeMs / views << " ms, one by one "
+             << linearMs / views << " ms" << (mismatch ? " (MISMATCH)" : "") << endl;
+
+        // nearest prop along random rays through the scene; the first hundred checked by hand
+        uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        double rayUs = 0.0;
+        size_t hits = 0;
+        mismatch = false;
+        for (int q = 0; q < queries; ++q)
+        {
+            const glm::vec3 origin(place(random), 0.0f, place(random));
+            glm::vec3 direction(unit(random), unit(random) * 0.1f, unit(random));
+            direction = glm::normalize(direction);
+            const glm::vec3 inverse(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+            auto boxDistance = [&](uint32_t i, float limit)
+            {
+                const glm::vec3 t0 = (boxes[i].min - origin) * inverse;
+                const glm::vec3 t1 = (boxes[i].max - origin) * inverse;
+                const glm::vec3 near = glm::min(t0, t1);
+                const glm::vec3 far = glm::max(t0, t1);
+                const float enter = std::max(std::max(near.x, near.y), std::max(near.z, 0.0f));
+                const float exit = std::min(std::min(far.x, far.y), std::min(far.z, limit));
+                return enter <= exit ? enter : -1.0f;
+            };
+
+            float distance = 2.0f * extent;
+            uint32_t primitive = 0;
+            start = Clock::now();
+            const bool hit = bvh.Raycast(origin, direction, distance, primitive, boxDistance);
+            rayUs += chrono::duration<double, micro>(Clock::now() - start).count();
+            hits += hit ? 1 : 0;
+
+            if (q < 100)
+            {
+                float nearest = 2.0f * extent;
+                bool any = false;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    const float t = boxDistance((uint32_t)i, nearest);
+                    if (t >= 0.0f && t <= nearest)
+                    {
+                        nearest = t;
+                        any = true;
+                    }
+                }
+                mismatch = mismatch || any != hit || (hit && nearest != distance);
+            }
+        }
+        cout << "  raycast, " << hits * 100 / queries << "% hit: " << rayUs / queries << " us" << (mismatch ? " (MISMATCH)" : "") << endl;
 
-}
-// Deletes mesh 
-void UDestroyMesh(GLMesh& mesh)
-{
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(1, &mesh.vbo);
+        // what a camera-sized box touches
+        double overlapUs = 0.0;
+        size_t touched = 0;
+        vector<uint32_t> overlapping;
+        for (int q = 0; q < queries; ++q)
+        {
+            const glm::vec3 centre(place(random), 0.0f, place(random));
+            const Aabb probe = { centre - glm::vec3(0.5f), centre + glm::vec3(0.5f) };
+            overlapping.clear();
+            start = Clock::now();
+            bvh.Overlap(probe, overlapping);
+            overlapUs += chrono::duration<double, micro>(Clock::now() - start).count();
+            touched += overlapping.size();
+        }
+        cout << "  overlap, " << (double)touched / queries << " touched: " << overlapUs / queries << " us" << endl;
+    }
+    return EXIT_SUCCESS;
 }
 
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// --bench-pick: TriangleBvh build and ray times on a rippled height field of two million
+// triangles, for each intersection kernel and against testing every triangle, whose answers
+// they have to match
+int UBenchmarkPick()
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    typedef chrono::steady_clock Clock;
+    const int size = 1000; // quads along each side
+    const int rays = 10000;
+    const int bruteForceRays = 20;
+
+    vector<float> vertices;
+    vertices.reserve((size_t)(size + 1) * (size + 1) * 3);
+    for (int j = 0; j <= size; ++j)
     {
-        flipImageVertically(image, width, height, channels);
+        for (int i = 0; i <= size; ++i)
+        {
+            const float x = 100.0f * i / size - 50.0f;
+            const float z = 100.0f * j / size - 50.0f;
+            vertices.push_back(x);
+            vertices.push_back(2.0f * std::sin(x * 0.3f) * std::cos(z * 0.2f));
+            vertices.push_back(z);
+        }
+    }
+    vector<uint32_t> indices;
+    indices.reserve((size_t)size * size * 6);
+    for (int j = 0; j < size; ++j)
+    {
+        for (int i = 0; i < size; ++i)
+        {
+            const uint32_t corner = (uint32_t)(j * (size + 1) + i);
+            const uint32_t quad[6] = { corner, corner + 1, corner + size + 2, corner, corner + size + 2, corner + size + 1 };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+    TriangleBvh mesh;
+    Clock::time_point start = Clock::now();
+    mesh.Build(vertices.data(), 3, indices.data(), indices.size());
+    cout << mesh.TriangleCount() << " triangles: build " << chrono::duration<double, milli>(Clock::now() - start).count() << " ms" << endl;
+
+    // rays down onto the surface from all over, at a slant
+    mt19937 random(1);
+    uniform_real_distribution<float> place(-60.0f, 60.0f);
+    uniform_real_distribution<float> slant(-0.5f, 0.5f);
+    vector<glm::vec3> origins(rays), directions(rays);
+    for (int r = 0; r < rays; ++r)
+    {
+        origins[r] = glm::vec3(place(random), 10.0f, place(random));
+        directions[r] = glm::normalize(glm::vec3(slant(random), -1.0f, slant(random)));
+    }
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    const char* kernelNames[] = { "scalar", "SSE2", "AVX2" };
+    vector<float> reference(rays);
+    for (int kernel = TRIANGLES_SCALAR; kernel <= TRIANGLES_AVX2; ++kernel)
+    {
+#ifndef CPU_X86_SIMD
+        if (kernel >= TRIANGLES_SSE2)
+            break;
+#endif
+        if (kernel == TRIANGLES_AVX2 && !cpuHasAVX2())
+            break;
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
+        int hits = 0, mismatches = 0;
+        start = Clock::now();
+        for (int r = 0; r < rays; ++r)
         {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
+            float distance = FLT_MAX;
+            uint32_t triangle;
+            hits += mesh.Raycast(origins[r], directions[r], distance, triangle, (TriangleKernel)kernel) ? 1 : 0;
+            if (kernel == TRIANGLES_SCALAR)
+                reference[r] = distance;
+            else if (std::fabs(distance - reference[r]) > 1e-3f * std::max(1.0f, reference[r]))
+                ++mismatches;
         }
+        const double us = chrono::duration<double, micro>(Clock::now() - start).count() / rays;
+        cout << "  " << kernelNames[kernel] << ": " << us << " us per ray, " << hits * 100 / rays << "% hit";
+        if (mismatches > 0)
+            cout << " (" << mismatches << " MISMATCHES)";
+        cout << endl;
+    }
 
-        glGenerateMipmap(GL_TEXTURE_2D);
+    // every triangle, no hierarchy
+    const TriangleLanes lanes = mesh.Lanes();
+    int mismatches = 0;
+    start = Clock::now();
+    for (int r = 0; r < bruteForceRays; ++r)
+    {
+        float distance = FLT_MAX;
+        uint32_t lane;
+        intersectTrianglesScalar(lanes, origins[r], directions[r], 0, (uint32_t)mesh.TriangleCount(), distance, lane);
+        if (std::fabs(distance - reference[r]) > 1e-3f * std::max(1.0f, reference[r]))
+            ++mismatches;
+    }
+    const double us = chrono::duration<double, micro>(Clock::now() - start).count() / bruteForceRays;
+    cout << "  every triangle: " << us << " us per ray" << (mismatches > 0 ? " (MISMATCH)" : "") << endl;
+    return EXIT_SUCCESS;
+}
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+// Decode throughput of the scene's JPEGs with stb_image's kernels capped at portable C (what a
+// STBI_NO_SIMD build runs), SSE2 and AVX2, decoding the way the loader does
+int UBenchmarkJpeg(const char* const filenames[], int count)
+{
+    typedef chrono::steady_clock Clock;
+    const int iterations = 5;
+    const char* levelNames[] = { "scalar", "SSE2", "AVX2" };
+    const int levels = cpuHasAVX2() ? 3 : 2;
 
-        return true;
+    if (gTextureLoadOptions.parallelDecode)
+        stbi_set_parallel_for(&TaskPool::StbParallelFor, &TaskPool::Shared());
+
+    double totalMs[3] = { 0.0, 0.0, 0.0 };
+    double totalPixels = 0.0;
+    for (int file = 0; file < count; ++file)
+    {
+        const char* extension = strrchr(filenames[file], '.');
+        vector<unsigned char> source;
+        if (!extension || strcmp(extension, ".jpg") != 0 || !readFileBytes(filenames[file], source))
+            continue;
+
+        unsigned char* reference = NULL;
+        int width = 0, height = 0, channels = 0;
+        cout << filenames[file] << ":";
+        for (int level = 0; level < levels; ++level)
+        {
+            stbi_set_jpeg_simd_limit(level);
+            Clock::time_point start = Clock::now();
+            for (int i = 0; i < iterations; ++i)
+            {
+                unsigned char* image = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 0);
+                if (!image)
+                    break;
+
+                // every level has to produce the scalar output exactly
+                if (!reference)
+                    reference = image;
+                else
+                {
+                    if (memcmp(image, reference, (size_t)width * height * channels) != 0)
+                        cout << " (" << levelNames[level] << " MISMATCH)";
+                    stbi_image_free(image);
+                }
+            }
+            double ms = chrono::duration<double, milli>(Clock::now() - start).count() / iterations;
+            totalMs[level] += ms;
+            cout << " " << levelNames[level] << " " << ms << " ms";
+        }
+        cout << endl;
+        totalPixels += (double)width * height;
+        stbi_image_free(reference);
     }
+    stbi_set_jpeg_simd_limit(2);
+
+    for (int level = 0; level < levels; ++level)
+        cout << "  " << levelNames[level] << ": " << totalPixels / (totalMs[level] * 1000.0) << " Mpixel/s, "
+             << totalMs[0] / totalMs[level] << "x scalar" << endl;
 
-    // Error loading the image
-    return false;
+    return EXIT_SUCCESS;
 }
 
 void UDestroyTexture(GLuint textureId)
 {
-    glGenTextures(1, &textureId);
+    glDeleteTextures(1, &textureId);
 }
 
 // Create shaders
@@ -1152,6 +1979,42 @@ bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSou
     return true;
 }
 
+// Compiles and links a compute shader
+bool UCreateComputeProgram(const char* shaderSource, GLuint& programId)
+{
+    int success = 0;
+    char infoLog[512];
+
+    programId = glCreateProgram();
+    GLuint shaderId = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shaderId, 1, &shaderSource, NULL);
+    glCompileShader(shaderId);
+
+    glGetShaderiv(shaderId, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(shaderId, sizeof(infoLog), NULL, infoLog);
+        cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n" << infoLog << endl;
+
+        return false;
+    }
+
+    glAttachShader(programId, shaderId);
+    glLinkProgram(programId);
+    glDeleteShader(shaderId);
+
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+        cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << endl;
+
+        return false;
+    }
+
+    return true;
+}
+
 // Deletes shader
 void UDestroyShaderProgram(GLuint programId)
 {
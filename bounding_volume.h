@@ -0,0 +1,101 @@
+#ifndef BOUNDING_VOLUME_H
+#define BOUNDING_VOLUME_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include <glm/glm.hpp>
+
+// Axis-aligned box
+struct Aabb
+{
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+struct BoundingSphere
+{
+    glm::vec3 centre;
+    float radius;
+};
+
+// Both volumes of one mesh, in its own space. The box is the tighter of the two; the sphere is
+// the cheaper to test and to carry through a rotation.
+struct MeshBounds
+{
+    Aabb box;
+    BoundingSphere sphere;
+};
+
+// Bounds of count vertices whose first three floats are the position, floatsPerVertex floats
+// apart. The sphere is centred on the box and reaches the farthest vertex.
+inline MeshBounds computeMeshBounds(const float* vertices, size_t count, size_t floatsPerVertex)
+{
+    MeshBounds bounds = {};
+    if (count == 0)
+        return bounds;
+
+    bounds.box.min = bounds.box.max = glm::vec3(vertices[0], vertices[1], vertices[2]);
+    for (size_t i = 1; i < count; ++i)
+    {
+        const float* v = vertices + i * floatsPerVertex;
+        const glm::vec3 position(v[0], v[1], v[2]);
+        bounds.box.min = glm::min(bounds.box.min, position);
+        bounds.box.max = glm::max(bounds.box.max, position);
+    }
+
+    bounds.sphere.centre = (bounds.box.min + bounds.box.max) * 0.5f;
+    float radiusSquared = 0.0f;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const float* v = vertices + i * floatsPerVertex;
+        const glm::vec3 offset = glm::vec3(v[0], v[1], v[2]) - bounds.sphere.centre;
+        radiusSquared = std::max(radiusSquared, glm::dot(offset, offset));
+    }
+    bounds.sphere.radius = std::sqrt(radiusSquared);
+    return bounds;
+}
+
+// Volumes holding both a and b, for a shape whose levels of detail differ slightly in extent
+inline MeshBounds mergeBounds(const MeshBounds& a, const MeshBounds& b)
+{
+    MeshBounds merged;
+    merged.box.min = glm::min(a.box.min, b.box.min);
+    merged.box.max = glm::max(a.box.max, b.box.max);
+    merged.sphere.centre = (merged.box.min + merged.box.max) * 0.5f;
+    merged.sphere.radius = std::max(glm::length(a.sphere.centre - merged.sphere.centre) + a.sphere.radius,
+                                    glm::length(b.sphere.centre - merged.sphere.centre) + b.sphere.radius);
+    return merged;
+}
+
+// The world box around a transformed local box, without transforming its eight corners (Arvo,
+// "Transforming Axis-Aligned Bounding Boxes", Graphics Gems, 1990)
+inline Aabb transformAabb(const Aabb& box, const glm::mat4& world)
+{
+    Aabb result;
+    result.min = result.max = glm::vec3(world[3]);
+    for (int column = 0; column < 3; ++column)
+    {
+        const glm::vec3 axis(world[column]);
+        const glm::vec3 a = axis * box.min[column];
+        const glm::vec3 b = axis * box.max[column];
+        result.min += glm::min(a, b);
+        result.max += glm::max(a, b);
+    }
+    return result;
+}
+
+// The sphere stretched by the world matrix's largest axis scale, so it still holds the mesh
+inline BoundingSphere transformSphere(const BoundingSphere& sphere, const glm::mat4& world)
+{
+    const float scaleSquared = std::max(std::max(glm::dot(glm::vec3(world[0]), glm::vec3(world[0])),
+                                                 glm::dot(glm::vec3(world[1]), glm::vec3(world[1]))),
+                                        glm::dot(glm::vec3(world[2]), glm::vec3(world[2])));
+    BoundingSphere result;
+    result.centre = glm::vec3(world * glm::vec4(sphere.centre, 1.0f));
+    result.radius = sphere.radius * std::sqrt(scaleSquared);
+    return result;
+}
+
+#endif
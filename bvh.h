@@ -0,0 +1,532 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <cfloat>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "bounding_volume.h"
+#include "frustum.h"
+
+// One node of a Bvh. A leaf (count > 0) holds count primitives starting at first in the
+// primitive order; an inner node (count 0) has its two children at first and first + 1.
+struct BvhNode
+{
+    Aabb box;
+    uint32_t first;
+    uint32_t count;
+};
+static_assert(sizeof(BvhNode) == 32, "BvhNode should stay two to a cache line");
+
+// Bounding volume hierarchy over primitives given as boxes, numbered by their index in the array
+// Build was given. Nodes live in one array, children side by side, built top down with the
+// surface area heuristic over binned centroids. When primitives move, Refit grows and shrinks
+// the boxes above them without changing the tree; it stays correct however far things move,
+// but only a Build restores its quality.
+class Bvh
+{
+public:
+    // leafSize of 0 leaves leaf sizes to the surface area heuristic; otherwise nodes of up to
+    // leafSize primitives always become leaves, for callers that test a leaf's primitives in
+    // one batch
+    void Build(const Aabb* primitiveBoxes, size_t count, uint32_t leafSize = 0)
+    {
+        boxes.assign(primitiveBoxes, primitiveBoxes + count);
+        primitives.resize(count);
+        records.resize(count);
+        nodes.clear();
+        parents.clear();
+        leafOf.assign(count, NONE);
+        if (count == 0)
+            return;
+
+        Aabb centroidBox = {};
+        Aabb rootBox = boxes[0];
+        for (size_t i = 0; i < count; ++i)
+        {
+            BuildRecord& record = records[i];
+            record.box = boxes[i];
+            record.centroid = (boxes[i].min + boxes[i].max) * 0.5f;
+            record.primitive = (uint32_t)i;
+            if (i == 0)
+                centroidBox.min = centroidBox.max = record.centroid;
+            centroidBox.min = glm::min(centroidBox.min, record.centroid);
+            centroidBox.max = glm::max(centroidBox.max, record.centroid);
+            grow(rootBox, record.box);
+        }
+
+        nodes.reserve(count * 2);
+        BvhNode root = { rootBox, 0, (uint32_t)count };
+        nodes.push_back(root);
+        parents.push_back(NONE);
+        std::vector<BuildTask> pending(1, BuildTask{ 0, 0, centroidBox });
+        while (!pending.empty())
+        {
+            const BuildTask task = pending.back();
+            pending.pop_back();
+            Aabb childBoxes[2];
+            Aabb childCentroids[2];
+            const uint32_t split = nodes[task.node].count <= leafSize ? 0 :
+                splitNode(task.node, task.centroidBox, task.depth >= MAX_SAH_DEPTH, childBoxes, childCentroids);
+            if (split == 0)
+            {
+                for (uint32_t i = 0; i < nodes[task.node].count; ++i)
+                {
+                    const uint32_t primitive = records[nodes[task.node].first + i].primitive;
+                    primitives[nodes[task.node].first + i] = primitive;
+                    leafOf[primitive] = task.node;
+                }
+                continue;
+            }
+
+            const BvhNode node = nodes[task.node];
+            const uint32_t left = (uint32_t)nodes.size();
+            BvhNode children[2] = { { childBoxes[0], node.first, split }, { childBoxes[1], node.first + split, node.count - split } };
+            nodes.push_back(children[0]);
+            nodes.push_back(children[1]);
+            parents.push_back(task.node);
+            parents.push_back(task.node);
+            nodes[task.node].first = left;
+            nodes[task.node].count = 0;
+            pending.push_back(BuildTask{ left + 1, task.depth + 1, childCentroids[1] });
+            pending.push_back(BuildTask{ left, task.depth + 1, childCentroids[0] });
+        }
+        records.clear();
+        records.shrink_to_fit();
+    }
+
+    // Takes the new boxes of the changed primitives and fixes the boxes of every node above them
+    void Refit(const Aabb* primitiveBoxes, const std::vector<uint32_t>& changed)
+    {
+        for (uint32_t primitive : changed)
+            boxes[primitive] = primitiveBoxes[primitive];
+
+        // with much of the scene moving, one pass over every node beats walking up from each
+        // leaf; children always sit after their parent, so back to front visits them first
+        if (changed.size() * 8 > boxes.size())
+        {
+            for (size_t index = nodes.size(); index-- > 0;)
+            {
+                BvhNode& node = nodes[index];
+                if (node.count > 0)
+                    node.box = rangeBox(node.first, node.count);
+                else
+                {
+                    node.box = nodes[node.first].box;
+                    grow(node.box, nodes[node.first + 1].box);
+                }
+            }
+            return;
+        }
+
+        for (uint32_t primitive : changed)
+        {
+            uint32_t index = leafOf[primitive];
+            nodes[index].box = rangeBox(nodes[index].first, nodes[index].count);
+            for (index = parents[index]; index != NONE; index = parents[index])
+            {
+                const BvhNode& left = nodes[nodes[index].first];
+                const BvhNode& right = nodes[nodes[index].first + 1];
+                const Aabb box = { glm::min(left.box.min, right.box.min), glm::max(left.box.max, right.box.max) };
+                if (sameBox(box, nodes[index].box))
+                    break; // nothing above can change either
+                nodes[index].box = box;
+            }
+        }
+    }
+
+    // Appends every primitive whose box reaches inside the frustum. A node found wholly inside
+    // a plane stops testing against it, so subtrees in the middle of the view cost no tests.
+    void Cull(const Frustum& frustum, std::vector<uint32_t>& visible) const
+    {
+        if (nodes.empty())
+            return;
+
+        struct Task
+        {
+            uint32_t node;
+            uint32_t planes; // bit p set while plane p still has to be tested
+        };
+        Task stack[STACK_SIZE];
+        size_t top = 0;
+        stack[top++] = Task{ 0, ALL_PLANES };
+        while (top > 0)
+        {
+            const Task task = stack[--top];
+            const BvhNode& node = nodes[task.node];
+            uint32_t planes = task.planes;
+            if (planes != 0 && !clipPlanes(frustum, node.box, planes))
+                continue;
+
+            if (node.count == 0)
+            {
+                stack[top++] = Task{ node.first + 1, planes };
+                stack[top++] = Task{ node.first, planes };
+                continue;
+            }
+            for (uint32_t i = 0; i < node.count; ++i)
+            {
+                const uint32_t primitive = primitives[node.first + i];
+                uint32_t primitivePlanes = planes;
+                if (primitivePlanes == 0 || node.count == 1 || clipPlanes(frustum, boxes[primitive], primitivePlanes))
+                    visible.push_back(primitive);
+            }
+        }
+    }
+
+    // Nearest hit along origin + t * direction for t in [0, distance]. intersect(primitive, limit)
+    // is called for primitives whose box the ray reaches before the best hit so far, and returns
+    // the primitive's own hit distance, or a negative one or one past limit for a miss. On a hit,
+    // returns true with distance and primitive set.
+    template <typename Intersect>
+    bool Raycast(const glm::vec3& origin, const glm::vec3& direction, float& distance, uint32_t& primitive,
+                 Intersect intersect) const
+    {
+        const glm::vec3 inverse(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+        return RaycastLeaves(origin, direction, distance, [&](uint32_t first, uint32_t count, float& limit)
+        {
+            bool hit = false;
+            for (uint32_t i = first; i < first + count; ++i)
+            {
+                const uint32_t candidate = primitives[i];
+                if (count > 1 && slabDistance(boxes[candidate], origin, inverse, limit) == FLT_MAX)
+                    continue;
+                const float t = intersect(candidate, limit);
+                if (t >= 0.0f && t <= limit)
+                {
+                    limit = t;
+                    primitive = candidate;
+                    hit = true;
+                }
+            }
+            return hit;
+        });
+    }
+
+    // Raycast a leaf at a time, for callers that test a leaf's primitives together:
+    // intersect(first, count, distance) gets the leaf's range in leaf order (see Primitive),
+    // and on a hit lowers distance to it and returns true. Leaves are visited nearest first,
+    // and any whose box starts beyond the best hit so far are skipped.
+    template <typename IntersectLeaf>
+    bool RaycastLeaves(const glm::vec3& origin, const glm::vec3& direction, float& distance, IntersectLeaf intersect) const
+    {
+        if (nodes.empty())
+            return false;
+
+        struct Task
+        {
+            uint32_t node;
+            float enter; // where the ray enters its box
+        };
+        const glm::vec3 inverse(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+        bool hit = false;
+        Task stack[STACK_SIZE];
+        size_t top = 0;
+        const float rootEnter = slabDistance(nodes[0].box, origin, inverse, distance);
+        if (rootEnter < FLT_MAX)
+            stack[top++] = Task{ 0, rootEnter };
+        while (top > 0)
+        {
+            const Task task = stack[--top];
+            if (task.enter > distance)
+                continue; // a hit found since it was pushed is nearer than all of it
+            const BvhNode& node = nodes[task.node];
+            if (node.count > 0)
+            {
+                hit = intersect(node.first, node.count, distance) || hit;
+                continue;
+            }
+
+            // nearer child on top, so it is searched first and can rule the other one out
+            const float left = slabDistance(nodes[node.first].box, origin, inverse, distance);
+            const float right = slabDistance(nodes[node.first + 1].box, origin, inverse, distance);
+            const bool leftFirst = left <= right;
+            const Task nearTask = { leftFirst ? node.first : node.first + 1, leftFirst ? left : right };
+            const Task farTask = { leftFirst ? node.first + 1 : node.first, leftFirst ? right : left };
+            if (farTask.enter < FLT_MAX)
+                stack[top++] = farTask;
+            if (nearTask.enter < FLT_MAX)
+                stack[top++] = nearTask;
+        }
+        return hit;
+    }
+
+    // Appends every primitive whose box overlaps box, such as the objects near the camera
+    void Overlap(const Aabb& box, std::vector<uint32_t>& hits) const
+    {
+        if (nodes.empty())
+            return;
+
+        uint32_t stack[STACK_SIZE];
+        size_t top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const BvhNode& node = nodes[stack[--top]];
+            if (!overlaps(node.box, box))
+                continue;
+            if (node.count == 0)
+            {
+                stack[top++] = node.first + 1;
+                stack[top++] = node.first;
+                continue;
+            }
+            for (uint32_t i = 0; i < node.count; ++i)
+            {
+                const uint32_t primitive = primitives[node.first + i];
+                if (overlaps(boxes[primitive], box))
+                    hits.push_back(primitive);
+            }
+        }
+    }
+
+    size_t Count() const { return boxes.size(); }
+    // The primitive at a position in leaf order
+    uint32_t Primitive(uint32_t order) const { return primitives[order]; }
+    size_t NodeCount() const { return nodes.size(); }
+    const Aabb& Box(uint32_t primitive) const { return boxes[primitive]; }
+
+private:
+    enum : uint32_t
+    {
+        NONE = 0xFFFFFFFF,
+        LEAF_SIZE = 4,      // most primitives a leaf gets while splitting still pays
+        TRAVERSAL_COST = 1, // of visiting an inner node, in box tests
+        BINS = 16,          // candidate split planes per axis
+        MAX_SAH_DEPTH = 40, // below this, nodes are halved instead, which bounds the depth
+        STACK_SIZE = 80,    // deepest traversal: MAX_SAH_DEPTH plus halving 2^32 primitives
+        ALL_PLANES = 0x3F
+    };
+
+    static bool sameBox(const Aabb& a, const Aabb& b)
+    {
+        return a.min == b.min && a.max == b.max;
+    }
+
+    static bool overlaps(const Aabb& a, const Aabb& b)
+    {
+        return a.min.x <= b.max.x && a.max.x >= b.min.x && a.min.y <= b.max.y && a.max.y >= b.min.y &&
+               a.min.z <= b.max.z && a.max.z >= b.min.z;
+    }
+
+    static float halfArea(const Aabb& box)
+    {
+        const glm::vec3 size = box.max - box.min;
+        return size.x * size.y + size.y * size.z + size.z * size.x;
+    }
+
+    static void grow(Aabb& box, const Aabb& other)
+    {
+        box.min = glm::min(box.min, other.min);
+        box.max = glm::max(box.max, other.max);
+    }
+
+    // False if the box is outside one of the planes still set in planes; otherwise clears the
+    // bits of the planes it is wholly inside
+    static bool clipPlanes(const Frustum& frustum, const Aabb& box, uint32_t& planes)
+    {
+        for (int p = 0; p < 6; ++p)
+        {
+            if (!(planes & (1u << p)))
+                continue;
+            const glm::vec4& plane = frustum.planes[p];
+            const glm::vec3 normal(plane);
+            const glm::vec3 farthest(plane.x >= 0.0f ? box.max.x : box.min.x, plane.y >= 0.0f ? box.max.y : box.min.y,
+                                     plane.z >= 0.0f ? box.max.z : box.min.z);
+            if (glm::dot(normal, farthest) + plane.w < 0.0f)
+                return false;
+            const glm::vec3 nearest(plane.x >= 0.0f ? box.min.x : box.max.x, plane.y >= 0.0f ? box.min.y : box.max.y,
+                                    plane.z >= 0.0f ? box.min.z : box.max.z);
+            if (glm::dot(normal, nearest) + plane.w >= 0.0f)
+                planes &= ~(1u << p);
+        }
+        return true;
+    }
+
+    // Where the ray enters the box, or FLT_MAX if it misses it or enters beyond maxDistance
+    static float slabDistance(const Aabb& box, const glm::vec3& origin, const glm::vec3& inverse, float maxDistance)
+    {
+        const glm::vec3 t0 = (box.min - origin) * inverse;
+        const glm::vec3 t1 = (box.max - origin) * inverse;
+        const glm::vec3 near = glm::min(t0, t1);
+        const glm::vec3 far = glm::max(t0, t1);
+        const float enter = std::max(std::max(near.x, near.y), std::max(near.z, 0.0f));
+        const float exit = std::min(std::min(far.x, far.y), std::min(far.z, maxDistance));
+        return enter <= exit ? enter : FLT_MAX;
+    }
+
+    Aabb rangeBox(uint32_t first, uint32_t count) const
+    {
+        Aabb box = boxes[primitives[first]];
+        for (uint32_t i = 1; i < count; ++i)
+            grow(box, boxes[primitives[first + i]]);
+        return box;
+    }
+
+    // Box and centroid bounds of count build records from first
+    void recordBounds(uint32_t first, uint32_t count, Aabb& box, Aabb& centroidBox) const
+    {
+        box = records[first].box;
+        centroidBox.min = centroidBox.max = records[first].centroid;
+        for (uint32_t i = 1; i < count; ++i)
+        {
+            grow(box, records[first + i].box);
+            centroidBox.min = glm::min(centroidBox.min, records[first + i].centroid);
+            centroidBox.max = glm::max(centroidBox.max, records[first + i].centroid);
+        }
+    }
+
+    // Picks where to split a node's primitives: the binned split with the lowest surface area
+    // cost over all three axes, or the median along the widest axis when halve is set. Reorders
+    // the primitives so the left child's come first and returns how many that is, with both
+    // children's boxes and centroid bounds; or returns 0 to make the node a leaf.
+    uint32_t splitNode(uint32_t index, const Aabb& centroidBox, bool halve, Aabb childBoxes[2], Aabb childCentroids[2])
+    {
+        const BvhNode& node = nodes[index];
+        if (node.count <= 1 || (halve && node.count <= LEAF_SIZE))
+            return 0;
+
+        BuildRecord* begin = records.data() + node.first;
+        BuildRecord* end = begin + node.count;
+        const glm::vec3 extent = centroidBox.max - centroidBox.min;
+        uint32_t split = node.count / 2;
+        if (halve || (extent.x <= 0.0f && extent.y <= 0.0f && extent.z <= 0.0f))
+        {
+            // every centroid in one spot is halved too: any split is as good as another
+            const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+            std::nth_element(begin, begin + split, end, [axis](const BuildRecord& a, const BuildRecord& b) { return a.centroid[axis] < b.centroid[axis]; });
+            recordBounds(node.first, split, childBoxes[0], childCentroids[0]);
+            recordBounds(node.first + split, node.count - split, childBoxes[1], childCentroids[1]);
+            return split;
+        }
+
+        // one pass sorts every primitive into a bin on each axis; small nodes get fewer bins
+        const uint32_t binCount = std::min((uint32_t)BINS, std::max(node.count, 4u));
+        struct Bin
+        {
+            Aabb box;
+            Aabb centroids;
+            uint32_t count;
+        };
+        Bin bins[3][BINS];
+        glm::vec3 scale;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            scale[axis] = extent[axis] > 0.0f ? binCount / extent[axis] : 0.0f;
+            for (uint32_t b = 0; b < binCount; ++b)
+                bins[axis][b].count = 0;
+        }
+        auto binOf = [&](const glm::vec3& centroid, int axis)
+        {
+            return std::min((uint32_t)((centroid[axis] - centroidBox.min[axis]) * scale[axis]), binCount - 1);
+        };
+        for (const BuildRecord* record = begin; record != end; ++record)
+        {
+            const glm::vec3& centroid = record->centroid;
+            const Aabb& box = record->box;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                Bin& bin = bins[axis][binOf(centroid, axis)];
+                if (bin.count++ == 0)
+                {
+                    bin.box = box;
+                    bin.centroids.min = bin.centroids.max = centroid;
+                    continue;
+                }
+                grow(bin.box, box);
+                bin.centroids.min = glm::min(bin.centroids.min, centroid);
+                bin.centroids.max = glm::max(bin.centroids.max, centroid);
+            }
+        }
+
+        // cost of splitting after bin b: a visit, plus left area * left count + right area * right count
+        float bestCost = FLT_MAX;
+        int bestAxis = -1;
+        uint32_t bestBin = 0;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (extent[axis] <= 0.0f)
+                continue;
+            float rightCosts[BINS];
+            Bin right = {};
+            for (uint32_t b = binCount - 1; b > 0; --b)
+            {
+                merge(right, bins[axis][b]);
+                rightCosts[b - 1] = right.count > 0 ? halfArea(right.box) * right.count : 0.0f;
+            }
+            Bin left = {};
+            for (uint32_t b = 0; b + 1 < binCount; ++b)
+            {
+                merge(left, bins[axis][b]);
+                if (left.count == 0 || left.count == node.count)
+                    continue;
+                const float cost = halfArea(node.box) * TRAVERSAL_COST + halfArea(left.box) * left.count + rightCosts[b];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        // a leaf costs one box test per primitive; keep it if no split beats that
+        const float leafCost = halfArea(node.box) * node.count;
+        if (bestAxis < 0 || (node.count <= LEAF_SIZE && bestCost >= leafCost))
+            return 0;
+
+        Bin sides[2] = {};
+        for (uint32_t b = 0; b < binCount; ++b)
+            merge(sides[b <= bestBin ? 0 : 1], bins[bestAxis][b]);
+        std::partition(begin, end, [&](const BuildRecord& record) { return binOf(record.centroid, bestAxis) <= bestBin; });
+        for (int side = 0; side < 2; ++side)
+        {
+            childBoxes[side] = sides[side].box;
+            childCentroids[side] = sides[side].centroids;
+        }
+        return sides[0].count;
+    }
+
+    template <typename Bin>
+    static void merge(Bin& into, const Bin& bin)
+    {
+        if (bin.count == 0)
+            return;
+        if (into.count == 0)
+            into = bin;
+        else
+        {
+            grow(into.box, bin.box);
+            grow(into.centroids, bin.centroids);
+            into.count += bin.count;
+        }
+    }
+
+    // A primitive as Build moves it around, everything splitting looks at in one place
+    struct BuildRecord
+    {
+        Aabb box;
+        glm::vec3 centroid;
+        uint32_t primitive;
+    };
+
+    struct BuildTask
+    {
+        uint32_t node;
+        uint32_t depth;
+        Aabb centroidBox; // of its primitives' centroids
+    };
+
+    std::vector<BvhNode> nodes;
+    std::vector<Aabb> boxes;            // by primitive
+    std::vector<uint32_t> primitives;   // leaf order
+    std::vector<uint32_t> parents;      // by node
+    std::vector<uint32_t> leafOf;       // by primitive
+    std::vector<BuildRecord> records;   // while building
+};
+
+#endif
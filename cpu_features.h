@@ -0,0 +1,45 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+// x86 builds always have SSE2 (x64, or 32-bit MSVC with its default /arch:SSE2). AVX2 code is
+// compiled into every build and only chosen at runtime, so it is tagged with CPU_AVX2_TARGET.
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define CPU_X86_SIMD
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CPU_AVX2_TARGET
+#else
+#define CPU_AVX2_TARGET __attribute__((target("avx2,fma")))
+#endif
+#endif
+
+// True when the CPU and the OS both support AVX2 (the OS must save the upper YMM state)
+inline bool cpuHasAVX2()
+{
+#if defined(CPU_X86_SIMD) && defined(_MSC_VER)
+    static const bool supported = []
+    {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool fma = (info[2] & (1 << 12)) != 0;
+        if (!osxsave || !fma || (_xgetbv(0) & 6) != 6)
+            return false;
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+    }();
+    return supported;
+#elif defined(CPU_X86_SIMD)
+    static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef DECODE_ARENA_H
+#define DECODE_ARENA_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Bump allocation for stb_image
+   Source.cpp points STBI_MALLOC, STBI_REALLOC_SIZED and STBI_FREE at decodeArenaMalloc and
+   friends. While a thread has a DecodeArena installed (DecodeArenaScope), everything stb_image
+   allocates comes out of that arena; anywhere else it falls through to the heap. Every block
+   starts with a small header naming its arena, so a block can be freed from any thread. */
+
+// What one decode asked for, to size the arenas by
+struct DecodeArenaStats
+{
+    size_t peakBytes;   // most arena memory in use at once, headers and dead blocks included
+    int allocations;    // malloc and realloc calls that handed out a new block
+    int chunkMallocs;   // times the arena itself had to go to the heap
+
+    DecodeArenaStats() : peakBytes(0), allocations(0), chunkMallocs(0) {}
+};
+
+// e.g. "peak 12.4 MB in 9 allocations, arena grew 1 time"
+inline std::string describeDecodeArenaStats(const DecodeArenaStats& stats)
+{
+    char text[96];
+    snprintf(text, sizeof(text), "peak %.1f MB in %d allocations, arena grew %d time%s",
+        stats.peakBytes / (1024.0 * 1024.0), stats.allocations, stats.chunkMallocs, stats.chunkMallocs == 1 ? "" : "s");
+    return text;
+}
+
+class DecodeArena
+{
+public:
+    static const size_t ALIGNMENT = 16;
+
+    explicit DecodeArena(size_t initialBytes = 0) : used(0), inUse(0)
+    {
+        if (initialBytes)
+            AddChunk(initialBytes);
+        stats = DecodeArenaStats();
+    }
+
+    ~DecodeArena()
+    {
+        for (Chunk& chunk : chunks)
+            free(chunk.memory);
+    }
+
+    DecodeArena(const DecodeArena&) = delete;
+    DecodeArena& operator=(const DecodeArena&) = delete;
+
+    void* Allocate(size_t size)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++stats.allocations;
+        return Bump(size);
+    }
+
+    // grows the newest block in place when it has room; otherwise copies into a fresh block
+    void* Reallocate(void* p, size_t newSize)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Header* header = HeaderOf(p);
+        if (IsTop(header))
+        {
+            Chunk& chunk = chunks[used];
+            const size_t oldBytes = BlockBytes(header->size);
+            const size_t newBytes = BlockBytes(newSize);
+            if (newBytes <= chunk.size - chunk.top + oldBytes)
+            {
+                chunk.top = chunk.top - oldBytes + newBytes;
+                inUse = inUse - oldBytes + newBytes;
+                stats.peakBytes = std::max(stats.peakBytes, inUse);
+                header->size = newSize;
+                return p;
+            }
+        }
+
+        ++stats.allocations;
+        void* q = Bump(newSize);
+        if (q)
+            memcpy(q, p, std::min(header->size, newSize));
+        return q;
+    }
+
+    // only the newest block gives its memory back; the rest waits for Reset
+    void Free(void* p)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Header* header = HeaderOf(p);
+        if (IsTop(header))
+        {
+            const size_t bytes = BlockBytes(header->size);
+            chunks[used].top -= bytes;
+            inUse -= bytes;
+        }
+    }
+
+    // Forgets every block but keeps the memory. If the last decode spilled into extra chunks
+    // they are merged into one, so the next decode of the same size never leaves the arena.
+    void Reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (chunks.size() > 1)
+        {
+            size_t total = 0;
+            for (Chunk& chunk : chunks)
+            {
+                total += chunk.size;
+                free(chunk.memory);
+            }
+            chunks.clear();
+            AddChunk(total);
+        }
+        for (Chunk& chunk : chunks)
+            chunk.top = 0;
+        used = 0;
+        inUse = 0;
+        stats = DecodeArenaStats();
+    }
+
+    DecodeArenaStats Stats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    size_t Capacity()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t total = 0;
+        for (const Chunk& chunk : chunks)
+            total += chunk.size;
+        return total;
+    }
+
+    // arena the calling thread allocates from, or nullptr for the heap
+    static DecodeArena*& Current()
+    {
+        static thread_local DecodeArena* current = nullptr;
+        return current;
+    }
+
+    // 16 bytes ahead of every block, arena or heap, so blocks keep malloc's alignment
+    struct alignas(16) Header
+    {
+        DecodeArena* owner; // nullptr for a heap block
+        size_t size;        // bytes the caller asked for
+    };
+
+    static Header* HeaderOf(void* p) { return (Header*)p - 1; }
+
+private:
+    struct Chunk
+    {
+        char* memory;
+        size_t size;
+        size_t top; // bytes handed out from the front
+    };
+
+    static size_t BlockBytes(size_t size)
+    {
+        return (sizeof(Header) + size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    bool IsTop(Header* header) const
+    {
+        if (chunks.empty())
+            return false;
+        const Chunk& chunk = chunks[used];
+        return (char*)header >= chunk.memory && (char*)header + BlockBytes(header->size) == chunk.memory + chunk.top;
+    }
+
+    bool AddChunk(size_t size)
+    {
+        Chunk chunk;
+        chunk.memory = (char*)malloc(size);
+        if (!chunk.memory)
+            return false;
+        chunk.size = size;
+        chunk.top = 0;
+        chunks.push_back(chunk);
+        ++stats.chunkMallocs;
+        return true;
+    }
+
+    // expects the lock to be held
+    void* Bump(size_t size)
+    {
+        const size_t bytes = BlockBytes(size);
+        if (chunks.empty() || chunks[used].size - chunks[used].top < bytes)
+        {
+            // at least double, so a decode that keeps growing only spills a few times
+            const size_t last = chunks.empty() ? 0 : chunks.back().size;
+            if (!AddChunk(std::max(bytes, std::max(last * 2, (size_t)1 << 20))))
+                return nullptr;
+            used = chunks.size() - 1;
+        }
+
+        Chunk& chunk = chunks[used];
+        Header* header = (Header*)(chunk.memory + chunk.top);
+        header->owner = this;
+        header->size = size;
+        chunk.top += bytes;
+        inUse += bytes;
+        stats.peakBytes = std::max(stats.peakBytes, inUse);
+        return header + 1;
+    }
+
+    std::vector<Chunk> chunks;
+    size_t used;  // chunk currently bumped from, always the newest
+    size_t inUse; // bytes handed out across all chunks
+    DecodeArenaStats stats;
+    std::mutex mutex;
+};
+
+// Installs an arena on the calling thread for its lifetime; nullptr selects the heap
+class DecodeArenaScope
+{
+public:
+    explicit DecodeArenaScope(DecodeArena* arena) : previous(DecodeArena::Current())
+    {
+        DecodeArena::Current() = arena;
+    }
+
+    ~DecodeArenaScope()
+    {
+        DecodeArena::Current() = previous;
+    }
+
+    DecodeArenaScope(const DecodeArenaScope&) = delete;
+    DecodeArenaScope& operator=(const DecodeArenaScope&) = delete;
+
+private:
+    DecodeArena* previous;
+};
+
+// Arenas shared by the workers of one decode pool. A lease resets its arena and puts it back
+// when the last copy goes away, which may be after the pool itself is gone.
+class DecodeArenaPool : public std::enable_shared_from_this<DecodeArenaPool>
+{
+public:
+    explicit DecodeArenaPool(size_t initialBytes = 0) : initialBytes(initialBytes) {}
+
+    std::shared_ptr<DecodeArena> Acquire()
+    {
+        DecodeArena* arena = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!idle.empty())
+            {
+                arena = idle.back().release();
+                idle.pop_back();
+            }
+        }
+        if (!arena)
+            arena = new DecodeArena(initialBytes);
+
+        std::shared_ptr<DecodeArenaPool> self = shared_from_this();
+        return std::shared_ptr<DecodeArena>(arena, [self](DecodeArena* returned) { self->Release(returned); });
+    }
+
+    // total memory the idle arenas are holding on to
+    size_t IdleBytes()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t total = 0;
+        for (std::unique_ptr<DecodeArena>& arena : idle)
+            total += arena->Capacity();
+        return total;
+    }
+
+private:
+    void Release(DecodeArena* arena)
+    {
+        arena->Reset();
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.emplace_back(arena);
+    }
+
+    size_t initialBytes;
+    std::vector<std::unique_ptr<DecodeArena> > idle;
+    std::mutex mutex;
+};
+
+// STBI_MALLOC / STBI_REALLOC_SIZED / STBI_FREE targets
+inline void* decodeArenaMalloc(size_t size)
+{
+    if (DecodeArena* arena = DecodeArena::Current())
+        return arena->Allocate(size);
+
+    DecodeArena::Header* header = (DecodeArena::Header*)malloc(sizeof(DecodeArena::Header) + size);
+    if (!header)
+        return nullptr;
+    header->owner = nullptr;
+    header->size = size;
+    return header + 1;
+}
+
+inline void decodeArenaFree(void* p)
+{
+    if (!p)
+        return;
+    DecodeArena::Header* header = DecodeArena::HeaderOf(p);
+    if (header->owner)
+        header->owner->Free(p);
+    else
+        free(header);
+}
+
+inline void* decodeArenaRealloc(void* p, size_t oldSize, size_t newSize)
+{
+    (void)oldSize; // the header already knows
+    if (!p)
+        return decodeArenaMalloc(newSize);
+
+    DecodeArena::Header* header = DecodeArena::HeaderOf(p);
+    if (header->owner)
+        return header->owner->Reallocate(p, newSize);
+
+    DecodeArena::Header* grown = (DecodeArena::Header*)realloc(header, sizeof(DecodeArena::Header) + newSize);
+    if (!grown)
+        return nullptr;
+    grown->size = newSize;
+    return grown + 1;
+}
+
+#endif
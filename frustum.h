@@ -0,0 +1,107 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "bounding_volume.h"
+#include "cpu_features.h"
+
+// The six planes of a view volume as (normal, distance), normals unit length and pointing
+// inwards: a point p is inside a plane when dot(normal, p) + distance >= 0
+struct Frustum
+{
+    glm::vec4 planes[6]; // left, right, bottom, top, near, far
+};
+
+// Planes of the clip volume -w <= x, y, z <= w of a projection * view matrix, in world space
+// (Gribb and Hartmann, "Fast Extraction of Viewing Frustum Planes from the World-View-Projection
+// Matrix", 2001). Works for perspective and orthographic projections alike.
+inline Frustum extractFrustum(const glm::mat4& viewProjection)
+{
+    const glm::mat4 m = glm::transpose(viewProjection); // rows of the matrix as columns
+    Frustum frustum;
+    frustum.planes[0] = m[3] + m[0];
+    frustum.planes[1] = m[3] - m[0];
+    frustum.planes[2] = m[3] + m[1];
+    frustum.planes[3] = m[3] - m[1];
+    frustum.planes[4] = m[3] + m[2];
+    frustum.planes[5] = m[3] - m[2];
+    for (glm::vec4& plane : frustum.planes)
+        plane = plane * (1.0f / glm::length(glm::vec3(plane)));
+    return frustum;
+}
+
+// Sets visible[i] to 1 for every sphere that reaches inside all six planes and 0 for the rest.
+// Spheres come as separate x, y, z and radius arrays so the SIMD version can load four at once.
+// A sphere near a corner of the frustum can pass without touching it; that only costs a draw.
+inline void cullSpheresScalar(const Frustum& frustum, const float* x, const float* y, const float* z,
+                              const float* radius, size_t count, uint8_t* visible)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        bool inside = true;
+        for (const glm::vec4& plane : frustum.planes)
+            inside = inside && plane.x * x[i] + plane.y * y[i] + plane.z * z[i] + plane.w >= -radius[i];
+        visible[i] = inside ? 1 : 0;
+    }
+}
+
+#ifdef CPU_X86_SIMD
+inline void cullSpheresSSE2(const Frustum& frustum, const float* x, const float* y, const float* z,
+                            const float* radius, size_t count, uint8_t* visible)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 px = _mm_loadu_ps(x + i);
+        const __m128 py = _mm_loadu_ps(y + i);
+        const __m128 pz = _mm_loadu_ps(z + i);
+        const __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (const glm::vec4& plane : frustum.planes)
+        {
+            __m128 distance = _mm_mul_ps(px, _mm_set1_ps(plane.x));
+            distance = _mm_add_ps(distance, _mm_mul_ps(py, _mm_set1_ps(plane.y)));
+            distance = _mm_add_ps(distance, _mm_mul_ps(pz, _mm_set1_ps(plane.z)));
+            distance = _mm_add_ps(distance, _mm_set1_ps(plane.w));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+        }
+        const int mask = _mm_movemask_ps(inside);
+        visible[i] = (uint8_t)(mask & 1);
+        visible[i + 1] = (uint8_t)((mask >> 1) & 1);
+        visible[i + 2] = (uint8_t)((mask >> 2) & 1);
+        visible[i + 3] = (uint8_t)((mask >> 3) & 1);
+    }
+    cullSpheresScalar(frustum, x + i, y + i, z + i, radius + i, count - i, visible + i);
+}
+#endif
+
+inline void cullSpheres(const Frustum& frustum, const float* x, const float* y, const float* z,
+                        const float* radius, size_t count, uint8_t* visible)
+{
+#ifdef CPU_X86_SIMD
+    cullSpheresSSE2(frustum, x, y, z, radius, count, visible);
+#else
+    cullSpheresScalar(frustum, x, y, z, radius, count, visible);
+#endif
+}
+
+// True when the box lies wholly outside one of the planes: its corner farthest along the
+// plane's normal is still behind it. Tighter than the sphere test for long, thin objects.
+inline bool boxOutsideFrustum(const Frustum& frustum, const Aabb& box)
+{
+    for (const glm::vec4& plane : frustum.planes)
+    {
+        const glm::vec3 farthest(plane.x >= 0.0f ? box.max.x : box.min.x, plane.y >= 0.0f ? box.max.y : box.min.y,
+                                 plane.z >= 0.0f ? box.max.z : box.min.z);
+        if (glm::dot(glm::vec3(plane), farthest) + plane.w < 0.0f)
+            return true;
+    }
+    return false;
+}
+
+#endif
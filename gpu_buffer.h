@@ -0,0 +1,95 @@
+#ifndef GPU_BUFFER_H
+#define GPU_BUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
+
+// One command of glMultiDrawElementsIndirect, in the layout GL reads from GL_DRAW_INDIRECT_BUFFER
+struct DrawElementsIndirectCommand
+{
+    GLuint count;         // indices per instance
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;     // added to every index
+    GLuint baseInstance;  // offset added to instanced attribute fetches
+};
+
+// A fixed-length array of T in GPU memory. The storage is immutable (glBufferStorage), so the
+// driver never has to reallocate it; individual elements can still be rewritten with Update.
+template <typename T>
+class GpuArray
+{
+public:
+    GpuArray() : buffer(0), count(0) {}
+
+    GpuArray(const GpuArray&) = delete;
+    GpuArray& operator=(const GpuArray&) = delete;
+
+    // data may be nullptr to leave the contents undefined until the first Update
+    void Create(const T* data, size_t elements)
+    {
+        count = elements;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferStorage(GL_COPY_WRITE_BUFFER, sizeof(T) * count, data, GL_DYNAMIC_STORAGE_BIT);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    void Update(size_t first, size_t elements, const T* data)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, sizeof(T) * first, sizeof(T) * elements, data);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    // Copies elements back to the CPU. Waits for the GPU to finish writing them, so read what
+    // was written a few frames ago rather than this one.
+    void Read(size_t first, size_t elements, T* data) const
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, sizeof(T) * first, sizeof(T) * elements, data);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    }
+
+    // Uploads mirror[i] for every i in indices, one glBufferSubData per run of consecutive
+    // indices. mirror is the CPU copy of the whole array; indices gets sorted.
+    void UpdateIndices(const T* mirror, std::vector<uint32_t>& indices)
+    {
+        std::sort(indices.begin(), indices.end());
+        for (size_t i = 0; i < indices.size();)
+        {
+            size_t end = i + 1;
+            while (end < indices.size() && indices[end] <= indices[end - 1] + 1)
+                ++end;
+            const uint32_t first = indices[i];
+            Update(first, indices[end - 1] + 1 - first, mirror + first);
+            i = end;
+        }
+    }
+
+    void Bind(GLenum target) const { glBindBuffer(target, buffer); }
+
+    // for indexed targets such as GL_SHADER_STORAGE_BUFFER
+    void BindBase(GLenum target, GLuint index) const { glBindBufferBase(target, index, buffer); }
+
+    void Destroy()
+    {
+        glDeleteBuffers(1, &buffer);
+        buffer = 0;
+        count = 0;
+    }
+
+    GLuint Id() const { return buffer; }
+    size_t Count() const { return count; }
+    size_t Bytes() const { return sizeof(T) * count; }
+
+private:
+    GLuint buffer;
+    size_t count;
+};
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef MESH_GENERATOR_H
+#define MESH_GENERATOR_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "vertex_format.h"
+
+// An indexed mesh in the authored vertex layout (FLOATS_PER_VERTEX floats: position, normal, UV)
+struct GeneratedMesh
+{
+    std::vector<float> vertices;
+    std::vector<uint16_t> indices;
+
+    size_t VertexCount() const { return vertices.size() / FLOATS_PER_VERTEX; }
+
+    uint16_t AddVertex(float x, float y, float z, float nx, float ny, float nz, float u, float v)
+    {
+        const float vertex[FLOATS_PER_VERTEX] = { x, y, z, nx, ny, nz, u, v };
+        vertices.insert(vertices.end(), vertex, vertex + FLOATS_PER_VERTEX);
+        return (uint16_t)(VertexCount() - 1);
+    }
+
+    // Adds a triangle, flipped if need be so it winds counter-clockwise seen from the side
+    // its first vertex's normal points to. Generators then only have to say which vertices
+    // make a triangle, not which way round.
+    void AddTriangle(uint16_t a, uint16_t b, uint16_t c)
+    {
+        const float* pa = &vertices[a * FLOATS_PER_VERTEX];
+        const float* pb = &vertices[b * FLOATS_PER_VERTEX];
+        const float* pc = &vertices[c * FLOATS_PER_VERTEX];
+        const float e1[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+        const float e2[3] = { pc[0] - pa[0], pc[1] - pa[1], pc[2] - pa[2] };
+        const float cross[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+        const bool facing = cross[0] * pa[3] + cross[1] * pa[4] + cross[2] * pa[5] >= 0.0f;
+        indices.push_back(a);
+        indices.push_back(facing ? b : c);
+        indices.push_back(facing ? c : b);
+    }
+};
+
+// A flat grid of segmentsU x segmentsV quads spanning origin to origin + uAxis + vAxis, with UVs
+// running 0 to 1 along the two axes
+inline void appendGrid(GeneratedMesh& mesh, const float origin[3], const float uAxis[3], const float vAxis[3],
+                       const float normal[3], int segmentsU, int segmentsV)
+{
+    const uint16_t first = (uint16_t)mesh.VertexCount();
+    for (int j = 0; j <= segmentsV; ++j)
+    {
+        const float t = (float)j / segmentsV;
+        for (int i = 0; i <= segmentsU; ++i)
+        {
+            const float s = (float)i / segmentsU;
+            mesh.AddVertex(origin[0] + uAxis[0] * s + vAxis[0] * t, origin[1] + uAxis[1] * s + vAxis[1] * t,
+                           origin[2] + uAxis[2] * s + vAxis[2] * t, normal[0], normal[1], normal[2], s, t);
+        }
+    }
+    const int row = segmentsU + 1;
+    for (int j = 0; j < segmentsV; ++j)
+    {
+        for (int i = 0; i < segmentsU; ++i)
+        {
+            const uint16_t corner = (uint16_t)(first + j * row + i);
+            mesh.AddTriangle(corner, corner + 1, corner + row + 1);
+            mesh.AddTriangle(corner, corner + row + 1, corner + row);
+        }
+    }
+}
+
+// Unit cube centred on the origin, each face a segments x segments grid with its own normal
+// and a full 0 to 1 UV square
+inline GeneratedMesh generateBox(int segments)
+{
+    struct Face
+    {
+        float origin[3];
+        float uAxis[3];
+        float vAxis[3];
+        float normal[3];
+    };
+    static const Face faces[] = {
+        { { 0.5f, -0.5f, 0.5f }, { 0.0f, 0.0f, -1.0f }, { 0.0f, 1.0f, 0.0f }, { 1.0f, 0.0f, 0.0f } },
+        { { -0.5f, -0.5f, -0.5f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 1.0f, 0.0f }, { -1.0f, 0.0f, 0.0f } },
+        { { -0.5f, 0.5f, 0.5f }, { 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, -1.0f }, { 0.0f, 1.0f, 0.0f } },
+        { { -0.5f, -0.5f, -0.5f }, { 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, -1.0f, 0.0f } },
+        { { -0.5f, -0.5f, 0.5f }, { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } },
+        { { 0.5f, -0.5f, -0.5f }, { -1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, -1.0f } },
+    };
+    GeneratedMesh mesh;
+    for (const Face& face : faces)
+        appendGrid(mesh, face.origin, face.uAxis, face.vAxis, face.normal, segments, segments);
+    return mesh;
+}
+
+// The wall of a cylinder of the given radius from y = bottom to y = top. The seam vertices are
+// doubled so U can run 0 to 1 once around; V runs 0 at the bottom to 1 at the top. inward
+// turns the normals to face the axis, for the inside of a tube.
+inline void appendCylinderWall(GeneratedMesh& mesh, int segments, float radius, float bottom, float top, bool inward)
+{
+    const float pi = 3.14159265358979f;
+    const float facing = inward ? -1.0f : 1.0f;
+    const uint16_t first = (uint16_t)mesh.VertexCount();
+    for (int i = 0; i <= segments; ++i)
+    {
+        const float angle = 2.0f * pi * i / segments;
+        const float c = std::cos(angle);
+        const float s = std::sin(angle);
+        const float u = (float)i / segments;
+        mesh.AddVertex(radius * c, bottom, radius * s, facing * c, 0.0f, facing * s, u, 0.0f);
+        mesh.AddVertex(radius * c, top, radius * s, facing * c, 0.0f, facing * s, u, 1.0f);
+    }
+    for (int i = 0; i < segments; ++i)
+    {
+        const uint16_t b0 = (uint16_t)(first + i * 2);
+        mesh.AddTriangle(b0, b0 + 2, b0 + 3);
+        mesh.AddTriangle(b0, b0 + 3, b0 + 1);
+    }
+}
+
+// A flat ring at height y between innerRadius and outerRadius, facing up or down; an inner
+// radius of 0 makes a disc. UVs project straight down onto the unit square.
+inline void appendAnnulus(GeneratedMesh& mesh, int segments, float innerRadius, float outerRadius, float y, bool up)
+{
+    const float pi = 3.14159265358979f;
+    const float ny = up ? 1.0f : -1.0f;
+    const float uvScale = 0.5f / outerRadius;
+    const uint16_t first = (uint16_t)mesh.VertexCount();
+    if (innerRadius <= 0.0f)
+    {
+        const uint16_t centre = mesh.AddVertex(0.0f, y, 0.0f, 0.0f, ny, 0.0f, 0.5f, 0.5f);
+        for (int i = 0; i < segments; ++i)
+        {
+            const float angle = 2.0f * pi * i / segments;
+            const float x = outerRadius * std::cos(angle);
+            const float z = outerRadius * std::sin(angle);
+            mesh.AddVertex(x, y, z, 0.0f, ny, 0.0f, 0.5f + x * uvScale, 0.5f - z * uvScale);
+        }
+        for (int i = 0; i < segments; ++i)
+            mesh.AddTriangle(centre, (uint16_t)(centre + 1 + i), (uint16_t)(centre + 1 + (i + 1) % segments));
+        return;
+    }
+
+    for (int i = 0; i < segments; ++i)
+    {
+        const float angle = 2.0f * pi * i / segments;
+        const float c = std::cos(angle);
+        const float s = std::sin(angle);
+        mesh.AddVertex(innerRadius * c, y, innerRadius * s, 0.0f, ny, 0.0f, 0.5f + innerRadius * c * uvScale, 0.5f - innerRadius * s * uvScale);
+        mesh.AddVertex(outerRadius * c, y, outerRadius * s, 0.0f, ny, 0.0f, 0.5f + outerRadius * c * uvScale, 0.5f - outerRadius * s * uvScale);
+    }
+    for (int i = 0; i < segments; ++i)
+    {
+        const uint16_t in0 = (uint16_t)(first + i * 2);
+        const uint16_t in1 = (uint16_t)(first + ((i + 1) % segments) * 2);
+        mesh.AddTriangle(in0, in1, in1 + 1);
+        mesh.AddTriangle(in0, in1 + 1, in0 + 1);
+    }
+}
+
+// Closed cylinder of radius 1 from y = -2 to y = 0 (the frame the scene's cylinders are placed
+// in), with segments sides
+inline GeneratedMesh generateCylinder(int segments)
+{
+    GeneratedMesh mesh;
+    appendCylinderWall(mesh, segments, 1.0f, -2.0f, 0.0f, false);
+    appendAnnulus(mesh, segments, 0.0f, 1.0f, 0.0f, true);
+    appendAnnulus(mesh, segments, 0.0f, 1.0f, -2.0f, false);
+    return mesh;
+}
+
+// Tube of outer radius 1 and the given inner radius, in the same frame as generateCylinder
+inline GeneratedMesh generateTube(int segments, float innerRadius)
+{
+    GeneratedMesh mesh;
+    appendCylinderWall(mesh, segments, 1.0f, -2.0f, 0.0f, false);
+    appendCylinderWall(mesh, segments, innerRadius, -2.0f, 0.0f, true);
+    appendAnnulus(mesh, segments, innerRadius, 1.0f, 0.0f, true);
+    appendAnnulus(mesh, segments, innerRadius, 1.0f, -2.0f, false);
+    return mesh;
+}
+
+// Largest distance between a circle of the given radius and a regular polygon with segments
+// sides inscribed in it
+inline float chordError(float radius, int segments)
+{
+    return radius * (1.0f - std::cos(3.14159265358979f / segments));
+}
+
+#endif
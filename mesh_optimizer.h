@@ -0,0 +1,176 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+// Post-transform cache size the optimiser plans for and the stats simulate. Real hardware
+// varies; 16 entries is a conservative FIFO that orders well for bigger caches too.
+const unsigned VERTEX_CACHE_SIZE = 16;
+
+// Turns a triangle soup of vertexCount vertices, stride bytes each, into unique vertices plus
+// 16-bit indices. Only byte-identical vertices merge, so a corner shared by faces with different
+// normals stays split. Returns false if more than 65536 vertices are unique.
+inline bool weldVertices(const void* vertices, size_t vertexCount, size_t stride,
+                         std::vector<unsigned char>& welded, std::vector<uint16_t>& indices)
+{
+    const unsigned char* source = static_cast<const unsigned char*>(vertices);
+    std::unordered_map<uint64_t, std::vector<uint16_t>> seen;
+    welded.clear();
+    indices.resize(vertexCount);
+    for (size_t i = 0; i < vertexCount; ++i)
+    {
+        const unsigned char* vertex = source + i * stride;
+
+        // 64-bit FNV-1a of the vertex bytes
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t b = 0; b < stride; ++b)
+        {
+            hash ^= vertex[b];
+            hash *= 1099511628211ull;
+        }
+
+        std::vector<uint16_t>& bucket = seen[hash];
+        bool found = false;
+        for (uint16_t index : bucket)
+        {
+            if (std::memcmp(&welded[index * stride], vertex, stride) == 0)
+            {
+                indices[i] = index;
+                found = true;
+                break;
+            }
+        }
+        if (found)
+            continue;
+
+        const size_t index = welded.size() / stride;
+        if (index > 0xFFFF)
+            return false;
+        welded.insert(welded.end(), vertex, vertex + stride);
+        bucket.push_back((uint16_t)index);
+        indices[i] = (uint16_t)index;
+    }
+    return true;
+}
+
+// Average cache miss ratio: vertex shader runs per triangle through a FIFO cache of cacheSize
+// entries. 3.0 means no reuse at all; about 0.5 is the floor for a regular grid.
+inline float averageCacheMissRatio(const uint16_t* indices, size_t indexCount, size_t vertexCount,
+                                   unsigned cacheSize = VERTEX_CACHE_SIZE)
+{
+    if (indexCount < 3)
+        return 0.0f;
+
+    // a vertex is cached while fewer than cacheSize misses have happened since it was loaded
+    std::vector<size_t> loadedAt(vertexCount, 0);
+    size_t misses = 0;
+    for (size_t i = 0; i < indexCount; ++i)
+    {
+        const uint16_t v = indices[i];
+        if (loadedAt[v] == 0 || misses - loadedAt[v] >= cacheSize)
+        {
+            ++misses;
+            loadedAt[v] = misses;
+        }
+    }
+    return (float)misses / (float)(indexCount / 3);
+}
+
+// Reorders triangles for the post-transform vertex cache with Tipsify (Sander, Nehab and
+// Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw", 2007): fan
+// around one vertex at a time, then move to the neighbour most likely still in the cache.
+// Linear in the index count. The vertices themselves are not moved.
+inline void optimizeVertexCache(uint16_t* indices, size_t indexCount, size_t vertexCount,
+                                unsigned cacheSize = VERTEX_CACHE_SIZE)
+{
+    const size_t triangleCount = indexCount / 3;
+    if (triangleCount == 0)
+        return;
+
+    // triangles using each vertex, as offsets into one flat list
+    std::vector<size_t> liveCount(vertexCount, 0);
+    for (size_t i = 0; i < triangleCount * 3; ++i)
+        ++liveCount[indices[i]];
+    std::vector<size_t> adjacencyStart(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; ++v)
+        adjacencyStart[v + 1] = adjacencyStart[v] + liveCount[v];
+    std::vector<size_t> adjacency(adjacencyStart[vertexCount]);
+    std::vector<size_t> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        for (size_t k = 0; k < 3; ++k)
+            adjacency[fill[indices[t * 3 + k]]++] = t;
+    }
+
+    std::vector<size_t> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<size_t> deadEnds;
+    std::vector<size_t> candidates;
+    std::vector<uint16_t> output;
+    output.reserve(triangleCount * 3);
+
+    size_t time = cacheSize + 1;
+    size_t cursor = 0; // next vertex to try when the dead-end stack runs dry
+    long fanning = 0;
+    while (fanning >= 0)
+    {
+        candidates.clear();
+        for (size_t a = adjacencyStart[fanning]; a < adjacencyStart[fanning + 1]; ++a)
+        {
+            const size_t t = adjacency[a];
+            if (emitted[t])
+                continue;
+            for (size_t k = 0; k < 3; ++k)
+            {
+                const uint16_t v = indices[t * 3 + k];
+                output.push_back(v);
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                --liveCount[v];
+                if (time - cacheTime[v] > cacheSize)
+                    cacheTime[v] = time++;
+            }
+            emitted[t] = true;
+        }
+
+        // prefer the oldest candidate that will still be cached once its fan is done
+        fanning = -1;
+        long best = -1;
+        for (size_t v : candidates)
+        {
+            if (liveCount[v] == 0)
+                continue;
+            long priority = 0;
+            if (time - cacheTime[v] + 2 * liveCount[v] <= cacheSize)
+                priority = (long)(time - cacheTime[v]);
+            if (priority > best)
+            {
+                best = priority;
+                fanning = (long)v;
+            }
+        }
+
+        // dead end: back up to a recently used vertex, or scan for any with triangles left
+        while (fanning < 0 && !deadEnds.empty())
+        {
+            const size_t v = deadEnds.back();
+            deadEnds.pop_back();
+            if (liveCount[v] > 0)
+                fanning = (long)v;
+        }
+        while (fanning < 0 && cursor < vertexCount)
+        {
+            if (liveCount[cursor] > 0)
+                fanning = (long)cursor;
+            ++cursor;
+        }
+    }
+
+    std::memcpy(indices, output.data(), output.size() * sizeof(uint16_t));
+}
+
+#endif
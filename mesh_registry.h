@@ -0,0 +1,209 @@
+#ifndef MESH_REGISTRY_H
+#define MESH_REGISTRY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "bounding_volume.h"
+
+// Where a registered mesh sits in the registry's buffers; the arguments of an indexed draw
+struct MeshHandle
+{
+    GLint baseVertex;  // added to every index
+    GLuint firstIndex;
+    GLuint count;      // indices
+};
+
+// The most vertices one mesh can have, all of them reachable by a 16-bit index
+const size_t MAX_MESH_VERTICES = 65536;
+
+class TriangleBvh;
+
+// A shape at one or more levels of detail, finest first
+const int MAX_MESH_LODS = 4;
+struct LodMesh
+{
+    MeshHandle levels[MAX_MESH_LODS];
+    int segments[MAX_MESH_LODS]; // sides around the circumference; 0 for shapes that aren't round
+    int count;
+    MeshBounds bounds;           // holds every level
+    const TriangleBvh* pickLevels[MAX_MESH_LODS]; // each level's triangles, kept on the CPU for picking
+};
+
+// One vertex attribute of the registry's interleaved layout
+struct VertexAttribute
+{
+    GLuint location;
+    GLint size;        // components
+    GLenum type;
+    GLboolean normalized;
+    GLuint offset;     // bytes from the start of the vertex
+};
+
+// What the registry holds, and what the same meshes would cost uploaded one buffer each
+struct MeshRegistryStats
+{
+    size_t meshes;         // Add calls
+    size_t uniqueMeshes;   // distinct vertex/index data actually stored
+    size_t requestedBytes; // vertex and index bytes over every Add call
+    size_t vertexBytes;    // stored
+    size_t indexBytes;     // stored
+};
+
+// Suballocates every mesh out of one vertex buffer and one index buffer behind a single VAO,
+// so the whole scene draws without rebinding anything. Meshes are staged on the CPU by Add and
+// go to the GPU together in Upload; a mesh whose vertices and indices match one already added
+// byte for byte gets that mesh's handle back instead of a second copy.
+class MeshRegistry
+{
+public:
+    MeshRegistry() : vao(0), vbo(0), ibo(0), stride(0), stats() {}
+
+    MeshRegistry(const MeshRegistry&) = delete;
+    MeshRegistry& operator=(const MeshRegistry&) = delete;
+
+    // Sets the interleaved vertex layout every mesh shares. Call before the first Add.
+    void SetLayout(GLsizei vertexStride, const VertexAttribute* attributes, size_t count)
+    {
+        stride = vertexStride;
+        layout.assign(attributes, attributes + count);
+    }
+
+    // vertexCount vertices of the layout's stride, at most 65536 of them since indices are
+    // 16 bits; baseVertex lets the buffer as a whole grow past that. indices may be nullptr for
+    // a triangle soup, which is drawn in order. Past that limit nothing is stored and the handle
+    // is empty, drawing nothing.
+    MeshHandle Add(const void* vertexData, size_t vertexCount, const GLushort* indexData, size_t indexCount)
+    {
+        if (vertexCount > MAX_MESH_VERTICES)
+            return MeshHandle();
+
+        std::vector<GLushort> sequential;
+        if (!indexData)
+        {
+            sequential.resize(vertexCount);
+            for (size_t i = 0; i < vertexCount; ++i)
+                sequential[i] = (GLushort)i;
+            indexData = sequential.data();
+            indexCount = vertexCount;
+        }
+
+        const size_t bytes = vertexCount * stride;
+        ++stats.meshes;
+        stats.requestedBytes += bytes + indexCount * sizeof(GLushort);
+
+        const uint64_t hash = hashMesh(static_cast<const unsigned char*>(vertexData), bytes, indexData, indexCount);
+        std::unordered_map<uint64_t, std::vector<Entry>>::iterator bucket = entries.find(hash);
+        if (bucket != entries.end())
+        {
+            for (const Entry& entry : bucket->second)
+            {
+                if (entry.vertexBytes == bytes && entry.handle.count == indexCount
+                    && std::memcmp(&vertices[entry.handle.baseVertex * stride], vertexData, bytes) == 0
+                    && std::memcmp(&indices[entry.handle.firstIndex], indexData, indexCount * sizeof(GLushort)) == 0)
+                    return entry.handle;
+            }
+        }
+
+        Entry entry;
+        entry.handle.baseVertex = (GLint)(vertices.size() / stride);
+        entry.handle.firstIndex = (GLuint)indices.size();
+        entry.handle.count = (GLuint)indexCount;
+        entry.vertexBytes = bytes;
+        const unsigned char* first = static_cast<const unsigned char*>(vertexData);
+        vertices.insert(vertices.end(), first, first + bytes);
+        indices.insert(indices.end(), indexData, indexData + indexCount);
+        entries[hash].push_back(entry);
+        ++stats.uniqueMeshes;
+        stats.vertexBytes += bytes;
+        stats.indexBytes += indexCount * sizeof(GLushort);
+        return entry.handle;
+    }
+
+    // Creates the buffers and the VAO from everything added so far. The staging copies are
+    // released; the registry is fixed from here on.
+    void Upload()
+    {
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferStorage(GL_ARRAY_BUFFER, vertices.size(), vertices.data(), 0);
+        for (const VertexAttribute& attribute : layout)
+        {
+            const void* offset = (const void*)(uintptr_t)attribute.offset;
+            if (attribute.type == GL_FLOAT || attribute.type == GL_HALF_FLOAT || attribute.normalized)
+                glVertexAttribPointer(attribute.location, attribute.size, attribute.type, attribute.normalized, stride, offset);
+            else
+                glVertexAttribIPointer(attribute.location, attribute.size, attribute.type, stride, offset);
+            glEnableVertexAttribArray(attribute.location);
+        }
+
+        // the element binding is VAO state, so it has to happen while the VAO is bound
+        glGenBuffers(1, &ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+        glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), indices.data(), 0);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        std::vector<unsigned char>().swap(vertices);
+        std::vector<GLushort>().swap(indices);
+        entries.clear();
+    }
+
+    const MeshRegistryStats& Stats() const { return stats; }
+
+    // the VAO holds the vertex layout and the index buffer
+    GLuint Vao() const { return vao; }
+
+    void Destroy()
+    {
+        glDeleteVertexArrays(1, &vao);
+        glDeleteBuffers(1, &vbo);
+        glDeleteBuffers(1, &ibo);
+        vao = vbo = ibo = 0;
+    }
+
+private:
+    struct Entry
+    {
+        MeshHandle handle;
+        size_t vertexBytes;
+    };
+
+    // 64-bit FNV-1a over the vertex bytes followed by the index bytes
+    static uint64_t hashMesh(const unsigned char* vertexData, size_t bytes, const GLushort* indexData, size_t indexCount)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < bytes; ++i)
+        {
+            hash ^= vertexData[i];
+            hash *= 1099511628211ull;
+        }
+        const unsigned char* indexBytes = reinterpret_cast<const unsigned char*>(indexData);
+        for (size_t i = 0; i < indexCount * sizeof(GLushort); ++i)
+        {
+            hash ^= indexBytes[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    GLuint vao;
+    GLuint vbo;
+    GLuint ibo;
+    GLsizei stride;
+    std::vector<VertexAttribute> layout;
+    std::vector<unsigned char> vertices;
+    std::vector<GLushort> indices;
+    std::unordered_map<uint64_t, std::vector<Entry>> entries;
+    MeshRegistryStats stats;
+};
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef OCCLUSION_CULLER_H
+#define OCCLUSION_CULLER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "bounding_volume.h"
+#include "gpu_buffer.h"
+#include "shader_program.h"
+
+static_assert(sizeof(Aabb) == 24, "Aabb must read as six floats in the occlusion shader");
+
+// Two-pass occlusion culling against a hierarchical depth buffer, for draws that already passed
+// the frustum test. The first pass draws what was visible last frame. Its depth is then reduced
+// to a pyramid whose texels hold the farthest depth beneath them, and every draw's world box is
+// tested against it. The second pass draws whatever the test finds visible that the first pass
+// skipped, so an object coming out from behind another is never a frame late. All of it stays
+// on the GPU: the tests write the instanceCount of indirect commands, 1 to draw and 0 to skip.
+//
+// The two programs are compute shaders the caller compiles; this class binds their inputs:
+//   pyramid program: uLevel, uDepth (sampler2D), uSource and uTarget (r32f image2D)
+//   test program: FrameData, storage blocks Draws, PassDraws, Visibility, Boxes and
+//   OcclusionStats, uPass, uDrawCount, uStatsSlot, uDepthSize and uPyramid (sampler2D)
+// The pyramid starts at a quarter of the depth buffer's size (BASE_SHIFT): a software
+// rasteriser pays for every invocation, and a full-size level buys little precision.
+class OcclusionCuller
+{
+public:
+    static const int STATS_FRAMES = 3; // how far behind the hidden counts are read back
+    static const int BASE_SHIFT = 2;   // pyramid level 0 is the depth buffer over 1 << BASE_SHIFT
+
+    OcclusionCuller() : firstBinding(0), firstUnit(0), depth(0), pyramid(0), width(0), height(0), levels(0),
+        levelLoc(-1), passLoc(-1), drawCountLoc(-1), statsSlotLoc(-1), depthSizeLoc(-1), frame(0)
+    {
+        for (int i = 0; i < STATS_FRAMES; ++i)
+            tested[i] = 0;
+    }
+
+    OcclusionCuller(const OcclusionCuller&) = delete;
+    OcclusionCuller& operator=(const OcclusionCuller&) = delete;
+
+    // Makes room for maxEntities slots. The test program's storage blocks take binding indices
+    // firstStorageBinding on; the two depth textures take texture units firstTextureUnit and the
+    // one after.
+    void Create(GLuint pyramidProgramId, GLuint testProgramId, size_t maxEntities, GLuint frameDataBinding,
+                GLuint firstStorageBinding, GLuint firstTextureUnit)
+    {
+        firstBinding = firstStorageBinding;
+        firstUnit = firstTextureUnit;
+
+        pyramidProgram.Reflect(pyramidProgramId);
+        levelLoc = pyramidProgram.Location("uLevel");
+        glUseProgram(pyramidProgramId);
+        glUniform1i(pyramidProgram.Location("uDepth"), (GLint)firstUnit);
+        glUniform1i(pyramidProgram.Location("uSource"), 0);
+        glUniform1i(pyramidProgram.Location("uTarget"), 1);
+
+        testProgram.Reflect(testProgramId);
+        passLoc = testProgram.Location("uPass");
+        drawCountLoc = testProgram.Location("uDrawCount");
+        statsSlotLoc = testProgram.Location("uStatsSlot");
+        depthSizeLoc = testProgram.Location("uDepthSize");
+        glUseProgram(testProgramId);
+        glUniform1i(testProgram.Location("uPyramid"), (GLint)firstUnit + 1);
+        testProgram.BindBlock("FrameData", frameDataBinding);
+        testProgram.BindStorageBlock("Draws", firstBinding + DRAWS);
+        testProgram.BindStorageBlock("PassDraws", firstBinding + PASS_DRAWS);
+        testProgram.BindStorageBlock("Visibility", firstBinding + VISIBILITY);
+        testProgram.BindStorageBlock("Boxes", firstBinding + BOXES);
+        testProgram.BindStorageBlock("OcclusionStats", firstBinding + STATS);
+        glUseProgram(0);
+
+        // everything counts as visible until it has been tested
+        const std::vector<GLuint> seen(maxEntities, 1);
+        visibility.Create(seen.data(), maxEntities);
+        boxes.Create(nullptr, maxEntities);
+        firstPass.Create(nullptr, maxEntities);
+        secondPass.Create(nullptr, maxEntities);
+        const GLuint zeros[STATS_FRAMES] = {};
+        stats.Create(zeros, STATS_FRAMES);
+        visibility.BindBase(GL_SHADER_STORAGE_BUFFER, firstBinding + VISIBILITY);
+        boxes.BindBase(GL_SHADER_STORAGE_BUFFER, firstBinding + BOXES);
+        stats.BindBase(GL_SHADER_STORAGE_BUFFER, firstBinding + STATS);
+    }
+
+    // Reallocates the depth copy and the pyramid when the framebuffer changes size
+    void Resize(int framebufferWidth, int framebufferHeight)
+    {
+        if (framebufferWidth == width && framebufferHeight == height)
+            return;
+        width = framebufferWidth;
+        height = framebufferHeight;
+        const int baseWidth = std::max(width >> BASE_SHIFT, 1);
+        const int baseHeight = std::max(height >> BASE_SHIFT, 1);
+        levels = 1;
+        while ((std::max(baseWidth, baseHeight) >> levels) > 0)
+            ++levels;
+        glProgramUniform2i(testProgram.Id(), depthSizeLoc, width, height);
+
+        glDeleteTextures(1, &depth);
+        glDeleteTextures(1, &pyramid);
+        glGenTextures(1, &depth);
+        glActiveTexture(GL_TEXTURE0 + firstUnit);
+        glBindTexture(GL_TEXTURE_2D, depth);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        glGenTextures(1, &pyramid);
+        glActiveTexture(GL_TEXTURE0 + firstUnit + 1);
+        glBindTexture(GL_TEXTURE_2D, pyramid);
+        glTexStorage2D(GL_TEXTURE_2D, levels, GL_R32F, baseWidth, baseHeight);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // Marks every slot visible again, for when entities have moved between slots
+    void Reset()
+    {
+        const std::vector<GLuint> seen(visibility.Count(), 1);
+        visibility.Update(0, seen.size(), seen.data());
+    }
+
+    // Uploads the world boxes of the slots in changed; boxes is the whole array, by slot
+    void UpdateBoxes(const Aabb* worldBoxes, std::vector<uint32_t>& changed)
+    {
+        boxes.UpdateIndices(worldBoxes, changed);
+    }
+
+    // Writes the first pass's commands from draws, the frustum test's survivors, and binds them
+    // to GL_DRAW_INDIRECT_BUFFER
+    void BindFirstPass(const GpuArray<DrawElementsIndirectCommand>& draws, GLsizei drawCount)
+    {
+        dispatchTest(0, draws, firstPass, drawCount);
+        firstPass.Bind(GL_DRAW_INDIRECT_BUFFER);
+    }
+
+    // Builds the pyramid from the depth buffer of the framebuffer bound for reading, tests every
+    // draw against it and binds the second pass's commands to GL_DRAW_INDIRECT_BUFFER
+    void BindSecondPass(const GpuArray<DrawElementsIndirectCommand>& draws, GLsizei drawCount)
+    {
+        buildPyramid();
+
+        const int slot = (int)(frame % STATS_FRAMES);
+        const GLuint zero = 0;
+        stats.Update(slot, 1, &zero);
+        tested[slot] = (GLuint)drawCount;
+        glUseProgram(testProgram.Id());
+        glUniform1ui(statsSlotLoc, (GLuint)slot);
+        dispatchTest(1, draws, secondPass, drawCount);
+        secondPass.Bind(GL_DRAW_INDIRECT_BUFFER);
+        ++frame;
+    }
+
+    // The commands the last BindFirstPass and BindSecondPass wrote, to draw again
+    const GpuArray<DrawElementsIndirectCommand>& FirstPass() const { return firstPass; }
+    const GpuArray<DrawElementsIndirectCommand>& SecondPass() const { return secondPass; }
+
+    // The draws tested and how many of them were hidden, STATS_FRAMES - 1 frames ago, so the
+    // GPU is long done with them. False until that many frames have gone by.
+    bool Stats(GLuint& drawsTested, GLuint& drawsHidden) const
+    {
+        if (frame < STATS_FRAMES)
+            return false;
+        const int slot = (int)(frame % STATS_FRAMES); // the oldest; written next frame
+        stats.Read(slot, 1, &drawsHidden);
+        drawsTested = tested[slot];
+        return true;
+    }
+
+    void Destroy()
+    {
+        glDeleteTextures(1, &depth);
+        glDeleteTextures(1, &pyramid);
+        depth = pyramid = 0;
+        width = height = 0;
+        visibility.Destroy();
+        boxes.Destroy();
+        firstPass.Destroy();
+        secondPass.Destroy();
+        stats.Destroy();
+    }
+
+private:
+    enum { DRAWS, PASS_DRAWS, VISIBILITY, BOXES, STATS }; // storage blocks, from firstBinding
+    enum { GROUP_SIZE = 8, TEST_GROUP_SIZE = 64 };        // the shaders' local sizes
+
+    void dispatchTest(int pass, const GpuArray<DrawElementsIndirectCommand>& draws,
+                      const GpuArray<DrawElementsIndirectCommand>& commands, GLsizei drawCount)
+    {
+        glUseProgram(testProgram.Id());
+        draws.BindBase(GL_SHADER_STORAGE_BUFFER, firstBinding + DRAWS);
+        commands.BindBase(GL_SHADER_STORAGE_BUFFER, firstBinding + PASS_DRAWS);
+        glUniform1i(passLoc, pass);
+        glUniform1ui(drawCountLoc, (GLuint)drawCount);
+        glDispatchCompute((GLuint)(drawCount + TEST_GROUP_SIZE - 1) / TEST_GROUP_SIZE, 1, 1);
+        glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    }
+
+    // Level 0 comes from the depth buffer; each level above it is built from the one below
+    void buildPyramid()
+    {
+        glActiveTexture(GL_TEXTURE0 + firstUnit);
+        glBindTexture(GL_TEXTURE_2D, depth);
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+        glActiveTexture(GL_TEXTURE0);
+
+        glUseProgram(pyramidProgram.Id());
+        for (int level = 0; level < levels; ++level)
+        {
+            glBindImageTexture(0, pyramid, std::max(level - 1, 0), GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+            glBindImageTexture(1, pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+            glUniform1i(levelLoc, level);
+            const GLuint levelWidth = (GLuint)std::max(width >> (BASE_SHIFT + level), 1);
+            const GLuint levelHeight = (GLuint)std::max(height >> (BASE_SHIFT + level), 1);
+            glDispatchCompute((levelWidth + GROUP_SIZE - 1) / GROUP_SIZE, (levelHeight + GROUP_SIZE - 1) / GROUP_SIZE, 1);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        }
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+
+    ShaderProgram pyramidProgram;
+    ShaderProgram testProgram;
+    GLuint firstBinding;
+    GLuint firstUnit;
+    GLuint depth;   // the first pass's depth buffer
+    GLuint pyramid; // farthest depth per texel, one level per halving
+    int width;
+    int height;
+    int levels;
+    GLint levelLoc;
+    GLint passLoc;
+    GLint drawCountLoc;
+    GLint statsSlotLoc;
+    GLint depthSizeLoc;
+
+    GpuArray<GLuint> visibility; // by slot: 1 if the last test found it visible
+    GpuArray<Aabb> boxes;        // by slot, in world space
+    GpuArray<DrawElementsIndirectCommand> firstPass;
+    GpuArray<DrawElementsIndirectCommand> secondPass;
+    GpuArray<GLuint> stats;      // draws hidden, one counter per frame in flight
+    GLuint tested[STATS_FRAMES]; // draws tested, likewise
+    uint64_t frame;
+};
+
+#endif
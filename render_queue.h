@@ -0,0 +1,100 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "gpu_buffer.h"
+
+// Sort key of an opaque draw, most significant first: a depth bucket, so nearer draws go first
+// and hide the fragments of those behind them before they are shaded, then the program, texture
+// and vertex array the draw needs, so draws sharing all three sit together within a bucket.
+// The three are GL names, which drivers hand out counting up from 1; each keeps its low 16 bits.
+inline uint64_t makeSortKey(uint16_t depthBucket, GLuint program, GLuint texture, GLuint vertexArray)
+{
+    return (uint64_t)depthBucket << 48 | (uint64_t)(program & 0xFFFF) << 32 | (uint64_t)(texture & 0xFFFF) << 16 |
+           (uint64_t)(vertexArray & 0xFFFF);
+}
+
+// The key without its depth bucket: what a draw has to bind
+inline uint64_t sortKeyState(uint64_t key) { return key & 0xFFFFFFFFFFFFull; }
+inline GLuint sortKeyProgram(uint64_t key) { return (GLuint)(key >> 32 & 0xFFFF); }
+inline GLuint sortKeyTexture(uint64_t key) { return (GLuint)(key >> 16 & 0xFFFF); }
+inline GLuint sortKeyVertexArray(uint64_t key) { return (GLuint)(key & 0xFFFF); }
+
+// Buckets view depths between the near and far planes on a log scale, so they are as fine near
+// the camera, where objects overlap most on screen, as a perspective depth buffer is
+inline uint16_t depthBucket(float viewDepth, float nearPlane, float farPlane)
+{
+    if (viewDepth <= nearPlane)
+        return 0;
+    if (viewDepth >= farPlane)
+        return 0xFFFF;
+    return (uint16_t)(65535.0f * std::log(viewDepth / nearPlane) / std::log(farPlane / nearPlane));
+}
+
+// The frame's opaque draws, sorted by key into runs that need the same state. Each run is one
+// glMultiDrawElementsIndirect over its stretch of Commands().
+class RenderQueue
+{
+public:
+    struct Run
+    {
+        uint64_t state; // sortKeyState of every draw in it
+        size_t first;   // into Commands()
+        size_t count;
+    };
+
+    void Clear() { items.clear(); }
+
+    void Push(uint64_t key, const DrawElementsIndirectCommand& command)
+    {
+        Item item = { key, command };
+        items.push_back(item);
+    }
+
+    // Sorts by key, ties going to the lower baseInstance so equal keys keep a steady order from
+    // frame to frame, and rebuilds Commands() and Runs()
+    void Sort()
+    {
+        std::sort(items.begin(), items.end(), [](const Item& a, const Item& b)
+        {
+            return a.key != b.key ? a.key < b.key : a.command.baseInstance < b.command.baseInstance;
+        });
+
+        commands.resize(items.size());
+        runs.clear();
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            commands[i] = items[i].command;
+            const uint64_t state = sortKeyState(items[i].key);
+            if (runs.empty() || runs.back().state != state)
+            {
+                Run run = { state, i, 0 };
+                runs.push_back(run);
+            }
+            ++runs.back().count;
+        }
+    }
+
+    const std::vector<DrawElementsIndirectCommand>& Commands() const { return commands; }
+    const std::vector<Run>& Runs() const { return runs; }
+
+private:
+    struct Item
+    {
+        uint64_t key;
+        DrawElementsIndirectCommand command;
+    };
+
+    std::vector<Item> items;
+    std::vector<DrawElementsIndirectCommand> commands;
+    std::vector<Run> runs;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "bounding_volume.h"
+#include "mesh_registry.h"
+#include "transform_table.h"
+
+// How an entity is shaded
+struct Material
+{
+    GLint layer;  // texture array layer
+    GLuint flags; // the renderer's DRAW_* bits
+};
+
+// World-space sphere around an entity's round outline, which picks its level of detail
+struct Bounds
+{
+    glm::vec3 centre;
+    float radius;
+};
+
+// World-space volumes the frustum test runs over. Sphere centres and radii each get their own
+// array so the test can load four entities' worth at once.
+struct CullVolumes
+{
+    std::vector<float> x, y, z, radius;
+    std::vector<Aabb> boxes;
+
+    void Push()
+    {
+        x.push_back(0.0f);
+        y.push_back(0.0f);
+        z.push_back(0.0f);
+        radius.push_back(0.0f);
+        Aabb box = {};
+        boxes.push_back(box);
+    }
+
+    void Set(uint32_t slot, const BoundingSphere& sphere, const Aabb& box)
+    {
+        x[slot] = sphere.centre.x;
+        y[slot] = sphere.centre.y;
+        z[slot] = sphere.centre.z;
+        radius[slot] = sphere.radius;
+        boxes[slot] = box;
+    }
+
+    // moves the last entry into slot and drops the last
+    void Remove(uint32_t slot)
+    {
+        x[slot] = x.back();
+        y[slot] = y.back();
+        z[slot] = z.back();
+        radius[slot] = radius.back();
+        boxes[slot] = boxes.back();
+        x.pop_back();
+        y.pop_back();
+        z.pop_back();
+        radius.pop_back();
+        boxes.pop_back();
+    }
+};
+
+// Handle to an entity. It stays valid while the entity lives, whatever happens to the others;
+// once destroyed, its number may be handed out again.
+typedef uint32_t Entity;
+
+// Entity store. Every component lives in a packed array indexed by the entity's slot, with no
+// gaps, so systems walk them front to back. Destroying an entity moves the last one into its
+// slot; Entity handles go through a sparse table and are unaffected.
+class Scene
+{
+public:
+    Scene() : revision(0) {}
+
+    // angle in radians about axis
+    Entity Create(const LodMesh* mesh, const Material& material, const glm::vec3& position, float angle,
+                  const glm::vec3& axis, const glm::vec3& scale)
+    {
+        Entity entity;
+        if (!freeEntities.empty())
+        {
+            entity = freeEntities.back();
+            freeEntities.pop_back();
+        }
+        else
+        {
+            entity = (Entity)slotOf.size();
+            slotOf.push_back(DEAD);
+        }
+
+        ++revision;
+        slotOf[entity] = (uint32_t)entities.size();
+        entities.push_back(entity);
+        transforms.Add(position, angle, axis, scale);
+        meshes.push_back(mesh);
+        materials.push_back(material);
+        Bounds bound = {};
+        bounds.push_back(bound);
+        volumes.Push();
+        lodLevels.push_back(-1);
+        return entity;
+    }
+
+    void Destroy(Entity entity)
+    {
+        ++revision;
+        const uint32_t slot = slotOf[entity];
+        const uint32_t last = (uint32_t)entities.size() - 1;
+        if (slot < last)
+        {
+            entities[slot] = entities[last];
+            meshes[slot] = meshes[last];
+            materials[slot] = materials[last];
+            bounds[slot] = bounds[last];
+            lodLevels[slot] = -1; // whatever was drawn in this slot belonged to the destroyed entity
+            slotOf[entities[slot]] = slot;
+        }
+        transforms.Remove(slot);
+        volumes.Remove(slot);
+        entities.pop_back();
+        meshes.pop_back();
+        materials.pop_back();
+        bounds.pop_back();
+        lodLevels.pop_back();
+        slotOf[entity] = DEAD;
+        freeEntities.push_back(entity);
+    }
+
+    bool Alive(Entity entity) const { return entity < slotOf.size() && slotOf[entity] != DEAD; }
+    uint32_t Slot(Entity entity) const { return slotOf[entity]; }
+    size_t Count() const { return entities.size(); }
+    // Changes whenever an entity is created or destroyed, which can move others between slots
+    uint64_t Revision() const { return revision; }
+
+    // Components, all indexed by slot. Changing a transform through the table marks the slot
+    // changed; a lodLevel of -1 asks for the slot's draw to be rewritten.
+    TransformTable transforms;
+    std::vector<const LodMesh*> meshes;
+    std::vector<Material> materials;
+    std::vector<Bounds> bounds;
+    CullVolumes volumes;
+    std::vector<int> lodLevels;
+    std::vector<Entity> entities; // which entity owns each slot
+
+private:
+    enum : uint32_t { DEAD = 0xFFFFFFFF };
+
+    std::vector<uint32_t> slotOf; // by entity
+    std::vector<Entity> freeEntities;
+    uint64_t revision;
+};
+
+#endif
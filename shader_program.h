@@ -0,0 +1,145 @@
+#ifndef SHADER_PROGRAM_H
+#define SHADER_PROGRAM_H
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <GL/glew.h>
+
+// Every active uniform, uniform block and shader storage block of a linked program, read once
+// with glGetActiveUniform and friends so the render loop never hands GL a name. Members of a
+// block have no location of their own; they are set through the block's buffer instead.
+class ShaderProgram
+{
+public:
+    ShaderProgram() : id(0) {}
+
+    // reads the tables from a linked program; call again after relinking
+    void Reflect(GLuint program)
+    {
+        id = program;
+        locations.clear();
+        blocks.clear();
+        storageBlocks.clear();
+
+        GLint count = 0;
+        GLint maxLength = 0;
+        glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        std::vector<GLchar> name(std::max(maxLength, 1));
+        for (GLint i = 0; i < count; ++i)
+        {
+            GLsizei length = 0;
+            GLint size = 0;
+            GLenum type = 0;
+            glGetActiveUniform(program, (GLuint)i, (GLsizei)name.size(), &length, &size, &type, name.data());
+            const GLint location = glGetUniformLocation(program, name.data());
+            if (location < 0)
+                continue; // lives in a block
+
+            // arrays are reported as "name[0]"; the location is the same for the bare name
+            std::string key(name.data(), length);
+            if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0)
+                key.resize(key.size() - 3);
+            locations[key] = location;
+        }
+
+        glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+        glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+        name.resize(std::max(maxLength, 1));
+        for (GLint i = 0; i < count; ++i)
+        {
+            GLsizei length = 0;
+            glGetActiveUniformBlockName(program, (GLuint)i, (GLsizei)name.size(), &length, name.data());
+            blocks[std::string(name.data(), length)] = (GLuint)i;
+        }
+
+        glGetProgramInterfaceiv(program, GL_SHADER_STORAGE_BLOCK, GL_ACTIVE_RESOURCES, &count);
+        glGetProgramInterfaceiv(program, GL_SHADER_STORAGE_BLOCK, GL_MAX_NAME_LENGTH, &maxLength);
+        name.resize(std::max(maxLength, 1));
+        for (GLint i = 0; i < count; ++i)
+        {
+            GLsizei length = 0;
+            glGetProgramResourceName(program, GL_SHADER_STORAGE_BLOCK, (GLuint)i, (GLsizei)name.size(), &length, name.data());
+            storageBlocks[std::string(name.data(), length)] = (GLuint)i;
+        }
+    }
+
+    GLuint Id() const { return id; }
+
+    // -1 for a name the program doesn't use, which glUniform* calls quietly ignore
+    GLint Location(const std::string& name) const
+    {
+        std::unordered_map<std::string, GLint>::const_iterator it = locations.find(name);
+        return it == locations.end() ? -1 : it->second;
+    }
+
+    // Points a uniform block at a buffer binding index. Returns false if the program has no
+    // such active block.
+    bool BindBlock(const std::string& name, GLuint binding) const
+    {
+        std::unordered_map<std::string, GLuint>::const_iterator it = blocks.find(name);
+        if (it == blocks.end())
+            return false;
+        glUniformBlockBinding(id, it->second, binding);
+        return true;
+    }
+
+    // BindBlock for a shader storage block
+    bool BindStorageBlock(const std::string& name, GLuint binding) const
+    {
+        std::unordered_map<std::string, GLuint>::const_iterator it = storageBlocks.find(name);
+        if (it == storageBlocks.end())
+            return false;
+        glShaderStorageBlockBinding(id, it->second, binding);
+        return true;
+    }
+
+private:
+    GLuint id;
+    std::unordered_map<std::string, GLint> locations;
+    std::unordered_map<std::string, GLuint> blocks;
+    std::unordered_map<std::string, GLuint> storageBlocks;
+};
+
+// Backing store for a std140 uniform block, attached to a fixed binding index. T has to mirror
+// the block's std140 layout (vec3s padded out to vec4s and so on).
+template <typename T>
+class UniformBuffer
+{
+public:
+    UniformBuffer() : buffer(0) {}
+
+    UniformBuffer(const UniformBuffer&) = delete;
+    UniformBuffer& operator=(const UniformBuffer&) = delete;
+
+    void Create(GLuint binding)
+    {
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(T), nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+    }
+
+    // replaces the whole block; every program bound to it sees the new values on its next draw
+    void Update(const T& data)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &data);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    void Destroy()
+    {
+        glDeleteBuffers(1, &buffer);
+        buffer = 0;
+    }
+
+private:
+    GLuint buffer;
+};
+
+#endif
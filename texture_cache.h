@@ -0,0 +1,638 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Pixel layouts a texture can be stored in, both in memory and in a cache file
+enum TextureFormat
+{
+    TEXTURE_RGB8 = 0,
+    TEXTURE_RGBA8 = 1,
+    TEXTURE_BC1 = 2, // DXT1, opaque RGB, 8 bytes per 4x4 block
+    TEXTURE_BC3 = 3  // DXT5, RGBA, 16 bytes per 4x4 block
+};
+
+inline bool isCompressedFormat(TextureFormat format)
+{
+    return format == TEXTURE_BC1 || format == TEXTURE_BC3;
+}
+
+// Bytes needed for one level of the given size
+inline size_t textureLevelBytes(TextureFormat format, int width, int height)
+{
+    switch (format)
+    {
+    case TEXTURE_RGB8:  return (size_t)width * height * 3;
+    case TEXTURE_RGBA8: return (size_t)width * height * 4;
+    case TEXTURE_BC1:   return (size_t)((width + 3) / 4) * ((height + 3) / 4) * 8;
+    case TEXTURE_BC3:   return (size_t)((width + 3) / 4) * ((height + 3) / 4) * 16;
+    }
+    return 0;
+}
+
+// Most mip levels a texture has, whether in a cache file or in the storage reserved for it:
+// a full chain for up to 32768x32768
+const int TEXTURE_MAX_LEVELS = 16;
+
+// Number of levels in a full mip chain down to 1x1, or the first TEXTURE_MAX_LEVELS of it
+inline int textureMipCount(int width, int height)
+{
+    int levels = 1;
+    while ((width > 1 || height > 1) && levels < TEXTURE_MAX_LEVELS)
+    {
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+        ++levels;
+    }
+    return levels;
+}
+
+// 64-bit FNV-1a, used to tell whether a cache entry still matches its source file
+inline uint64_t hashBytes(const unsigned char* data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Cache file layout
+   A cache file (<source>.gtex) holds one texture exactly as it is uploaded: already flipped for
+   OpenGL, with every mip level precomputed, optionally block compressed. The header is followed
+   by the levels, largest first. Offsets are from the start of the file. */
+
+const uint32_t TEXTURE_CACHE_MAGIC = 0x58455447; // "GTEX"
+const uint32_t TEXTURE_CACHE_VERSION = 1;
+
+struct TextureCacheLevel
+{
+    uint64_t offset;
+    uint64_t size;
+    uint32_t width;
+    uint32_t height;
+};
+
+struct TextureCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;      // TextureFormat
+    uint32_t levelCount;
+    TextureCacheLevel levels[TEXTURE_MAX_LEVELS];
+};
+
+// One mip level, pointing into memory owned by whoever produced it
+struct TextureLevel
+{
+    int width;
+    int height;
+    const unsigned char* data;
+    size_t size;
+};
+
+// layerSize is nonzero for an entry resampled to one layer of a texture array, e.g. "wood.jpg.1024.gtex"
+inline std::string textureCachePath(const std::string& sourcePath, int layerSize = 0)
+{
+    if (layerSize)
+        return sourcePath + "." + std::to_string(layerSize) + ".gtex";
+    return sourcePath + ".gtex";
+}
+
+// Checks a cache image against the source hash and fills in the level table. Returns false for
+// anything malformed, truncated, from another version, or built from different source bytes.
+inline bool parseTextureCache(const unsigned char* data, size_t size, uint64_t sourceHash,
+    TextureFormat& format, std::vector<TextureLevel>& levels)
+{
+    if (size < sizeof(TextureCacheHeader))
+        return false;
+
+    TextureCacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != TEXTURE_CACHE_MAGIC || header.version != TEXTURE_CACHE_VERSION)
+        return false;
+    if (header.sourceHash != sourceHash)
+        return false;
+    if (header.format > TEXTURE_BC3 || header.levelCount == 0 || header.levelCount > (uint32_t)TEXTURE_MAX_LEVELS)
+        return false;
+
+    format = (TextureFormat)header.format;
+    levels.clear();
+    for (uint32_t i = 0; i < header.levelCount; ++i)
+    {
+        const TextureCacheLevel& level = header.levels[i];
+        if (level.offset > size || level.size > size - level.offset)
+            return false;
+        if (level.size != textureLevelBytes(format, level.width, level.height))
+            return false;
+
+        TextureLevel out;
+        out.width = (int)level.width;
+        out.height = (int)level.height;
+        out.data = data + level.offset;
+        out.size = (size_t)level.size;
+        levels.push_back(out);
+    }
+    return true;
+}
+
+// Read-only view of a whole file, memory mapped where the platform allows
+class MappedFile
+{
+public:
+    MappedFile() : data(nullptr), size(0)
+#ifdef _WIN32
+        , file(INVALID_HANDLE_VALUE), mapping(nullptr)
+#endif
+    {
+    }
+
+    ~MappedFile() { Close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const std::string& path)
+    {
+        Close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping)
+        {
+            Close();
+            return false;
+        }
+        data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        size = (size_t)fileSize.QuadPart;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (view == MAP_FAILED)
+            return false;
+        data = (const unsigned char*)view;
+        size = (size_t)info.st_size;
+#endif
+        if (!data)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+            munmap((void*)data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+    const unsigned char* Data() const { return data; }
+    size_t Size() const { return size; }
+
+private:
+    const unsigned char* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+// Reads a whole file into memory
+inline bool readFileBytes(const std::string& path, std::vector<unsigned char>& bytes)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length <= 0)
+    {
+        fclose(file);
+        return false;
+    }
+
+    bytes.resize((size_t)length);
+    bool ok = fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    fclose(file);
+    return ok;
+}
+
+// Reads just the header of a cache file, without checking it against its source. Returns false
+// if there is no readable entry of this version.
+inline bool readTextureCacheHeader(const std::string& path, TextureCacheHeader& header)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    bool ok = fread(&header, 1, sizeof(header), file) == sizeof(header);
+    fclose(file);
+    return ok && header.magic == TEXTURE_CACHE_MAGIC && header.version == TEXTURE_CACHE_VERSION
+        && header.format <= TEXTURE_BC3;
+}
+
+// Writes through a temporary file so a reader never maps a half written cache entry
+inline bool writeFileBytes(const std::string& path, const std::vector<unsigned char>& bytes)
+{
+    std::string tmpPath = path + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (!file)
+        return false;
+
+    bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    ok = (fclose(file) == 0) && ok;
+    if (ok)
+    {
+        remove(path.c_str());
+        ok = rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+    if (!ok)
+        remove(tmpPath.c_str());
+    return ok;
+}
+
+// Halves a level with a box filter, matching the level sizes glGenerateMipmap would produce
+inline void downsampleLevel(const unsigned char* src, int width, int height, int channels, unsigned char* dst)
+{
+    const int dstWidth = std::max(1, width / 2);
+    const int dstHeight = std::max(1, height / 2);
+
+    for (int y = 0; y < dstHeight; ++y)
+    {
+        const int y0 = std::min(y * 2, height - 1);
+        const int y1 = std::min(y * 2 + 1, height - 1);
+        for (int x = 0; x < dstWidth; ++x)
+        {
+            const int x0 = std::min(x * 2, width - 1);
+            const int x1 = std::min(x * 2 + 1, width - 1);
+            for (int c = 0; c < channels; ++c)
+            {
+                int sum = src[(y0 * width + x0) * channels + c] + src[(y0 * width + x1) * channels + c]
+                        + src[(y1 * width + x0) * channels + c] + src[(y1 * width + x1) * channels + c];
+                dst[(y * dstWidth + x) * channels + c] = (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+// Scales to any size with a separable tent filter. The filter widens with the shrink factor, so
+// every source texel contributes when shrinking by more than 2x. Works one output row at a time
+// so only a single row of floats is ever held.
+inline void resampleImage(const unsigned char* src, int width, int height, int channels,
+    unsigned char* dst, int dstWidth, int dstHeight)
+{
+    struct Axis
+    {
+        std::vector<int> first;     // first source texel under each output texel
+        std::vector<float> weights; // taps per output texel, normalised to sum to 1
+        int taps;
+
+        Axis(int srcSize, int dstSize)
+        {
+            const float scale = (float)srcSize / dstSize;
+            const float radius = std::max(1.0f, scale);
+            taps = (int)std::ceil(radius) * 2 + 1;
+            first.resize(dstSize);
+            weights.assign((size_t)dstSize * taps, 0.0f);
+            for (int i = 0; i < dstSize; ++i)
+            {
+                const float center = (i + 0.5f) * scale - 0.5f;
+                first[i] = (int)std::floor(center - radius) + 1;
+                float* w = &weights[(size_t)i * taps];
+                float total = 0.0f;
+                for (int t = 0; t < taps; ++t)
+                {
+                    w[t] = std::max(0.0f, 1.0f - std::fabs(first[i] + t - center) / radius);
+                    total += w[t];
+                }
+                for (int t = 0; t < taps; ++t)
+                    w[t] /= total;
+            }
+        }
+    };
+
+    const Axis across(width, dstWidth);
+    const Axis down(height, dstHeight);
+    const size_t rowValues = (size_t)width * channels;
+    std::vector<float> row(rowValues);
+
+    for (int y = 0; y < dstHeight; ++y)
+    {
+        // blend the source rows under this output row, clamping at the edges
+        std::fill(row.begin(), row.end(), 0.0f);
+        const float* wy = &down.weights[(size_t)y * down.taps];
+        for (int t = 0; t < down.taps; ++t)
+        {
+            if (wy[t] == 0.0f)
+                continue;
+            const unsigned char* srcRow = src + std::min(std::max(down.first[y] + t, 0), height - 1) * rowValues;
+            for (size_t i = 0; i < rowValues; ++i)
+                row[i] += wy[t] * srcRow[i];
+        }
+
+        unsigned char* dstRow = dst + (size_t)y * dstWidth * channels;
+        for (int x = 0; x < dstWidth; ++x)
+        {
+            const float* wx = &across.weights[(size_t)x * across.taps];
+            for (int c = 0; c < channels; ++c)
+            {
+                float sum = 0.0f;
+                for (int t = 0; t < across.taps; ++t)
+                    sum += wx[t] * row[std::min(std::max(across.first[x] + t, 0), width - 1) * channels + c];
+                dstRow[x * channels + c] = (unsigned char)std::min(255.0f, std::max(0.0f, sum + 0.5f));
+            }
+        }
+    }
+}
+
+/* Block compression
+   A straightforward BC1/BC3 encoder: colour endpoints come from the extremes of the block along its
+   principal axis, and every texel picks the closest of the four palette entries. It favours speed
+   over the last bit of quality since the bake runs at load time whenever a source changes. */
+
+inline uint16_t packColor565(const float rgb[3])
+{
+    int r = (int)(std::min(std::max(rgb[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    int g = (int)(std::min(std::max(rgb[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+    int b = (int)(std::min(std::max(rgb[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+inline void unpackColor565(uint16_t color, int rgb[3])
+{
+    int r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// texels: 16 RGBA texels, row major
+inline void encodeColorBlock(const unsigned char texels[16][4], unsigned char out[8])
+{
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; ++i)
+        for (int c = 0; c < 3; ++c)
+            mean[c] += texels[i][c] / 16.0f;
+
+    float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; ++i)
+    {
+        float r = texels[i][0] - mean[0], g = texels[i][1] - mean[1], b = texels[i][2] - mean[2];
+        cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+        cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+    }
+
+    // principal axis by power iteration
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for (int iteration = 0; iteration < 4; ++iteration)
+    {
+        float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+        float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+        float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+        float length = std::max(std::max(std::fabs(x), std::fabs(y)), std::fabs(z));
+        if (length < 1e-6f)
+            break;
+        axis[0] = x / length; axis[1] = y / length; axis[2] = z / length;
+    }
+
+    int minIndex = 0, maxIndex = 0;
+    float minDot = 1e30f, maxDot = -1e30f;
+    for (int i = 0; i < 16; ++i)
+    {
+        float d = texels[i][0] * axis[0] + texels[i][1] * axis[1] + texels[i][2] * axis[2];
+        if (d < minDot) { minDot = d; minIndex = i; }
+        if (d > maxDot) { maxDot = d; maxIndex = i; }
+    }
+
+    float hi[3] = { (float)texels[maxIndex][0], (float)texels[maxIndex][1], (float)texels[maxIndex][2] };
+    float lo[3] = { (float)texels[minIndex][0], (float)texels[minIndex][1], (float)texels[minIndex][2] };
+    uint16_t color0 = packColor565(hi);
+    uint16_t color1 = packColor565(lo);
+    if (color0 < color1)
+        std::swap(color0, color1);
+
+    // color0 > color1 selects the four colour mode; equal endpoints use index 0 everywhere
+    int palette[4][3];
+    unpackColor565(color0, palette[0]);
+    unpackColor565(color1, palette[1]);
+    for (int c = 0; c < 3; ++c)
+    {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    uint32_t indices = 0;
+    if (color0 != color1)
+    {
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0, bestError = 1 << 30;
+            for (int p = 0; p < 4; ++p)
+            {
+                int dr = texels[i][0] - palette[p][0], dg = texels[i][1] - palette[p][1], db = texels[i][2] - palette[p][2];
+                int error = dr * dr + dg * dg + db * db;
+                if (error < bestError)
+                {
+                    bestError = error;
+                    best = p;
+                }
+            }
+            indices |= (uint32_t)best << (i * 2);
+        }
+    }
+
+    out[0] = (unsigned char)(color0 & 0xFF); out[1] = (unsigned char)(color0 >> 8);
+    out[2] = (unsigned char)(color1 & 0xFF); out[3] = (unsigned char)(color1 >> 8);
+    for (int i = 0; i < 4; ++i)
+        out[4 + i] = (unsigned char)(indices >> (i * 8));
+}
+
+inline void encodeAlphaBlock(const unsigned char texels[16][4], unsigned char out[8])
+{
+    int alpha0 = 0, alpha1 = 255;
+    for (int i = 0; i < 16; ++i)
+    {
+        alpha0 = std::max(alpha0, (int)texels[i][3]);
+        alpha1 = std::min(alpha1, (int)texels[i][3]);
+    }
+
+    // alpha0 > alpha1 selects the eight value mode
+    int palette[8] = { alpha0, alpha1 };
+    for (int i = 1; i <= 6; ++i)
+        palette[i + 1] = ((7 - i) * alpha0 + i * alpha1) / 7;
+
+    uint64_t indices = 0;
+    if (alpha0 != alpha1)
+    {
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0, bestError = 256;
+            for (int p = 0; p < 8; ++p)
+            {
+                int error = std::abs(texels[i][3] - palette[p]);
+                if (error < bestError)
+                {
+                    bestError = error;
+                    best = p;
+                }
+            }
+            indices |= (uint64_t)best << (i * 3);
+        }
+    }
+
+    out[0] = (unsigned char)alpha0;
+    out[1] = (unsigned char)alpha1;
+    for (int i = 0; i < 6; ++i)
+        out[2 + i] = (unsigned char)(indices >> (i * 8));
+}
+
+// Compresses one level; edge blocks repeat the last row/column
+inline void compressLevel(const unsigned char* src, int width, int height, int channels, TextureFormat format, unsigned char* dst)
+{
+    const size_t blockBytes = format == TEXTURE_BC1 ? 8 : 16;
+    for (int by = 0; by < (height + 3) / 4; ++by)
+    {
+        for (int bx = 0; bx < (width + 3) / 4; ++bx)
+        {
+            unsigned char texels[16][4];
+            for (int i = 0; i < 16; ++i)
+            {
+                const int x = std::min(bx * 4 + i % 4, width - 1);
+                const int y = std::min(by * 4 + i / 4, height - 1);
+                const unsigned char* texel = src + ((size_t)y * width + x) * channels;
+                texels[i][0] = texel[0];
+                texels[i][1] = texel[1];
+                texels[i][2] = texel[2];
+                texels[i][3] = channels == 4 ? texel[3] : 255;
+            }
+
+            if (format == TEXTURE_BC3)
+            {
+                encodeAlphaBlock(texels, dst);
+                encodeColorBlock(texels, dst + 8);
+            }
+            else
+                encodeColorBlock(texels, dst);
+            dst += blockBytes;
+        }
+    }
+}
+
+// Builds a complete cache image (header and every level) from flipped 3 or 4 channel pixels
+inline void buildTextureCache(const unsigned char* pixels, int width, int height, int channels,
+    uint64_t sourceHash, bool compress, std::vector<unsigned char>& out)
+{
+    TextureFormat format;
+    if (compress)
+        format = channels == 4 ? TEXTURE_BC3 : TEXTURE_BC1;
+    else
+        format = channels == 4 ? TEXTURE_RGBA8 : TEXTURE_RGB8;
+
+    TextureCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = TEXTURE_CACHE_MAGIC;
+    header.version = TEXTURE_CACHE_VERSION;
+    header.sourceHash = sourceHash;
+    header.width = (uint32_t)width;
+    header.height = (uint32_t)height;
+    header.format = (uint32_t)format;
+    header.levelCount = (uint32_t)textureMipCount(width, height);
+
+    uint64_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.levelCount; ++i)
+    {
+        TextureCacheLevel& level = header.levels[i];
+        level.width = (uint32_t)std::max(1, width >> i);
+        level.height = (uint32_t)std::max(1, height >> i);
+        level.offset = offset;
+        level.size = textureLevelBytes(format, level.width, level.height);
+        offset += (level.size + 15) & ~(uint64_t)15;
+    }
+
+    out.assign((size_t)offset, 0);
+    memcpy(out.data(), &header, sizeof(header));
+
+    // walk down the chain in uncompressed form, compressing each level on the way if asked
+    std::vector<unsigned char> current(pixels, pixels + (size_t)width * height * channels);
+    std::vector<unsigned char> next;
+    for (uint32_t i = 0; i < header.levelCount; ++i)
+    {
+        const TextureCacheLevel& level = header.levels[i];
+        unsigned char* dst = out.data() + level.offset;
+        if (compress)
+            compressLevel(current.data(), level.width, level.height, channels, format, dst);
+        else
+            memcpy(dst, current.data(), (size_t)level.size);
+
+        if (i + 1 < header.levelCount)
+        {
+            next.resize((size_t)std::max(1u, level.width / 2) * std::max(1u, level.height / 2) * channels);
+            downsampleLevel(current.data(), level.width, level.height, channels, next.data());
+            current.swap(next);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,1132 @@
+#ifndef TEXTURE_LOADER_H
+#define TEXTURE_LOADER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <GL/glew.h>
+#include "Debug/stb_image.h"
+#include "cpu_features.h"
+#include "decode_arena.h"
+#include "texture_cache.h"
+
+// Row swap kernels behind flipImageVertically
+enum FlipKernel
+{
+    FLIP_BYTEWISE, // the original one byte at a time loop, kept as a benchmark baseline
+    FLIP_SCALAR,   // 8 bytes at a time, for non x86 builds
+    FLIP_SSE2,
+    FLIP_AVX2,
+    FLIP_BEST      // fastest kernel this CPU supports
+};
+
+inline void swapRowsBytewise(unsigned char* a, unsigned char* b, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i)
+    {
+        unsigned char tmp = a[i];
+        a[i] = b[i];
+        b[i] = tmp;
+    }
+}
+
+inline void swapRowsScalar(unsigned char* a, unsigned char* b, size_t bytes)
+{
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        memcpy(a + i, &y, 8);
+        memcpy(b + i, &x, 8);
+    }
+    swapRowsBytewise(a + i, b + i, bytes - i);
+}
+
+#ifdef CPU_X86_SIMD
+inline void swapRowsSSE2(unsigned char* a, unsigned char* b, size_t bytes)
+{
+    size_t i = 0;
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m128i x0 = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i x1 = _mm_loadu_si128((const __m128i*)(a + i + 16));
+        __m128i y0 = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i y1 = _mm_loadu_si128((const __m128i*)(b + i + 16));
+        _mm_storeu_si128((__m128i*)(a + i), y0);
+        _mm_storeu_si128((__m128i*)(a + i + 16), y1);
+        _mm_storeu_si128((__m128i*)(b + i), x0);
+        _mm_storeu_si128((__m128i*)(b + i + 16), x1);
+    }
+    swapRowsScalar(a + i, b + i, bytes - i);
+}
+
+CPU_AVX2_TARGET inline void swapRowsAVX2(unsigned char* a, unsigned char* b, size_t bytes)
+{
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64)
+    {
+        __m256i x0 = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i*)(a + i + 32));
+        __m256i y0 = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i y1 = _mm256_loadu_si256((const __m256i*)(b + i + 32));
+        _mm256_storeu_si256((__m256i*)(a + i), y0);
+        _mm256_storeu_si256((__m256i*)(a + i + 32), y1);
+        _mm256_storeu_si256((__m256i*)(b + i), x0);
+        _mm256_storeu_si256((__m256i*)(b + i + 32), x1);
+    }
+    swapRowsSSE2(a + i, b + i, bytes - i);
+}
+#endif
+
+// Swaps rows so the first row of the image ends up at the bottom, as OpenGL expects
+inline void flipImageVertically(unsigned char* image, int width, int height, int channels, FlipKernel kernel = FLIP_BEST)
+{
+    typedef void (*SwapRows)(unsigned char*, unsigned char*, size_t);
+    SwapRows swapRows = swapRowsScalar;
+    if (kernel == FLIP_BYTEWISE)
+        swapRows = swapRowsBytewise;
+#ifdef CPU_X86_SIMD
+    if (kernel == FLIP_SSE2 || (kernel == FLIP_BEST && !cpuHasAVX2()))
+        swapRows = swapRowsSSE2;
+    if (kernel == FLIP_AVX2 || (kernel == FLIP_BEST && cpuHasAVX2()))
+        swapRows = swapRowsAVX2;
+#endif
+
+    const size_t rowBytes = (size_t)width * channels;
+    for (int j = 0; j < height / 2; ++j)
+        swapRows(image + j * rowBytes, image + (height - 1 - j) * rowBytes, rowBytes);
+}
+
+// Helper threads for splitting a single decode into independent tasks (stb_image's parallel JPEG
+// and PNG paths). The calling thread works through its own batch as well, so a batch always
+// finishes even when every helper is busy with a batch from another decode worker. Tasks
+// allocate from the caller's DecodeArena, whichever thread runs them.
+class TaskPool
+{
+public:
+    // threadCount of 0 uses one helper per hardware thread, less the caller
+    explicit TaskPool(unsigned int threadCount = 0)
+        : stopping(false)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(1u, std::thread::hardware_concurrency()) - 1;
+
+        for (unsigned int i = 0; i < threadCount; ++i)
+            helpers.emplace_back(&TaskPool::HelperLoop, this);
+    }
+
+    ~TaskPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        batchReady.notify_all();
+        for (std::thread& helper : helpers)
+            helper.join();
+    }
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    // process-wide pool shared by all decode workers
+    static TaskPool& Shared()
+    {
+        static TaskPool pool;
+        return pool;
+    }
+
+    // calls task(data, i) for every i in [0, count) and returns once all of them are done
+    void Run(int count, void (*task)(void*, int), void* data)
+    {
+        if (count <= 1 || helpers.empty())
+        {
+            for (int i = 0; i < count; ++i)
+                task(data, i);
+            return;
+        }
+
+        std::shared_ptr<Batch> batch = std::make_shared<Batch>(task, data, count, DecodeArena::Current());
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batches.push_back(batch);
+        }
+        batchReady.notify_all();
+
+        Work(*batch);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        batchDone.wait(lock, [&batch] { return batch->done.load() == batch->count; });
+    }
+
+    // matches stbi_parallel_for, with the pool as the user pointer
+    static void StbParallelFor(void* user, int count, void (*task)(void*, int), void* data)
+    {
+        static_cast<TaskPool*>(user)->Run(count, task, data);
+    }
+
+private:
+    struct Batch
+    {
+        void (*task)(void*, int);
+        void* data;
+        int count;
+        DecodeArena* arena;
+        std::atomic<int> next;
+        std::atomic<int> done;
+
+        Batch(void (*t)(void*, int), void* d, int n, DecodeArena* a) : task(t), data(d), count(n), arena(a), next(0), done(0) {}
+    };
+
+    // claims and runs tasks until the batch has none left to hand out
+    void Work(Batch& batch)
+    {
+        DecodeArenaScope scope(batch.arena);
+        for (int i = batch.next++; i < batch.count; i = batch.next++)
+        {
+            batch.task(batch.data, i);
+            if (++batch.done == batch.count)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                batchDone.notify_all();
+            }
+        }
+    }
+
+    void HelperLoop()
+    {
+        for (;;)
+        {
+            std::shared_ptr<Batch> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                batchReady.wait(lock, [this] { return stopping || !batches.empty(); });
+                if (stopping)
+                    return;
+                batch = batches.front();
+                // every task is claimed once the last index is handed out, so the batch can leave the queue
+                if (batch->next.load() >= batch->count)
+                {
+                    batches.pop_front();
+                    continue;
+                }
+            }
+            Work(*batch);
+        }
+    }
+
+    std::vector<std::thread> helpers;
+    std::deque<std::shared_ptr<Batch>> batches;
+    std::mutex mutex;
+    std::condition_variable batchReady;
+    std::condition_variable batchDone;
+    bool stopping;
+};
+
+// An image decoded into CPU memory (or mapped from its cache file), waiting to be uploaded on the GL thread
+struct DecodedImage
+{
+    int slot;                         // index into the caller's texture id array
+    std::string filename;
+    int width;
+    int height;
+    int channels;
+    TextureFormat format;
+    std::vector<TextureLevel> levels; // largest first; a lone level gets its mipmaps built on the GPU
+    std::shared_ptr<void> storage;    // keeps the memory behind levels alive
+    bool fromCache;
+    DecodeArenaStats decodeStats;     // stb_image's allocations; all zero when nothing was decoded
+    std::string error;
+
+    DecodedImage() : slot(-1), width(0), height(0), channels(0), format(TEXTURE_RGBA8), fromCache(false) {}
+
+    bool Valid() const { return !levels.empty(); }
+
+    void Free()
+    {
+        levels.clear();
+        storage.reset();
+    }
+};
+
+// How decode workers turn a file into uploadable levels
+struct TextureLoadOptions
+{
+    bool useCache;        // read <file>.gtex when it matches the source, write it when it does not
+    bool rebuildCache;    // ignore existing entries and write fresh ones (the bake step)
+    bool compress;        // block compress newly built entries
+    bool allowCompressed; // whether the GL context can take BC1/BC3 data at all
+    bool flipInDecoder;   // have stb_image emit rows bottom-up instead of flipping afterwards
+    bool parallelDecode;  // split each JPEG/PNG decode across TaskPool::Shared()
+    bool useArena;        // decode into a pooled DecodeArena instead of the heap
+    size_t arenaBytes;    // starting size of each arena; they grow to fit and keep that size
+    size_t vramBudget;    // texture storage TextureStreamer may reserve, in bytes; 0 for no limit
+    int layerSize;        // nonzero: decode as RGBA stretched to layerSize x layerSize, one layer of a texture array
+
+    TextureLoadOptions() : useCache(true), rebuildCache(false), compress(false), allowCompressed(true), flipInDecoder(true),
+        parallelDecode(true), useArena(true), arenaBytes(0), vramBudget(0), layerSize(0) {}
+};
+
+// What a texture will need on the GPU, worked out from file headers before anything is decoded
+struct TextureProbe
+{
+    int width;
+    int height;
+    int channels;
+    TextureFormat format; // what the decode worker is expected to hand back
+    int levels;           // full mip chain
+    size_t bytes;         // storage for every level
+    std::string error;
+
+    TextureProbe() : width(0), height(0), channels(0), format(TEXTURE_RGBA8), levels(0), bytes(0) {}
+};
+
+// Format of every layer in a texture array; layers are always decoded with 4 channels
+inline TextureFormat textureLayerFormat(const TextureLoadOptions& options)
+{
+    return options.compress && options.allowCompressed ? TEXTURE_BC3 : TEXTURE_RGBA8;
+}
+
+// Reads the image header with stbi_info, and the cache header if there is one, to predict the
+// size and format Decode will produce. Fails for unreadable files and unsupported channel counts.
+inline bool probeTexture(const std::string& filename, const TextureLoadOptions& options, TextureProbe& probe)
+{
+    if (!stbi_info(filename.c_str(), &probe.width, &probe.height, &probe.channels))
+    {
+        probe.error = stbi_failure_reason() ? stbi_failure_reason() : "can't read header";
+        return false;
+    }
+    if (options.layerSize)
+    {
+        probe.width = options.layerSize;
+        probe.height = options.layerSize;
+        probe.channels = 4;
+        probe.format = textureLayerFormat(options);
+    }
+    else if (probe.channels != 3 && probe.channels != 4)
+    {
+        probe.error = std::to_string(probe.channels) + " channels not supported";
+        return false;
+    }
+    else
+    {
+        const bool compress = options.compress && options.allowCompressed;
+        probe.format = compress ? (probe.channels == 4 ? TEXTURE_BC3 : TEXTURE_BC1)
+                                : (probe.channels == 4 ? TEXTURE_RGBA8 : TEXTURE_RGB8);
+    }
+
+    // an existing entry is loaded (or rebuilt) in the format it was baked in
+    TextureCacheHeader header;
+    if (!options.layerSize && options.useCache && !options.rebuildCache && readTextureCacheHeader(textureCachePath(filename), header)
+        && header.width == (uint32_t)probe.width && header.height == (uint32_t)probe.height
+        && (options.allowCompressed || !isCompressedFormat((TextureFormat)header.format)))
+    {
+        probe.format = (TextureFormat)header.format;
+        probe.channels = (probe.format == TEXTURE_RGB8 || probe.format == TEXTURE_BC1) ? 3 : 4;
+    }
+
+    probe.levels = textureMipCount(probe.width, probe.height);
+    probe.bytes = 0;
+    for (int i = 0; i < probe.levels; ++i)
+        probe.bytes += textureLevelBytes(probe.format, std::max(1, probe.width >> i), std::max(1, probe.height >> i));
+    return true;
+}
+
+// Layer size for packing these files into one texture array: the largest side among them rounded
+// up to a power of two, no more than maxLayerSize, and halved until every layer fits the budget.
+// Files whose header can't be read don't count.
+inline int chooseTextureLayerSize(const char* const filenames[], int count, int maxLayerSize, const TextureLoadOptions& options)
+{
+    int largest = 1;
+    for (int i = 0; i < count; ++i)
+    {
+        int width, height, channels;
+        if (stbi_info(filenames[i], &width, &height, &channels))
+            largest = std::max(largest, std::max(width, height));
+    }
+
+    int layerSize = 1;
+    while (layerSize < largest && layerSize * 2 <= maxLayerSize)
+        layerSize *= 2;
+
+    const TextureFormat format = textureLayerFormat(options);
+    while (options.vramBudget && layerSize > 1)
+    {
+        size_t bytes = 0;
+        for (int i = 0; i < textureMipCount(layerSize, layerSize); ++i)
+            bytes += textureLevelBytes(format, std::max(1, layerSize >> i), std::max(1, layerSize >> i));
+        if (bytes * count <= options.vramBudget)
+            break;
+        layerSize /= 2;
+    }
+    return layerSize;
+}
+
+// Decodes image files on a pool of worker threads. Only the CPU side (cache lookup, stbi_load,
+// the vertical flip and any rebake) happens here; the GL upload stays on the thread that owns
+// the context.
+class TextureDecodePool
+{
+public:
+    // threadCount of 0 uses one worker per hardware thread
+    explicit TextureDecodePool(unsigned int threadCount = 0, const TextureLoadOptions& options = TextureLoadOptions())
+        : loadOptions(options), arenas(std::make_shared<DecodeArenaPool>(options.arenaBytes)), stopping(false), pending(0)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+        // stb_image keeps one process-wide setting, so the latest pool decides it
+        if (options.parallelDecode)
+            stbi_set_parallel_for(&TaskPool::StbParallelFor, &TaskPool::Shared());
+        else
+            stbi_set_parallel_for(nullptr, nullptr);
+
+        for (unsigned int i = 0; i < threadCount; ++i)
+            workers.emplace_back(&TextureDecodePool::WorkerLoop, this);
+    }
+
+    ~TextureDecodePool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+
+        // Drop anything that was decoded but never collected
+        for (DecodedImage& image : results)
+            image.Free();
+    }
+
+    TextureDecodePool(const TextureDecodePool&) = delete;
+    TextureDecodePool& operator=(const TextureDecodePool&) = delete;
+
+    // queues a file for decoding into the given slot
+    void Submit(int slot, const std::string& filename)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Job job;
+            job.slot = slot;
+            job.filename = filename;
+            jobs.push_back(job);
+            ++pending;
+        }
+        jobReady.notify_one();
+    }
+
+    // blocks until the next image finishes decoding, in completion order. Returns false once
+    // every submitted image has been handed out.
+    bool WaitNext(DecodedImage& image)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        resultReady.wait(lock, [this] { return !results.empty() || pending == 0; });
+        if (results.empty())
+            return false;
+
+        image = results.front();
+        results.pop_front();
+        return true;
+    }
+
+    // non-blocking version of WaitNext; returns false if nothing has finished yet
+    bool PollNext(DecodedImage& image)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (results.empty())
+            return false;
+
+        image = results.front();
+        results.pop_front();
+        return true;
+    }
+
+private:
+    struct Job
+    {
+        int slot;
+        std::string filename;
+    };
+
+    void WorkerLoop()
+    {
+        stbi_set_flip_vertically_on_load_thread(loadOptions.flipInDecoder ? 1 : 0);
+
+        for (;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping)
+                    return;
+                job = jobs.front();
+                jobs.pop_front();
+            }
+
+            DecodedImage image = Decode(job, loadOptions, loadOptions.useArena ? arenas->Acquire() : nullptr);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                results.push_back(image);
+                --pending;
+            }
+            resultReady.notify_all();
+        }
+    }
+
+    // arena is nullptr to decode on the heap. It goes back to the pool once the pixels are freed,
+    // which for an uncached separate texture is after the upload.
+    static DecodedImage Decode(const Job& job, const TextureLoadOptions& options, std::shared_ptr<DecodeArena> arena)
+    {
+        DecodedImage image;
+        image.slot = job.slot;
+        image.filename = job.filename;
+
+        std::vector<unsigned char> source;
+        if (!readFileBytes(job.filename, source))
+        {
+            image.error = "can't open file";
+            return image;
+        }
+
+        const uint64_t sourceHash = hashBytes(source.data(), source.size());
+        const std::string cachePath = textureCachePath(job.filename, options.layerSize);
+        const int layerSize = options.layerSize;
+        bool compress = options.compress;
+
+        if (options.useCache)
+        {
+            std::shared_ptr<MappedFile> cache(new MappedFile);
+            if (cache->Open(cachePath))
+            {
+                if (!options.rebuildCache && parseTextureCache(cache->Data(), cache->Size(), sourceHash, image.format, image.levels)
+                    && (options.allowCompressed || !isCompressedFormat(image.format))
+                    && (!layerSize || (image.format == textureLayerFormat(options) && image.levels[0].width == layerSize
+                        && image.levels[0].height == layerSize)))
+                {
+                    image.width = image.levels[0].width;
+                    image.height = image.levels[0].height;
+                    image.channels = (image.format == TEXTURE_RGB8 || image.format == TEXTURE_BC1) ? 3 : 4;
+                    image.storage = cache;
+                    image.fromCache = true;
+                    return image;
+                }
+
+                // stale entry: rebuild it in the format it was baked in, unless it's a layer
+                // whose format the array decides
+                TextureCacheHeader header;
+                if (!layerSize && cache->Size() >= sizeof(header))
+                {
+                    memcpy(&header, cache->Data(), sizeof(header));
+                    if (header.magic == TEXTURE_CACHE_MAGIC && header.format <= TEXTURE_BC3)
+                        compress = compress || isCompressedFormat((TextureFormat)header.format);
+                }
+                image.levels.clear();
+            }
+        }
+        compress = compress && options.allowCompressed;
+
+        unsigned char* pixels;
+        {
+            DecodeArenaScope scope(arena.get());
+            pixels = stbi_load_from_memory(source.data(), (int)source.size(), &image.width, &image.height, &image.channels, layerSize ? 4 : 0);
+        }
+        if (arena)
+            image.decodeStats = arena->Stats();
+        if (!pixels)
+        {
+            image.error = stbi_failure_reason() ? stbi_failure_reason() : "unknown error";
+            return image;
+        }
+        if (layerSize)
+            image.channels = 4; // stb_image reports what the file had, not what it was asked for
+        if (image.channels != 3 && image.channels != 4)
+        {
+            image.error = std::to_string(image.channels) + " channels not supported";
+            stbi_image_free(pixels);
+            return image;
+        }
+        if (!options.flipInDecoder)
+            flipImageVertically(pixels, image.width, image.height, image.channels);
+
+        std::shared_ptr<void> decoded(pixels, [arena](void* p) { stbi_image_free(p); });
+
+        // A layer is stretched to the array's square. Texture coordinates span the whole layer
+        // either way, so only the resolution along each axis changes.
+        if (layerSize && (image.width != layerSize || image.height != layerSize))
+        {
+            std::shared_ptr<std::vector<unsigned char> > layer(new std::vector<unsigned char>((size_t)layerSize * layerSize * 4));
+            resampleImage(pixels, image.width, image.height, 4, layer->data(), layerSize, layerSize);
+            pixels = layer->data();
+            decoded = std::shared_ptr<void>(layer, pixels);
+            image.width = layerSize;
+            image.height = layerSize;
+        }
+
+        // A separate texture without the cache goes up as one level for glGenerateMipmap. A layer
+        // is built like a cache entry, mips and compression included, just not written out, since
+        // it must match the array's format and generating mips on the GPU would rebuild every layer.
+        if (!options.useCache && !layerSize)
+        {
+            TextureLevel level;
+            level.width = image.width;
+            level.height = image.height;
+            level.data = pixels;
+            level.size = (size_t)image.width * image.height * image.channels;
+            image.levels.push_back(level);
+            image.format = image.channels == 4 ? TEXTURE_RGBA8 : TEXTURE_RGB8;
+            image.storage = decoded;
+            return image;
+        }
+
+        std::shared_ptr<std::vector<unsigned char> > baked(new std::vector<unsigned char>);
+        buildTextureCache(pixels, image.width, image.height, image.channels, sourceHash, compress, *baked);
+        decoded.reset();
+
+        if (options.useCache)
+            writeFileBytes(cachePath, *baked); // a read-only directory only costs the next launch a rebake
+        parseTextureCache(baked->data(), baked->size(), sourceHash, image.format, image.levels);
+        image.storage = baked;
+        return image;
+    }
+
+    TextureLoadOptions loadOptions;
+    std::shared_ptr<DecodeArenaPool> arenas;
+    std::vector<std::thread> workers;
+    std::deque<Job> jobs;
+    std::deque<DecodedImage> results;
+    std::mutex mutex;
+    std::condition_variable jobReady;
+    std::condition_variable resultReady;
+    bool stopping;
+    int pending; // submitted but not yet decoded
+};
+
+// Streams textures in behind 1x1 placeholders so rendering can start before anything is decoded.
+// Start probes every file's header and reserves immutable storage (glTexStorage2D, full mip
+// chain) for all of them before any decode, so the VRAM total is known up front and files that
+// can't be used fail right away. Decoding runs on a TextureDecodePool; decoded levels are copied
+// into a small ring of pixel buffer objects a band at a time, so no single frame pays for a whole
+// image. A slot's real texture id replaces the placeholder only after the fence behind its last
+// upload (and mipmap build) signals.
+// StartArray streams into the layers of one GL_TEXTURE_2D_ARRAY instead. A layer counts as
+// resident once its fence signals, and until then the caller shows its own placeholder.
+class TextureStreamer
+{
+public:
+    static const int STAGING_BUFFERS = 4;                     // pixel buffer objects in the ring
+    static const GLsizeiptr STAGING_BYTES = 4 * 1024 * 1024;  // capacity of each one; always holds a full row
+
+    TextureStreamer() : textureIds(nullptr), arrayTexture(0), arrayFormat(TEXTURE_RGBA8), layerSize(0), remaining(0), failed(0), nextStaging(0)
+    {
+        for (int i = 0; i < STAGING_BUFFERS; ++i)
+        {
+            staging[i].pbo = 0;
+            staging[i].fence = 0;
+        }
+    }
+
+    TextureStreamer(const TextureStreamer&) = delete;
+    TextureStreamer& operator=(const TextureStreamer&) = delete;
+
+    // Fills every slot with a placeholder, reserves storage for each file that probes cleanly
+    // and fits the budget, and queues those for decoding. ids must stay valid until every texture
+    // is resident; slots are overwritten as real textures become ready.
+    void Start(const char* const filenames[], GLuint ids[], int count,
+        const TextureLoadOptions& loadOptions = TextureLoadOptions(), unsigned int threadCount = 0)
+    {
+        textureIds = ids;
+        arrayTexture = 0;
+        remaining = count;
+        failed = 0;
+        reserved.assign(count, Reservation());
+
+        const unsigned char placeholder[4] = { 128, 128, 128, 255 };
+        for (int i = 0; i < count; ++i)
+        {
+            glGenTextures(1, &textureIds[i]);
+            glBindTexture(GL_TEXTURE_2D, textureIds[i]);
+            glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, 1, 1);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        std::vector<bool> queued(count, false);
+        size_t reservedBytes = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            TextureProbe probe;
+            if (!probeTexture(filenames[i], loadOptions, probe))
+            {
+                std::cout << "Failed to load texture " << filenames[i] << " (" << probe.error << "), keeping placeholder" << std::endl;
+                ++failed;
+                --remaining;
+                continue;
+            }
+            if (loadOptions.vramBudget && reservedBytes + probe.bytes > loadOptions.vramBudget)
+            {
+                std::cout << "Skipping texture " << filenames[i] << ": " << probe.bytes / (1024 * 1024) << " MB would pass the "
+                          << loadOptions.vramBudget / (1024 * 1024) << " MB budget, keeping placeholder" << std::endl;
+                ++failed;
+                --remaining;
+                continue;
+            }
+
+            reserved[i].texture = CreateStorage(probe.format, probe.width, probe.height, probe.levels);
+            reserved[i].format = probe.format;
+            reserved[i].width = probe.width;
+            reserved[i].height = probe.height;
+            reservedBytes += probe.bytes;
+            queued[i] = true;
+        }
+        std::cout << "Reserved " << reservedBytes / (1024.0 * 1024.0) << " MB of texture storage for "
+                  << count - failed << " of " << count << " textures" << std::endl;
+
+        Launch(filenames, queued, loadOptions, threadCount);
+    }
+
+    // Packs the files into the layers of one texture array, layer i holding filenames[i], all
+    // stretched to one square size (see chooseTextureLayerSize) and stored as RGBA8, or BC3 when
+    // compressing. The array's storage is reserved here and its id written to arrayId; the caller
+    // owns it. A file that fails leaves its layer without content for good.
+    void StartArray(const char* const filenames[], int count, GLuint& arrayId, int maxLayerSize,
+        const TextureLoadOptions& loadOptions = TextureLoadOptions(), unsigned int threadCount = 0)
+    {
+        textureIds = nullptr;
+        remaining = count;
+        failed = 0;
+        reserved.clear();
+        resident.assign(count, false);
+
+        TextureLoadOptions options = loadOptions;
+        options.layerSize = chooseTextureLayerSize(filenames, count, maxLayerSize, loadOptions);
+        layerSize = options.layerSize;
+        arrayFormat = textureLayerFormat(options);
+
+        std::vector<bool> queued(count, false);
+        for (int i = 0; i < count; ++i)
+        {
+            TextureProbe probe;
+            if (!probeTexture(filenames[i], options, probe))
+            {
+                std::cout << "Failed to load texture " << filenames[i] << " (" << probe.error << "), leaving layer " << i << " empty" << std::endl;
+                ++failed;
+                --remaining;
+                continue;
+            }
+            queued[i] = true;
+        }
+
+        const int levels = textureMipCount(layerSize, layerSize);
+        glGenTextures(1, &arrayTexture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, arrayTexture);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, InternalFormat(arrayFormat), layerSize, layerSize, count);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        arrayId = arrayTexture;
+
+        size_t layerBytes = 0;
+        for (int i = 0; i < levels; ++i)
+            layerBytes += textureLevelBytes(arrayFormat, std::max(1, layerSize >> i), std::max(1, layerSize >> i));
+        std::cout << "Reserved " << layerBytes * count / (1024.0 * 1024.0) << " MB for a " << layerSize << "x" << layerSize
+                  << " texture array of " << count << " layers" << std::endl;
+
+        Launch(filenames, queued, options, threadCount);
+    }
+
+    // Advances streaming by at most one band per staging buffer. Call once per frame on the
+    // GL thread. Returns true if anything changed.
+    bool Update()
+    {
+        if (remaining == 0)
+            return false;
+
+        bool progressed = false;
+
+        DecodedImage image;
+        while (pool && pool->PollNext(image))
+        {
+            progressed = true;
+            if (arrayTexture && image.Valid() && (image.format != arrayFormat || image.width != layerSize || image.height != layerSize))
+            {
+                image.Free();
+                image.error = "doesn't match the texture array";
+            }
+            if (!image.Valid())
+            {
+                std::cout << "Failed to load texture " << image.filename << " (" << image.error << "), keeping placeholder" << std::endl;
+                if (!arrayTexture)
+                {
+                    glDeleteTextures(1, &reserved[image.slot].texture);
+                    reserved[image.slot].texture = 0;
+                }
+                ++failed;
+                --remaining;
+                continue;
+            }
+            if (image.decodeStats.allocations > 0)
+                std::cout << "Decoded " << image.filename << ": " << describeDecodeArenaStats(image.decodeStats) << std::endl;
+            BeginUpload(image);
+        }
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (int band = 0; band < STAGING_BUFFERS && !uploads.empty(); ++band)
+        {
+            StagingBuffer* buffer = AcquireStaging();
+            if (!buffer)
+                break;
+            UploadBand(uploads.front(), *buffer);
+            progressed = true;
+
+            Upload& upload = uploads.front();
+            if (upload.level == (int)upload.image.levels.size())
+            {
+                // array layers always arrive with their whole chain (see TextureDecodePool::Decode)
+                if (!arrayTexture && upload.image.levels.size() == 1)
+                {
+                    glBindTexture(Target(), upload.texture);
+                    glGenerateMipmap(Target());
+                    glBindTexture(Target(), 0);
+                }
+                upload.image.Free();
+                upload.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                finishing.push_back(upload);
+                uploads.pop_front();
+            }
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        for (size_t i = 0; i < finishing.size(); )
+        {
+            if (!Signaled(finishing[i].fence))
+            {
+                ++i;
+                continue;
+            }
+            glDeleteSync(finishing[i].fence);
+            if (arrayTexture)
+            {
+                resident[finishing[i].slot] = true;
+            }
+            else
+            {
+                glDeleteTextures(1, &textureIds[finishing[i].slot]);
+                textureIds[finishing[i].slot] = finishing[i].texture;
+            }
+            finishing.erase(finishing.begin() + i);
+            --remaining;
+            progressed = true;
+        }
+
+        if (remaining == 0)
+            ReleaseStaging();
+
+        return progressed;
+    }
+
+    // Blocks until every slot holds its real texture or has failed. Returns false on any failure.
+    bool Finish()
+    {
+        while (remaining > 0)
+        {
+            if (!Update())
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return failed == 0;
+    }
+
+    bool Done() const { return remaining == 0; }
+
+    // whether a StartArray layer holds its texture yet
+    bool LayerResident(int layer) const
+    {
+        return layer >= 0 && layer < (int)resident.size() && resident[layer];
+    }
+
+    // Releases everything still in flight; slots that never finished keep their placeholder. A
+    // texture array stays with the caller, with whichever layers made it.
+    void Shutdown()
+    {
+        pool.reset();
+        for (Reservation& reservation : reserved)
+        {
+            if (reservation.texture)
+                glDeleteTextures(1, &reservation.texture);
+        }
+        reserved.clear();
+        for (Upload& upload : uploads)
+        {
+            if (!arrayTexture)
+                glDeleteTextures(1, &upload.texture);
+        }
+        for (Upload& upload : finishing)
+        {
+            glDeleteSync(upload.fence);
+            if (!arrayTexture)
+                glDeleteTextures(1, &upload.texture);
+        }
+        uploads.clear();
+        finishing.clear();
+        ReleaseStaging();
+        remaining = 0;
+    }
+
+private:
+    struct StagingBuffer
+    {
+        GLuint pbo;
+        GLsync fence; // last transfer out of this buffer; 0 when free
+    };
+
+    // storage made by Start for a slot that hasn't started uploading yet
+    struct Reservation
+    {
+        GLuint texture;
+        TextureFormat format;
+        int width;
+        int height;
+
+        Reservation() : texture(0), format(TEXTURE_RGBA8), width(0), height(0) {}
+    };
+
+    struct Upload
+    {
+        int slot;
+        DecodedImage image;
+        GLuint texture;
+        int level;   // level being transferred
+        int nextRow; // first pixel row of that level not yet transferred
+        GLsync fence;
+    };
+
+    GLenum Target() const { return arrayTexture ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D; }
+
+    static bool Signaled(GLsync fence)
+    {
+        GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+    }
+
+    static GLenum InternalFormat(TextureFormat format)
+    {
+        switch (format)
+        {
+        case TEXTURE_RGB8:  return GL_RGB8;
+        case TEXTURE_RGBA8: return GL_RGBA8;
+        case TEXTURE_BC1:   return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case TEXTURE_BC3:   return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        }
+        return GL_RGBA8;
+    }
+
+    // Immutable storage for a full mip chain (the chain a cache file holds, or the one
+    // glGenerateMipmap fills in)
+    static GLuint CreateStorage(TextureFormat format, int width, int height, int levels)
+    {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexStorage2D(GL_TEXTURE_2D, levels, InternalFormat(format), width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return texture;
+    }
+
+    // creates the staging ring and queues the files marked in queued for decoding
+    void Launch(const char* const filenames[], const std::vector<bool>& queued, const TextureLoadOptions& loadOptions, unsigned int threadCount)
+    {
+        for (int i = 0; i < STAGING_BUFFERS; ++i)
+        {
+            glGenBuffers(1, &staging[i].pbo);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging[i].pbo);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, STAGING_BYTES, nullptr, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        if (remaining == 0)
+            return;
+        if (threadCount == 0)
+            threadCount = std::min((unsigned int)remaining, std::max(1u, std::thread::hardware_concurrency()));
+        pool.reset(new TextureDecodePool(threadCount, loadOptions));
+        for (int i = 0; i < (int)queued.size(); ++i)
+        {
+            if (queued[i])
+                pool->Submit(i, filenames[i]);
+        }
+    }
+
+    void BeginUpload(const DecodedImage& image)
+    {
+        Upload upload;
+        upload.slot = image.slot;
+        upload.image = image;
+        upload.level = 0;
+        upload.nextRow = 0;
+        upload.fence = 0;
+
+        if (arrayTexture)
+        {
+            upload.texture = arrayTexture;
+            uploads.push_back(upload);
+            return;
+        }
+
+        // the probe guessed wrong (say, a stale cache entry rebuilt in another format), so the
+        // reservation is traded for storage that fits
+        Reservation& reservation = reserved[image.slot];
+        if (reservation.format != image.format || reservation.width != image.width || reservation.height != image.height)
+        {
+            glDeleteTextures(1, &reservation.texture);
+            const int levels = image.levels.size() > 1 ? (int)image.levels.size() : textureMipCount(image.width, image.height);
+            reservation.texture = CreateStorage(image.format, image.width, image.height, levels);
+        }
+        upload.texture = reservation.texture;
+        reservation.texture = 0;
+
+        uploads.push_back(upload);
+    }
+
+    // returns the next staging buffer whose previous transfer has completed, or nullptr
+    StagingBuffer* AcquireStaging()
+    {
+        StagingBuffer& buffer = staging[nextStaging];
+        if (buffer.fence)
+        {
+            if (!Signaled(buffer.fence))
+                return nullptr;
+            glDeleteSync(buffer.fence);
+            buffer.fence = 0;
+        }
+        nextStaging = (nextStaging + 1) % STAGING_BUFFERS;
+        return &buffer;
+    }
+
+    // Fills the staging buffer with as many rows as fit, continuing into the following mip
+    // levels once a level is complete, and starts their transfer. Compressed levels move in
+    // whole rows of 4x4 blocks.
+    void UploadBand(Upload& upload, StagingBuffer& buffer)
+    {
+        const DecodedImage& image = upload.image;
+        const bool compressed = isCompressedFormat(image.format);
+        const GLenum internalFormat = InternalFormat(image.format);
+        const GLenum pixelFormat = image.channels == 3 ? GL_RGB : GL_RGBA;
+        const int rowsPerUnit = compressed ? 4 : 1;
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.pbo);
+        unsigned char* dst = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, STAGING_BYTES,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+
+        struct Chunk
+        {
+            int level, y, rows;
+            size_t offset, bytes;
+        };
+        std::vector<Chunk> chunks;
+        size_t used = 0;
+
+        while (upload.level < (int)image.levels.size())
+        {
+            const TextureLevel& level = image.levels[upload.level];
+            const size_t unitBytes = compressed
+                ? textureLevelBytes(image.format, level.width, 4)
+                : (size_t)level.width * image.channels;
+            const int unitsLeft = (level.height - upload.nextRow + rowsPerUnit - 1) / rowsPerUnit;
+            const int units = std::min(unitsLeft, (int)(((size_t)STAGING_BYTES - used) / unitBytes));
+            if (units == 0)
+                break;
+
+            Chunk chunk;
+            chunk.level = upload.level;
+            chunk.y = upload.nextRow;
+            chunk.rows = std::min(units * rowsPerUnit, level.height - upload.nextRow);
+            chunk.offset = used;
+            chunk.bytes = units * unitBytes;
+            memcpy(dst + used, level.data + (upload.nextRow / rowsPerUnit) * unitBytes, chunk.bytes);
+            chunks.push_back(chunk);
+            used += (chunk.bytes + 15) & ~(size_t)15;
+
+            upload.nextRow += chunk.rows;
+            if (upload.nextRow == level.height)
+            {
+                ++upload.level;
+                upload.nextRow = 0;
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        glBindTexture(Target(), upload.texture);
+        for (const Chunk& chunk : chunks)
+        {
+            const int width = image.levels[chunk.level].width;
+            if (arrayTexture && compressed)
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, chunk.level, 0, chunk.y, upload.slot, width, chunk.rows, 1,
+                    internalFormat, (GLsizei)chunk.bytes, (const void*)chunk.offset);
+            else if (arrayTexture)
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, chunk.level, 0, chunk.y, upload.slot, width, chunk.rows, 1,
+                    pixelFormat, GL_UNSIGNED_BYTE, (const void*)chunk.offset);
+            else if (compressed)
+                glCompressedTexSubImage2D(GL_TEXTURE_2D, chunk.level, 0, chunk.y, width, chunk.rows,
+                    internalFormat, (GLsizei)chunk.bytes, (const void*)chunk.offset);
+            else
+                glTexSubImage2D(GL_TEXTURE_2D, chunk.level, 0, chunk.y, width, chunk.rows,
+                    pixelFormat, GL_UNSIGNED_BYTE, (const void*)chunk.offset);
+        }
+        glBindTexture(Target(), 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    void ReleaseStaging()
+    {
+        for (int i = 0; i < STAGING_BUFFERS; ++i)
+        {
+            if (staging[i].fence)
+                glDeleteSync(staging[i].fence);
+            if (staging[i].pbo)
+                glDeleteBuffers(1, &staging[i].pbo);
+            staging[i].pbo = 0;
+            staging[i].fence = 0;
+        }
+    }
+
+    GLuint* textureIds;
+    GLuint arrayTexture;               // StartArray's texture; 0 when streaming separate textures
+    TextureFormat arrayFormat;
+    int layerSize;
+    std::vector<bool> resident;        // StartArray layers whose upload has completed
+    std::vector<Reservation> reserved; // indexed by slot
+    int remaining; // slots still showing their placeholder and not yet failed
+    int failed;
+    std::unique_ptr<TextureDecodePool> pool;
+    std::deque<Upload> uploads;   // decoded, transfer in progress
+    std::vector<Upload> finishing; // fully submitted, waiting on their fence
+    StagingBuffer staging[STAGING_BUFFERS];
+    int nextStaging;
+};
+
+#endif
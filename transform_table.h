@@ -0,0 +1,151 @@
+#ifndef TRANSFORM_TABLE_H
+#define TRANSFORM_TABLE_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Local transforms (translate * rotate * scale) and the world and normal matrices built from
+// them, one entry per object, each component in its own contiguous array. The matrices are only
+// rebuilt for entries changed since the last Update, so a frame in which nothing moves costs
+// nothing however many objects there are.
+class TransformTable
+{
+public:
+    // angle in radians about axis, which need not be unit length. Returns the new entry's index.
+    uint32_t Add(const glm::vec3& translation, float angle, const glm::vec3& axis, const glm::vec3& scale)
+    {
+        const uint32_t index = (uint32_t)translations.size();
+        translations.push_back(translation);
+        rotations.push_back(axisAngle(angle, axis));
+        scales.push_back(scale);
+        worlds.push_back(glm::mat4(1.0f));
+        normals.push_back(glm::mat3(1.0f));
+        dirty.push_back(0);
+        markDirty(index);
+        return index;
+    }
+
+    void SetTranslation(uint32_t index, const glm::vec3& translation)
+    {
+        translations[index] = translation;
+        markDirty(index);
+    }
+
+    void SetRotation(uint32_t index, float angle, const glm::vec3& axis)
+    {
+        rotations[index] = axisAngle(angle, axis);
+        markDirty(index);
+    }
+
+    void SetScale(uint32_t index, const glm::vec3& scale)
+    {
+        scales[index] = scale;
+        markDirty(index);
+    }
+
+    // Moves the last entry into index and drops the last slot, so the arrays stay packed. The
+    // moved entry counts as changed at its new index.
+    void Remove(uint32_t index)
+    {
+        const uint32_t last = (uint32_t)worlds.size() - 1;
+        translations[index] = translations[last];
+        rotations[index] = rotations[last];
+        scales[index] = scales[last];
+        worlds[index] = worlds[last];
+        normals[index] = normals[last];
+        translations.pop_back();
+        rotations.pop_back();
+        scales.pop_back();
+        worlds.pop_back();
+        normals.pop_back();
+        dirty.pop_back();
+        if (index < last)
+            markDirty(index);
+    }
+
+    // Rebuilds the world and normal matrices of every entry changed since the last call and
+    // returns their indices, valid until the next call
+    const std::vector<uint32_t>& Update()
+    {
+        updated.clear();
+        for (uint32_t index : dirtyList)
+        {
+            if (index >= worlds.size())
+                continue; // removed since it changed
+            worlds[index] = compose(translations[index], rotations[index], scales[index]);
+            normals[index] = normalMatrix(worlds[index], scales[index]);
+            dirty[index] = 0;
+            updated.push_back(index);
+        }
+        dirtyList.clear();
+        return updated;
+    }
+
+    const glm::mat4& World(uint32_t index) const { return worlds[index]; }
+    const glm::mat3& Normal(uint32_t index) const { return normals[index]; }
+    const glm::vec3& Scale(uint32_t index) const { return scales[index]; }
+    size_t Count() const { return worlds.size(); }
+
+private:
+    void markDirty(uint32_t index)
+    {
+        if (dirty[index])
+            return;
+        dirty[index] = 1;
+        dirtyList.push_back(index);
+    }
+
+    // unit axis in xyz, angle in w; the axis is normalised here once rather than on every rebuild
+    static glm::vec4 axisAngle(float angle, const glm::vec3& axis)
+    {
+        const float length = std::sqrt(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+        if (length == 0.0f)
+            return glm::vec4(0.0f, 1.0f, 0.0f, 0.0f);
+        return glm::vec4(axis.x / length, axis.y / length, axis.z / length, angle);
+    }
+
+    // translate * rotate * scale, written out: the rotation's columns scaled, translation last
+    static glm::mat4 compose(const glm::vec3& t, const glm::vec4& r, const glm::vec3& s)
+    {
+        const float c = std::cos(r.w);
+        const float sn = std::sin(r.w);
+        const float k = 1.0f - c;
+        const float x = r.x, y = r.y, z = r.z;
+
+        glm::mat4 m(1.0f);
+        m[0] = glm::vec4(c + k * x * x, k * x * y + sn * z, k * x * z - sn * y, 0.0f) * s.x;
+        m[1] = glm::vec4(k * x * y - sn * z, c + k * y * y, k * y * z + sn * x, 0.0f) * s.y;
+        m[2] = glm::vec4(k * x * z + sn * y, k * y * z - sn * x, c + k * z * z, 0.0f) * s.z;
+        m[3] = glm::vec4(t.x, t.y, t.z, 1.0f);
+        return m;
+    }
+
+    // The inverse transpose of the world matrix's upper 3x3, from its parts rather than a general
+    // inverse: for R * S it is R * S^-1, the world columns divided by the squared scale. Rigid and
+    // uniformly scaled entries take the rotation alone, since shaders renormalise the normal.
+    static glm::mat3 normalMatrix(const glm::mat4& world, const glm::vec3& s)
+    {
+        if (s.x == s.y && s.y == s.z)
+        {
+            const float inverse = s.x != 0.0f ? 1.0f / s.x : 0.0f;
+            return glm::mat3(glm::vec3(world[0]) * inverse, glm::vec3(world[1]) * inverse, glm::vec3(world[2]) * inverse);
+        }
+        const glm::vec3 inverse(s.x != 0.0f ? 1.0f / (s.x * s.x) : 0.0f, s.y != 0.0f ? 1.0f / (s.y * s.y) : 0.0f,
+                                s.z != 0.0f ? 1.0f / (s.z * s.z) : 0.0f);
+        return glm::mat3(glm::vec3(world[0]) * inverse.x, glm::vec3(world[1]) * inverse.y, glm::vec3(world[2]) * inverse.z);
+    }
+
+    std::vector<glm::vec3> translations;
+    std::vector<glm::vec4> rotations;
+    std::vector<glm::vec3> scales;
+    std::vector<glm::mat4> worlds;
+    std::vector<glm::mat3> normals;
+    std::vector<uint8_t> dirty;
+    std::vector<uint32_t> dirtyList;
+    std::vector<uint32_t> updated;
+};
+
+#endif
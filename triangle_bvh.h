@@ -0,0 +1,289 @@
+#ifndef TRIANGLE_BVH_H
+#define TRIANGLE_BVH_H
+
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "bounding_volume.h"
+#include "bvh.h"
+#include "cpu_features.h"
+
+enum TriangleKernel
+{
+    TRIANGLES_SCALAR,
+    TRIANGLES_SSE2, // 4 triangles at a time
+    TRIANGLES_AVX2, // 8 triangles at a time
+    TRIANGLES_BEST  // fastest kernel this CPU supports
+};
+
+// Triangles as the intersection kernels read them: each triangle's first corner and two edges,
+// every coordinate in its own array, in leaf order so a leaf is one run of lanes
+struct TriangleLanes
+{
+    const float* v0[3];
+    const float* e1[3];
+    const float* e2[3];
+};
+
+// Ray-triangle tests for count triangles from first (Moller and Trumbore, "Fast, Minimum
+// Storage Ray/Triangle Intersection", 1997), either side facing. Each lowers distance to the
+// nearest hit and sets lane to its triangle, and returns whether there was one.
+inline bool intersectTrianglesScalar(const TriangleLanes& lanes, const glm::vec3& origin, const glm::vec3& direction,
+                                     uint32_t first, uint32_t count, float& distance, uint32_t& lane)
+{
+    bool hit = false;
+    for (uint32_t i = first; i < first + count; ++i)
+    {
+        const glm::vec3 e1(lanes.e1[0][i], lanes.e1[1][i], lanes.e1[2][i]);
+        const glm::vec3 e2(lanes.e2[0][i], lanes.e2[1][i], lanes.e2[2][i]);
+        const glm::vec3 p = glm::cross(direction, e2);
+        const float det = glm::dot(e1, p);
+        if (std::fabs(det) < 1e-12f)
+            continue;
+        const float inverse = 1.0f / det;
+        const glm::vec3 s = origin - glm::vec3(lanes.v0[0][i], lanes.v0[1][i], lanes.v0[2][i]);
+        const float u = glm::dot(s, p) * inverse;
+        if (u < 0.0f || u > 1.0f)
+            continue;
+        const glm::vec3 q = glm::cross(s, e1);
+        const float v = glm::dot(direction, q) * inverse;
+        if (v < 0.0f || u + v > 1.0f)
+            continue;
+        const float t = glm::dot(e2, q) * inverse;
+        if (t >= 0.0f && t < distance)
+        {
+            distance = t;
+            lane = i;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+#ifdef CPU_X86_SIMD
+// Lanes past count belong to the next leaf, or are zero padding at the end, so they are tested
+// too: any hit they report is a real one.
+inline bool intersectTrianglesSSE2(const TriangleLanes& lanes, const glm::vec3& origin, const glm::vec3& direction,
+                                   uint32_t first, uint32_t count, float& distance, uint32_t& lane)
+{
+    const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+    const __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 epsilon = _mm_set1_ps(1e-12f);
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+    bool hit = false;
+    for (uint32_t i = first; i < first + count; i += 4)
+    {
+        const __m128 e1x = _mm_loadu_ps(lanes.e1[0] + i), e1y = _mm_loadu_ps(lanes.e1[1] + i), e1z = _mm_loadu_ps(lanes.e1[2] + i);
+        const __m128 e2x = _mm_loadu_ps(lanes.e2[0] + i), e2y = _mm_loadu_ps(lanes.e2[1] + i), e2z = _mm_loadu_ps(lanes.e2[2] + i);
+
+        // p = direction x e2, det = e1 . p
+        const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        const __m128 inverse = _mm_div_ps(one, det);
+
+        const __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(lanes.v0[0] + i));
+        const __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(lanes.v0[1] + i));
+        const __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(lanes.v0[2] + i));
+        const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverse);
+
+        // q = s x e1
+        const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverse);
+        const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverse);
+
+        __m128 mask = _mm_cmpge_ps(_mm_andnot_ps(signBit, det), epsilon);
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(distance)));
+        int bits = _mm_movemask_ps(mask);
+        if (bits == 0)
+            continue;
+
+        float ts[4];
+        _mm_storeu_ps(ts, t);
+        for (; bits != 0; bits &= bits - 1)
+        {
+            const int k = bits & 1 ? 0 : (bits & 2 ? 1 : (bits & 4 ? 2 : 3));
+            if (ts[k] < distance)
+            {
+                distance = ts[k];
+                lane = i + k;
+                hit = true;
+            }
+        }
+    }
+    return hit;
+}
+
+CPU_AVX2_TARGET inline bool intersectTrianglesAVX2(const TriangleLanes& lanes, const glm::vec3& origin, const glm::vec3& direction,
+                                                   uint32_t first, uint32_t count, float& distance, uint32_t& lane)
+{
+    const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+    const __m256 dx = _mm256_set1_ps(direction.x), dy = _mm256_set1_ps(direction.y), dz = _mm256_set1_ps(direction.z);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 epsilon = _mm256_set1_ps(1e-12f);
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    bool hit = false;
+    for (uint32_t i = first; i < first + count; i += 8)
+    {
+        const __m256 e1x = _mm256_loadu_ps(lanes.e1[0] + i), e1y = _mm256_loadu_ps(lanes.e1[1] + i), e1z = _mm256_loadu_ps(lanes.e1[2] + i);
+        const __m256 e2x = _mm256_loadu_ps(lanes.e2[0] + i), e2y = _mm256_loadu_ps(lanes.e2[1] + i), e2z = _mm256_loadu_ps(lanes.e2[2] + i);
+
+        const __m256 px = _mm256_fmsub_ps(dy, e2z, _mm256_mul_ps(dz, e2y));
+        const __m256 py = _mm256_fmsub_ps(dz, e2x, _mm256_mul_ps(dx, e2z));
+        const __m256 pz = _mm256_fmsub_ps(dx, e2y, _mm256_mul_ps(dy, e2x));
+        const __m256 det = _mm256_fmadd_ps(e1z, pz, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1x, px)));
+        const __m256 inverse = _mm256_div_ps(one, det);
+
+        const __m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(lanes.v0[0] + i));
+        const __m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(lanes.v0[1] + i));
+        const __m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(lanes.v0[2] + i));
+        const __m256 u = _mm256_mul_ps(_mm256_fmadd_ps(sz, pz, _mm256_fmadd_ps(sy, py, _mm256_mul_ps(sx, px))), inverse);
+
+        const __m256 qx = _mm256_fmsub_ps(sy, e1z, _mm256_mul_ps(sz, e1y));
+        const __m256 qy = _mm256_fmsub_ps(sz, e1x, _mm256_mul_ps(sx, e1z));
+        const __m256 qz = _mm256_fmsub_ps(sx, e1y, _mm256_mul_ps(sy, e1x));
+        const __m256 v = _mm256_mul_ps(_mm256_fmadd_ps(dz, qz, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dx, qx))), inverse);
+        const __m256 t = _mm256_mul_ps(_mm256_fmadd_ps(e2z, qz, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2x, qx))), inverse);
+
+        __m256 mask = _mm256_cmp_ps(_mm256_andnot_ps(signBit, det), epsilon, _CMP_GE_OQ);
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(distance), _CMP_LT_OQ));
+        int bits = _mm256_movemask_ps(mask);
+        if (bits == 0)
+            continue;
+
+        float ts[8];
+        _mm256_storeu_ps(ts, t);
+        for (int k = 0; k < 8; ++k)
+        {
+            if ((bits >> k) & 1 && ts[k] < distance)
+            {
+                distance = ts[k];
+                lane = i + k;
+                hit = true;
+            }
+        }
+    }
+    return hit;
+}
+#endif
+
+// A mesh's triangles under a Bvh whose leaves hold up to TriangleBvh::LANES of them, each leaf
+// one pass of the widest intersection kernel, for picking on meshes of any size
+class TriangleBvh
+{
+public:
+    enum : uint32_t { LANES = 8 };
+
+    TriangleBvh() : stride(0) {}
+
+    // Triangles from indexCount indices into vertices, whose first three floats are the
+    // position, floatsPerVertex floats apart
+    template <typename Index>
+    void Build(const float* vertices, size_t floatsPerVertex, const Index* indices, size_t indexCount)
+    {
+        const size_t count = indexCount / 3;
+        std::vector<Aabb> boxes(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const glm::vec3 a = position(vertices, floatsPerVertex, indices[i * 3]);
+            const glm::vec3 b = position(vertices, floatsPerVertex, indices[i * 3 + 1]);
+            const glm::vec3 c = position(vertices, floatsPerVertex, indices[i * 3 + 2]);
+            boxes[i].min = glm::min(glm::min(a, b), c);
+            boxes[i].max = glm::max(glm::max(a, b), c);
+        }
+        bvh.Build(boxes.data(), count, LANES);
+
+        // padded so the last leaf can be read a whole kernel width at a time
+        stride = count + LANES;
+        coordinates.assign(stride * 9, 0.0f);
+        for (size_t order = 0; order < count; ++order)
+        {
+            const uint32_t triangle = bvh.Primitive((uint32_t)order);
+            const glm::vec3 a = position(vertices, floatsPerVertex, indices[triangle * 3]);
+            const glm::vec3 e1 = position(vertices, floatsPerVertex, indices[triangle * 3 + 1]) - a;
+            const glm::vec3 e2 = position(vertices, floatsPerVertex, indices[triangle * 3 + 2]) - a;
+            for (int k = 0; k < 3; ++k)
+            {
+                coordinates[k * stride + order] = a[k];
+                coordinates[(3 + k) * stride + order] = e1[k];
+                coordinates[(6 + k) * stride + order] = e2[k];
+            }
+        }
+    }
+
+    // Nearest triangle along origin + t * direction for t in [0, distance]; on a hit, returns
+    // true with distance and triangle (its index in the Build indices / 3) set
+    bool Raycast(const glm::vec3& origin, const glm::vec3& direction, float& distance, uint32_t& triangle,
+                 TriangleKernel kernel = TRIANGLES_BEST) const
+    {
+        typedef bool (*Intersect)(const TriangleLanes&, const glm::vec3&, const glm::vec3&, uint32_t, uint32_t, float&, uint32_t&);
+        Intersect intersect = intersectTrianglesScalar;
+#ifdef CPU_X86_SIMD
+        if (kernel == TRIANGLES_SSE2 || (kernel == TRIANGLES_BEST && !cpuHasAVX2()))
+            intersect = intersectTrianglesSSE2;
+        if (kernel == TRIANGLES_AVX2 || (kernel == TRIANGLES_BEST && cpuHasAVX2()))
+            intersect = intersectTrianglesAVX2;
+#endif
+
+        const TriangleLanes lanes = Lanes();
+        uint32_t lane = 0;
+        const bool hit = bvh.RaycastLeaves(origin, direction, distance, [&](uint32_t first, uint32_t count, float& limit)
+        {
+            return intersect(lanes, origin, direction, first, count, limit, lane);
+        });
+        if (hit)
+            triangle = bvh.Primitive(lane);
+        return hit;
+    }
+
+    size_t TriangleCount() const { return bvh.Count(); }
+
+    // Every triangle in leaf order, for checking the Bvh against a test of them all
+    TriangleLanes Lanes() const
+    {
+        TriangleLanes lanes;
+        for (int k = 0; k < 3; ++k)
+        {
+            lanes.v0[k] = coordinates.data() + k * stride;
+            lanes.e1[k] = coordinates.data() + (3 + k) * stride;
+            lanes.e2[k] = coordinates.data() + (6 + k) * stride;
+        }
+        return lanes;
+    }
+
+    // The triangle at a position in leaf order
+    uint32_t Triangle(uint32_t order) const { return bvh.Primitive(order); }
+
+private:
+    template <typename Index>
+    static glm::vec3 position(const float* vertices, size_t floatsPerVertex, Index index)
+    {
+        const float* v = vertices + (size_t)index * floatsPerVertex;
+        return glm::vec3(v[0], v[1], v[2]);
+    }
+
+    Bvh bvh;
+    std::vector<float> coordinates; // v0, e1 and e2, x, y and z of each, stride floats apart
+    size_t stride;
+};
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef VERTEX_FORMAT_H
+#define VERTEX_FORMAT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// The scene's vertex as authored: 3 float position, 3 float normal, 2 float UV (32 bytes)
+const size_t FLOATS_PER_VERTEX = 8;
+
+// The same vertex in 16 bytes. Positions are packed in mesh space, before the transform table's
+// scale, and every mesh lies within one unit of its origin (the unit box, radius-1 cylinders), so
+// three half floats round them by at most 2^-12 of a unit (--check-vertex-packing reports about
+// 2e-4) without a per-mesh scale to carry around. The normal is GL_INT_2_10_10_10_REV: the
+// authored normals are not all unit length and the shader normalises after transforming, so the
+// components are stored as they are rather than octahedrally. The UV is unorm16, so it must lie
+// in [0, 1].
+struct PackedVertex
+{
+    uint16_t position[3]; // GL_HALF_FLOAT
+    uint16_t pad;
+    uint32_t normal;      // GL_INT_2_10_10_10_REV, normalised
+    uint16_t uv[2];       // GL_UNSIGNED_SHORT, normalised
+};
+static_assert(sizeof(PackedVertex) == 16, "PackedVertex must stay 16 bytes");
+
+// IEEE 754 binary16, rounded to nearest even; out of range values become infinity
+inline uint16_t floatToHalf(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    const uint32_t magnitude = bits & 0x7FFFFFFF;
+
+    if (magnitude >= 0x7F800000) // infinity or NaN
+        return sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0);
+    if (magnitude >= 0x477FF000) // rounds past 65504
+        return sign | 0x7C00;
+    if (magnitude < 0x38800000) // subnormal half, or zero
+    {
+        if (magnitude < 0x33000000)
+            return sign;
+        const uint32_t shift = 126 - (magnitude >> 23);
+        const uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            ++half;
+        return sign | (uint16_t)half;
+    }
+
+    // rebias the exponent and round the 13 dropped mantissa bits; a carry bumps the exponent
+    uint32_t half = (magnitude - 0x38000000) >> 13;
+    const uint32_t rest = magnitude & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        ++half;
+    return sign | (uint16_t)half;
+}
+
+inline float halfToFloat(uint16_t half)
+{
+    const uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    const uint32_t exponent = (half >> 10) & 0x1F;
+    const uint32_t mantissa = half & 0x3FF;
+    float value;
+    if (exponent == 0)
+        value = std::ldexp((float)mantissa, -24);
+    else if (exponent == 31)
+        value = mantissa ? NAN : INFINITY;
+    else
+        value = std::ldexp((float)(mantissa | 0x400), (int)exponent - 25);
+    return sign ? -value : value;
+}
+
+// x, y and z as signed normalised 10-bit fields, w = 0
+inline uint32_t packSnorm1010102(float x, float y, float z)
+{
+    auto field = [](float v)
+    {
+        const int q = (int)std::lround(std::min(std::max(v, -1.0f), 1.0f) * 511.0f);
+        return (uint32_t)q & 0x3FF;
+    };
+    return field(x) | (field(y) << 10) | (field(z) << 20);
+}
+
+// GL's rule for normalised signed fields: max(q / 511, -1)
+inline void unpackSnorm1010102(uint32_t packed, float out[3])
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        int q = (int)((packed >> (10 * i)) & 0x3FF);
+        if (q & 0x200)
+            q -= 0x400;
+        out[i] = std::max((float)q / 511.0f, -1.0f);
+    }
+}
+
+inline uint16_t packUnorm16(float v)
+{
+    return (uint16_t)std::lround(std::min(std::max(v, 0.0f), 1.0f) * 65535.0f);
+}
+
+inline float unpackUnorm16(uint16_t q)
+{
+    return (float)q / 65535.0f;
+}
+
+// Packs count authored vertices (FLOATS_PER_VERTEX floats each)
+inline void packVertices(const float* vertices, size_t count, PackedVertex* packed)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const float* v = vertices + i * FLOATS_PER_VERTEX;
+        PackedVertex& p = packed[i];
+        for (int k = 0; k < 3; ++k)
+            p.position[k] = floatToHalf(v[k]);
+        p.pad = 0;
+        p.normal = packSnorm1010102(v[3], v[4], v[5]);
+        p.uv[0] = packUnorm16(v[6]);
+        p.uv[1] = packUnorm16(v[7]);
+    }
+}
+
+// Largest per-component difference between the authored vertices and what the GPU reads back
+// from their packed form
+struct VertexPackingError
+{
+    float position;
+    float normal;
+    float uv;
+};
+
+inline VertexPackingError measurePackingError(const float* vertices, size_t count)
+{
+    VertexPackingError error = { 0.0f, 0.0f, 0.0f };
+    for (size_t i = 0; i < count; ++i)
+    {
+        const float* v = vertices + i * FLOATS_PER_VERTEX;
+        PackedVertex p;
+        packVertices(v, 1, &p);
+
+        float normal[3];
+        unpackSnorm1010102(p.normal, normal);
+        for (int k = 0; k < 3; ++k)
+        {
+            error.position = std::max(error.position, std::fabs(halfToFloat(p.position[k]) - v[k]));
+            error.normal = std::max(error.normal, std::fabs(normal[k] - v[3 + k]));
+        }
+        for (int k = 0; k < 2; ++k)
+            error.uv = std::max(error.uv, std::fabs(unpackUnorm16(p.uv[k]) - v[6 + k]));
+    }
+    return error;
+}
+
+#endif